@@ -140,6 +140,7 @@ private:
     {
         if (_tokens.equals(0, "tile:") ||
             _tokens.equals(0, "tilecombine:") ||
+            _tokens.equals(0, "tilebin:") ||
             _tokens.equals(0, "renderfont:") ||
             _tokens.equals(0, "windowpaint:"))
         {
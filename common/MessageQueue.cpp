@@ -9,6 +9,7 @@
 
 #include "MessageQueue.hpp"
 #include <climits>
+#include <cstring>
 #include <algorithm>
 
 #include <Poco/JSON/JSON.h>
@@ -19,118 +20,287 @@
 #include "Log.hpp"
 #include <TileDesc.hpp>
 
+namespace {
+
+/// Remove seq from the ordered sequence numbers.
+void eraseSeq(std::deque<std::uint64_t>& seqs, std::uint64_t seq)
+{
+    const auto it = std::lower_bound(seqs.begin(), seqs.end(), seq);
+    assert(it != seqs.end() && *it == seq);
+    seqs.erase(it);
+}
+
+}
+
+TileQueue::TileQueue()
+    : _latencyTargets{ { std::chrono::milliseconds(10), std::chrono::milliseconds(50),
+                         std::chrono::milliseconds(20), std::chrono::milliseconds(500),
+                         std::chrono::milliseconds(2000) } }
+    , _maxInvalidationRects(8)
+{
+    const char* max = std::getenv("LOOL_INVALIDATION_MAX_RECTS");
+    if (max)
+        _maxInvalidationRects = std::max(1, std::atoi(max));
+
+    // In ms, in the order of the classes of work.
+    const char* latency = std::getenv("LOOL_QUEUE_LATENCY_MS");
+    if (latency)
+    {
+        const StringVector targets = Util::tokenize(latency, std::strlen(latency), ',');
+        for (std::size_t i = 0; i < targets.size() && i < _latencyTargets.size(); ++i)
+        {
+            int target = 0;
+            if (LOOLProtocol::stringToInteger(targets[i], target) && target >= 0)
+                _latencyTargets[i] = std::chrono::milliseconds(target);
+        }
+    }
+}
+
 void TileQueue::put_impl(const Payload& value)
 {
-    const std::string msg = std::string(value.data(), value.size());
+    compact();
+
     const std::string firstToken = LOOLProtocol::getFirstToken(value);
 
     if (firstToken == "canceltiles")
     {
-        LOG_TRC("Processing [" << LOOLProtocol::getAbbreviatedMessage(msg) << "]. Before canceltiles have " << getQueue().size() << " in queue.");
-        const std::string seqs = msg.substr(12);
-        StringVector tokens(Util::tokenize(seqs, ','));
-        getQueue().erase(std::remove_if(getQueue().begin(), getQueue().end(),
-                [&tokens](const Payload& v)
-                {
-                    const std::string s(v.data(), v.size());
-                    // Tile is for a thumbnail, don't cancel it
-                    if (s.find("id=") != std::string::npos)
-                        return false;
-                    for (size_t i = 0; i < tokens.size(); ++i)
-                    {
-                        if (s.find("ver=" + tokens[i]) != std::string::npos)
-                        {
-                            LOG_TRC("Matched " << tokens[i] << ", Removing [" << s << ']');
-                            return true;
-                        }
-                    }
-
-                    return false;
-
-                }), getQueue().end());
+        LOG_TRC("Processing [" << LOOLProtocol::getAbbreviatedMessage(value) << "]. Before canceltiles have " << _size << " in queue.");
+        if (value.size() > 12)
+            cancelTiles(Util::tokenize(value.data() + 12, value.size() - 12, ','));
 
         // Don't push canceltiles into the queue.
-        LOG_TRC("After canceltiles have " << getQueue().size() << " in queue.");
+        LOG_TRC("After canceltiles have " << _size << " in queue.");
         return;
     }
     else if (firstToken == "tilecombine")
     {
         // Breakup tilecombine and deduplicate (we are re-combining the tiles
         // in the get_impl() again)
-        const TileCombined tileCombined = TileCombined::parse(msg);
+        const TileCombined tileCombined = TileCombined::parse(std::string(value.data(), value.size()));
         for (auto& tile : tileCombined.getTiles())
         {
-            const std::string newMsg = tile.serialize("tile");
+            removeTileDuplicate(tile);
 
-            removeTileDuplicate(newMsg);
-
-            MessageQueue::put_impl(Payload(newMsg.data(), newMsg.data() + newMsg.size()));
+            push(Payload(), std::unique_ptr<TileDesc>(new TileDesc(tile)));
         }
         return;
     }
     else if (firstToken == "tile")
     {
-        removeTileDuplicate(msg);
+        std::unique_ptr<TileDesc> tile(new TileDesc(TileDesc::parse(std::string(value.data(), value.size()))));
+
+        removeTileDuplicate(*tile);
 
-        MessageQueue::put_impl(value);
+        // Only previews are sent back as they came, other tiles are serialized
+        // again when combining.
+        Payload message = tile->getId() >= 0 ? value : Payload();
+        push(std::move(message), std::move(tile));
         return;
     }
     else if (firstToken == "callback")
     {
-        const std::string newMsg = removeCallbackDuplicate(msg);
+        std::unique_ptr<Callback> callback = Callback::parse(std::string(value.data(), value.size()));
+        if (!callback)
+        {
+            LOG_ERR("Invalid callback message: [" << LOOLProtocol::getAbbreviatedMessage(value) << "].");
+            return;
+        }
+
+        removeCallbackDuplicate(*callback);
+        push(Payload(), nullptr, std::move(callback));
+        return;
+    }
+
+    push(value);
+}
+
+void TileQueue::push(Payload message, std::unique_ptr<TileDesc> tile,
+                     std::unique_ptr<Callback> callback)
+{
+    push(Entry(std::move(message), std::move(tile), std::move(callback),
+               std::chrono::steady_clock::now()));
+}
+
+void TileQueue::push(Entry entry)
+{
+    const std::uint64_t seq = _frontSeq + _entries.size();
+    if (entry._tile)
+    {
+        _tileIndex[TileKey(*entry._tile)] = seq;
+
+        // Tile is for a thumbnail, never cancelled.
+        if (entry._tile->getId() < 0 && entry._tile->getVersion() >= 0)
+            _versionIndex.emplace(entry._tile->getVersion(), seq);
+
+        // Nor combined.
+        if (!entry.isPreview())
+        {
+            _rowIndex[rowKey(*entry._tile, entry._tile->getTilePosY())].push_back(seq);
+
+            if (!entry._tile->getPrefetch())
+            {
+                entry._priority = priority(*entry._tile);
+                if (entry._priority >= 0)
+                    _inputTiles[entry._priority].push_back(seq);
+            }
+        }
+    }
+    else if (entry._callback && entry._callback->isInvalidation())
+        _regionIndex[entry._callback->getRegionKey()] = seq;
+    else
+        _regionBarrierSeq = seq + 1;
+
+    _classQueues[static_cast<std::size_t>(entry.getQueueClass())].push_back(seq);
+    _size += (entry._callback ? entry._callback->count() : 1);
+    _entries.push_back(std::move(entry));
+}
+
+std::unique_ptr<TileQueue::Callback> TileQueue::remove(std::size_t pos)
+{
+    Entry& entry = _entries[pos];
+    assert(!entry._removed && "Removing a removed entry.");
+
+    if (entry.isTile())
+    {
+        const std::uint64_t seq = _frontSeq + pos;
+        const auto it = _tileIndex.find(TileKey(*entry._tile));
+        if (it != _tileIndex.end() && it->second == seq)
+            _tileIndex.erase(it);
 
-        if (newMsg.empty())
+        const auto range = _versionIndex.equal_range(entry._tile->getVersion());
+        for (auto versionIt = range.first; versionIt != range.second; ++versionIt)
         {
-            MessageQueue::put_impl(value);
+            if (versionIt->second == seq)
+            {
+                _versionIndex.erase(versionIt);
+                break;
+            }
         }
-        else
+
+        if (!entry.isPreview())
         {
-            MessageQueue::put_impl(Payload(newMsg.data(), newMsg.data() + newMsg.size()));
+            const auto row = _rowIndex.find(rowKey(*entry._tile, entry._tile->getTilePosY()));
+            assert(row != _rowIndex.end());
+            eraseSeq(row->second, seq);
+            if (row->second.empty())
+                _rowIndex.erase(row);
         }
 
-        return;
+        if (entry._priority >= 0)
+            eraseSeq(_inputTiles[entry._priority], seq);
+    }
+
+    std::unique_ptr<Callback> callback = std::move(entry._callback);
+    if (callback && callback->isInvalidation())
+    {
+        const auto it = _regionIndex.find(callback->getRegionKey());
+        if (it != _regionIndex.end() && it->second == _frontSeq + pos)
+            _regionIndex.erase(it);
     }
 
-    MessageQueue::put_impl(value);
+    entry._removed = true;
+    entry._message = Payload();
+    entry._tile.reset();
+    _size -= (callback ? callback->count() : 1);
+    return callback;
 }
 
-void TileQueue::removeTileDuplicate(const std::string& tileMsg)
+void TileQueue::compact()
 {
-    assert(LOOLProtocol::matchPrefix("tile", tileMsg, /*ignoreWhitespace*/ true));
+    while (!_entries.empty() && _entries.front()._removed)
+    {
+        _entries.pop_front();
+        ++_frontSeq;
+    }
+
+    // Removing from the middle leaves holes; once they outnumber the messages
+    // squeeze them out, which also renumbers the tiles.
+    if (_entries.size() < 64 || _entries.size() < 2 * _size)
+        return;
 
+    std::deque<Entry> entries;
+    entries.swap(_entries);
+    _frontSeq = 0;
+    _size = 0;
+    _tileIndex.clear();
+    _versionIndex.clear();
+    _regionIndex.clear();
+    _regionBarrierSeq = 0;
+    for (std::deque<std::uint64_t>& queue : _classQueues)
+        queue.clear();
+    for (std::deque<std::uint64_t>& queue : _inputTiles)
+        queue.clear();
+    _rowIndex.clear();
+
+    for (Entry& entry : entries)
+    {
+        if (!entry._removed)
+            push(std::move(entry));
+    }
+}
+
+void TileQueue::clear_impl()
+{
+    _entries.clear();
+    for (std::deque<std::uint64_t>& queue : _classQueues)
+        queue.clear();
+    for (std::deque<std::uint64_t>& queue : _inputTiles)
+        queue.clear();
+    _rowIndex.clear();
+    _tileIndex.clear();
+    _versionIndex.clear();
+    _regionIndex.clear();
+    _regionBarrierSeq = 0;
+    _frontSeq = 0;
+    _size = 0;
+}
+
+void TileQueue::removeTileDuplicate(const TileDesc& tile)
+{
     // Ver is always provided at this point and it is necessary to
     // return back to clients the last rendered version of a tile
     // in case there are new invalidations and requests while rendering.
     // Here we compare duplicates without 'ver' since that's irrelevant.
-    size_t newMsgPos = tileMsg.find(" ver");
-    if (newMsgPos == std::string::npos)
+    const auto it = _tileIndex.find(TileKey(tile));
+    if (it != _tileIndex.end())
     {
-        newMsgPos = tileMsg.size() - 1;
+        const std::size_t pos = it->second - _frontSeq;
+        LOG_TRC("Remove duplicate tile request: " << _entries[pos]._tile->serialize("tile") << " -> " << tile.serialize("tile"));
+        remove(pos);
     }
+}
 
-    for (size_t i = 0; i < getQueue().size(); ++i)
+void TileQueue::cancelTiles(const StringVector& versions)
+{
+    std::vector<std::uint64_t> seqs;
+    for (std::size_t i = 0; i < versions.size(); ++i)
     {
-        auto& it = getQueue()[i];
-        if (it.size() > newMsgPos &&
-            strncmp(tileMsg.data(), it.data(), newMsgPos) == 0)
+        int version = 0;
+        if (!LOOLProtocol::stringToInteger(versions[i], version))
+            continue;
+
+        // Collect first, removing updates the index.
+        seqs.clear();
+        const auto range = _versionIndex.equal_range(version);
+        for (auto it = range.first; it != range.second; ++it)
+            seqs.push_back(it->second);
+
+        for (const std::uint64_t seq : seqs)
         {
-            LOG_TRC("Remove duplicate tile request: " << std::string(it.data(), it.size()) << " -> " << LOOLProtocol::getAbbreviatedMessage(tileMsg));
-            getQueue().erase(getQueue().begin() + i);
-            break;
+            const std::size_t pos = seq - _frontSeq;
+            LOG_TRC("Matched " << version << ", Removing [" << _entries[pos]._tile->serialize("tile") << ']');
+            remove(pos);
         }
     }
 }
 
 namespace {
 
-/// Read the viewId from the tokens.
-std::string extractViewId(const std::string& origMsg, const StringVector& tokens)
+/// Read the viewId from the JSON payload.
+std::string extractViewId(const std::string& payload)
 {
-    size_t nonJson = tokens[0].size() + tokens[1].size() + tokens[2].size() + 3; // including spaces
-    std::string jsonString(origMsg.data() + nonJson, origMsg.size() - nonJson);
-
     Poco::JSON::Parser parser;
-    const Poco::Dynamic::Var result = parser.parse(jsonString);
+    const Poco::Dynamic::Var result = parser.parse(payload);
     const auto& json = result.extract<Poco::JSON::Object::Ptr>();
     return json->get("viewId").toString();
 }
@@ -148,210 +318,293 @@ std::string extractUnoCommand(const std::string& command)
     return command;
 }
 
-/// Extract rectangle from the invalidation callback
-bool extractRectangle(const StringVector& tokens, int& x, int& y, int& w, int& h, int& part)
+/// Extract rectangle from the invalidation callback payload, followed by
+/// the part.
+bool extractRectangle(const StringVector& tokens, int& x, int& y, int& w, int& h)
 {
     x = 0;
     y = 0;
     w = INT_MAX;
     h = INT_MAX;
-    part = 0;
 
-    if (tokens.size() < 5)
+    if (tokens.size() < 2)
         return false;
 
-    if (tokens.equals(3, "EMPTY,"))
-    {
-        part = std::atoi(tokens[4].c_str());
+    if (tokens.equals(0, "EMPTY,"))
         return true;
-    }
 
-    if (tokens.size() < 8)
+    if (tokens.size() < 5)
         return false;
 
-    x = std::atoi(tokens[3].c_str());
-    y = std::atoi(tokens[4].c_str());
-    w = std::atoi(tokens[5].c_str());
-    h = std::atoi(tokens[6].c_str());
-    part = std::atoi(tokens[7].c_str());
+    x = std::atoi(tokens[0].c_str());
+    y = std::atoi(tokens[1].c_str());
+    w = std::atoi(tokens[2].c_str());
+    h = std::atoi(tokens[3].c_str());
 
     return true;
 }
 
+/// Whether the rectangle is the whole part, as invalidated by 'EMPTY'.
+bool isEverything(const Util::Rectangle& rectangle)
+{
+    return rectangle.getLeft() <= 0 && rectangle.getTop() <= 0
+           && rectangle.getRight() == INT_MAX && rectangle.getBottom() == INT_MAX;
+}
+
+bool covers(const Util::Rectangle& outer, const Util::Rectangle& inner)
+{
+    return outer.getLeft() <= inner.getLeft() && inner.getRight() <= outer.getRight()
+           && outer.getTop() <= inner.getTop() && inner.getBottom() <= outer.getBottom();
 }
 
-std::string TileQueue::removeCallbackDuplicate(const std::string& callbackMsg)
+/// Whether the rectangles overlap or touch.
+bool touches(const Util::Rectangle& a, const Util::Rectangle& b)
 {
-    assert(LOOLProtocol::matchPrefix("callback", callbackMsg, /*ignoreWhitespace*/ true));
+    return a.getLeft() <= b.getRight() && b.getLeft() <= a.getRight()
+           && a.getTop() <= b.getBottom() && b.getTop() <= a.getBottom();
+}
 
-    StringVector tokens = Util::tokenize(callbackMsg);
+std::int64_t area(const Util::Rectangle& rectangle)
+{
+    return static_cast<std::int64_t>(rectangle.getWidth()) * rectangle.getHeight();
+}
 
+}
+
+TileQueue::Callback::Callback(int view, int type, std::string payload, std::string viewId)
+    : _view(view)
+    , _exceptView(-1)
+    , _type(type)
+    , _payload(std::move(payload))
+    , _viewId(std::move(viewId))
+{
+    switch (static_cast<LibreOfficeKitCallbackType>(_type))
+    {
+        case LOK_CALLBACK_INVALIDATE_TILES:
+        {
+            const StringVector tokens = Util::tokenize(_payload);
+            int x, y, w, h;
+            if (extractRectangle(tokens, x, y, w, h))
+            {
+                const std::size_t part = (tokens.equals(0, "EMPTY,") ? 1 : 4);
+                _regionSuffix = _payload.substr(tokens.begin()[part]._index);
+                _region.emplace_back(x, y, w, h);
+            }
+        }
+        break;
+
+        case LOK_CALLBACK_STATE_CHANGED:
+            _unoCommand = extractUnoCommand(_payload.substr(0, _payload.find(' ')));
+        break;
+
+        case LOK_CALLBACK_INVALIDATE_VIEW_CURSOR:
+        case LOK_CALLBACK_CELL_VIEW_CURSOR:
+        case LOK_CALLBACK_VIEW_CURSOR_VISIBLE:
+            if (_viewId.empty())
+                _viewId = extractViewId(_payload);
+        break;
+
+        default:
+        break;
+    }
+}
+
+std::unique_ptr<TileQueue::Callback> TileQueue::Callback::parse(const std::string& message)
+{
+    // the message is "callback <view> <type> <payload>"
+    const StringVector tokens = Util::tokenize(message);
     if (tokens.size() < 3)
-        return std::string();
+        return nullptr;
 
-    // the message is "callback <view> <id> ..."
-    const auto pair = Util::i32FromString(tokens[2]);
-    if (!pair.second)
-        return std::string();
+    int view = -1;
+    int exceptView = -1;
+    if (LOOLProtocol::matchPrefix("except-", tokens[1]))
+    {
+        if (!LOOLProtocol::stringToInteger(tokens[1].substr(7), exceptView))
+            return nullptr;
+    }
+    else if (!tokens.equals(1, "all") && !LOOLProtocol::stringToInteger(tokens[1], view))
+        return nullptr;
+
+    const auto type = Util::i32FromString(tokens[2]);
+    if (!type.second)
+        return nullptr;
+
+    // payload is the rest of the message
+    const std::size_t offset = tokens[0].size() + tokens[1].size() + tokens[2].size() + 3; // + delims
+    std::unique_ptr<Callback> callback(new Callback(
+        view, type.first, offset < message.size() ? message.substr(offset) : std::string()));
+    callback->_exceptView = exceptView;
+    return callback;
+}
 
-    const auto callbackType = static_cast<LibreOfficeKitCallbackType>(pair.first);
+std::string TileQueue::Callback::serialize() const
+{
+    std::string target;
+    if (_view >= 0)
+        target = std::to_string(_view);
+    else if (_exceptView >= 0)
+        target = "except-" + std::to_string(_exceptView);
+    else
+        target = "all";
+
+    return "callback " + target + ' ' + std::to_string(_type) + ' ' + _payload;
+}
 
-    switch (callbackType)
+void TileQueue::Callback::addToRegion(Util::Rectangle rectangle, std::size_t maxRects)
+{
+    for (const Util::Rectangle& queued : _region)
     {
-        case LOK_CALLBACK_INVALIDATE_TILES: // invalidation
+        if (covers(queued, rectangle))
+            return;
+    }
+
+    // Absorb what the rectangle covers, or can be merged with: when they
+    // touch, and their bounding box is small or mostly them.
+    const int reasonableSizeX = 4 * 3840; // 4x tile at 100% zoom
+    const int reasonableSizeY = 2 * 3840; // 2x tile at 100% zoom
+    bool merged = true;
+    while (merged)
+    {
+        merged = false;
+        for (auto it = _region.begin(); it != _region.end(); ++it)
         {
-            int msgX, msgY, msgW, msgH, msgPart;
+            if (!touches(*it, rectangle))
+                continue;
+
+            Util::Rectangle join = rectangle;
+            join.extend(*it);
+            if (covers(rectangle, *it)
+                || (join.getWidth() <= reasonableSizeX && join.getHeight() <= reasonableSizeY)
+                || area(join) <= area(rectangle) + area(*it))
+            {
+                rectangle = join;
+                _region.erase(it);
+                merged = true;
+                break;
+            }
+        }
+    }
 
-            if (!extractRectangle(tokens, msgX, msgY, msgW, msgH, msgPart))
-                return std::string();
+    _region.push_back(rectangle);
 
-            bool performedMerge = false;
+    if (_region.size() > maxRects)
+    {
+        Util::Rectangle bounds;
+        for (Util::Rectangle& queued : _region)
+            bounds.extend(queued);
 
-            // we always travel the entire queue
-            std::size_t i = 0;
-            while (i < getQueue().size())
-            {
-                auto& it = getQueue()[i];
+        _region.assign(1, bounds);
+    }
+}
 
-                StringVector queuedTokens = Util::tokenize(it.data(), it.size());
-                if (queuedTokens.size() < 3)
-                {
-                    ++i;
-                    continue;
-                }
+std::unique_ptr<TileQueue::Callback> TileQueue::Callback::takeFirstRectangle()
+{
+    std::unique_ptr<Callback> callback(new Callback(*this));
+    callback->_region.assign(1, _region.front());
+    callback->updatePayload();
 
-                // not a invalidation callback
-                if (queuedTokens[0] != tokens[0] || queuedTokens[1] != tokens[1]
-                    || queuedTokens[2] != tokens[2])
-                {
-                    ++i;
-                    continue;
-                }
+    _region.erase(_region.begin());
+    return callback;
+}
 
-                int queuedX, queuedY, queuedW, queuedH, queuedPart;
+void TileQueue::Callback::updatePayload()
+{
+    assert(_region.size() == 1);
 
-                if (!extractRectangle(queuedTokens, queuedX, queuedY, queuedW, queuedH, queuedPart))
-                {
-                    ++i;
-                    continue;
-                }
+    const Util::Rectangle& rectangle = _region.front();
+    if (isEverything(rectangle))
+    {
+        _payload = "EMPTY, " + _regionSuffix;
+        return;
+    }
 
-                if (msgPart != queuedPart)
-                {
-                    ++i;
-                    continue;
-                }
+    _payload = std::to_string(rectangle.getLeft()) + ", " + std::to_string(rectangle.getTop()) + ", "
+               + std::to_string(rectangle.getWidth()) + ", " + std::to_string(rectangle.getHeight())
+               + ", " + _regionSuffix;
+}
 
-                // the invalidation in the queue is fully covered by the message,
-                // just remove it
-                if (msgX <= queuedX && queuedX + queuedW <= msgX + msgW && msgY <= queuedY
-                    && queuedY + queuedH <= msgY + msgH)
-                {
-                    LOG_TRC("Removing smaller invalidation: "
-                            << std::string(it.data(), it.size()) << " -> " << tokens[0] << ' '
-                            << tokens[1] << ' ' << tokens[2] << ' ' << msgX << ' ' << msgY << ' '
-                            << msgW << ' ' << msgH << ' ' << msgPart);
-
-                    // remove from the queue
-                    getQueue().erase(getQueue().begin() + i);
-                    continue;
-                }
+void TileQueue::putCallback(int view, int type, std::string payload, std::string viewId)
+{
+    compact();
 
-                // the invalidation just intersects, join those (if the result is
-                // small)
-                if (TileDesc::rectanglesIntersect(msgX, msgY, msgW, msgH, queuedX, queuedY, queuedW,
-                                                  queuedH))
-                {
-                    int joinX = std::min(msgX, queuedX);
-                    int joinY = std::min(msgY, queuedY);
-                    int joinW = std::max(msgX + msgW, queuedX + queuedW) - joinX;
-                    int joinH = std::max(msgY + msgH, queuedY + queuedH) - joinY;
-
-                    const int reasonableSizeX = 4 * 3840; // 4x tile at 100% zoom
-                    const int reasonableSizeY = 2 * 3840; // 2x tile at 100% zoom
-                    if (joinW > reasonableSizeX || joinH > reasonableSizeY)
-                    {
-                        ++i;
-                        continue;
-                    }
-
-                    LOG_TRC("Merging invalidations: "
-                            << std::string(it.data(), it.size()) << " and " << tokens[0] << ' '
-                            << tokens[1] << ' ' << tokens[2] << ' ' << msgX << ' ' << msgY << ' '
-                            << msgW << ' ' << msgH << ' ' << msgPart << " -> " << tokens[0] << ' '
-                            << tokens[1] << ' ' << tokens[2] << ' ' << joinX << ' ' << joinY << ' '
-                            << joinW << ' ' << joinH << ' ' << msgPart);
-
-                    msgX = joinX;
-                    msgY = joinY;
-                    msgW = joinW;
-                    msgH = joinH;
-                    performedMerge = true;
-
-                    // remove from the queue
-                    getQueue().erase(getQueue().begin() + i);
-                    continue;
-                }
+    std::unique_ptr<Callback> callback(new Callback(view, type, std::move(payload), std::move(viewId)));
+    removeCallbackDuplicate(*callback);
+    push(Payload(), nullptr, std::move(callback));
+}
 
-                ++i;
-            }
+std::unique_ptr<TileQueue::Callback> TileQueue::popCallback()
+{
+    compact();
 
-            if (performedMerge)
-            {
-                std::size_t pre = tokens[0].size() + tokens[1].size() + tokens[2].size() + 3;
-                std::size_t post = pre + tokens[3].size() + tokens[4].size() + tokens[5].size()
-                              + tokens[6].size() + 4;
+    WorkClass workClass;
+    std::uint64_t seq;
+    if (!schedule(workClass, seq) || !_entries[seq - _frontSeq]._callback)
+        return nullptr;
 
-                std::string result = callbackMsg.substr(0, pre) + std::to_string(msgX) + ", "
-                                     + std::to_string(msgY) + ", " + std::to_string(msgW) + ", "
-                                     + std::to_string(msgH) + ", " + callbackMsg.substr(post);
+    served(workClass, _entries[seq - _frontSeq]._queued, std::chrono::steady_clock::now());
+    return takeCallback(seq - _frontSeq);
+}
 
-                LOG_TRC("Merge result: " << result);
+std::unique_ptr<TileQueue::Callback> TileQueue::takeCallback(std::size_t pos)
+{
+    Callback& queued = *_entries[pos]._callback;
+    if (queued.count() > 1)
+    {
+        // The rest of the region stays queued.
+        --_size;
+        return queued.takeFirstRectangle();
+    }
 
-                return result;
-            }
+    std::unique_ptr<Callback> callback = remove(pos);
+    if (callback->isInvalidation())
+        callback->updatePayload();
+
+    return callback;
+}
+
+void TileQueue::removeCallbackDuplicate(Callback& callback)
+{
+    switch (static_cast<LibreOfficeKitCallbackType>(callback._type))
+    {
+        case LOK_CALLBACK_INVALIDATE_TILES: // invalidation
+        {
+            if (!callback.isInvalidation())
+                return;
+
+            // Take over the region of the part, unless some other callback
+            // was queued since, which has to be dispatched after it.
+            const auto it = _regionIndex.find(callback.getRegionKey());
+            if (it == _regionIndex.end() || it->second < _regionBarrierSeq)
+                return;
+
+            const std::unique_ptr<Callback> queued = remove(it->second - _frontSeq);
+            const Util::Rectangle rectangle = callback._region.front();
+            callback._region = std::move(queued->_region);
+            callback.addToRegion(rectangle, _maxInvalidationRects);
+
+            LOG_TRC("Invalidated region of " << callback.serialize() << " now has "
+                                             << callback._region.size() << " rectangles.");
         }
         break;
 
         case LOK_CALLBACK_STATE_CHANGED: // state changed
         {
-            if (tokens.size() < 4)
-                return std::string();
-
-            std::string unoCommand = extractUnoCommand(tokens[3]);
-            if (unoCommand.empty())
-                return std::string();
-
             // This is needed because otherwise it creates some problems when
             // a save occurs while a cell is still edited in Calc.
-            if (unoCommand == ".uno:ModifiedStatus")
-                return std::string();
+            if (callback._unoCommand.empty() || callback._unoCommand == ".uno:ModifiedStatus")
+                return;
 
             // remove obsolete states of the same .uno: command
-            for (std::size_t i = 0; i < getQueue().size(); ++i)
+            for (std::size_t i = 0; i < _entries.size(); ++i)
             {
-                auto& it = getQueue()[i];
-
-                StringVector queuedTokens = Util::tokenize(it.data(), it.size());
-                if (queuedTokens.size() < 4)
-                    continue;
-
-                if (queuedTokens[0] != tokens[0] || queuedTokens[1] != tokens[1]
-                    || queuedTokens[2] != tokens[2])
-                    continue;
-
-                // callback, the same target, state changed; now check it's
-                // the same .uno: command
-                std::string queuedUnoCommand = extractUnoCommand(queuedTokens[3]);
-                if (queuedUnoCommand.empty())
-                    continue;
-
-                if (unoCommand == queuedUnoCommand)
+                const Callback* queued = _entries[i]._callback.get();
+                if (queued && queued->sameTarget(callback)
+                    && queued->_unoCommand == callback._unoCommand)
                 {
-                    LOG_TRC("Remove obsolete uno command: "
-                            << std::string(it.data(), it.size()) << " -> "
-                            << LOOLProtocol::getAbbreviatedMessage(callbackMsg));
-                    getQueue().erase(getQueue().begin() + i);
+                    LOG_TRC("Remove obsolete uno command: " << queued->serialize() << " -> "
+                                                            << callback._unoCommand);
+                    remove(i);
                     break;
                 }
             }
@@ -367,53 +620,19 @@ std::string TileQueue::removeCallbackDuplicate(const std::string& callbackMsg)
         case LOK_CALLBACK_CELL_VIEW_CURSOR: // the view cell cursor has moved
         case LOK_CALLBACK_VIEW_CURSOR_VISIBLE: // the view cursor visibility has changed
         {
-            const bool isViewCallback = (callbackType == LOK_CALLBACK_INVALIDATE_VIEW_CURSOR
-                                         || callbackType == LOK_CALLBACK_CELL_VIEW_CURSOR
-                                         || callbackType == LOK_CALLBACK_VIEW_CURSOR_VISIBLE);
-
-            const std::string viewId
-                = (isViewCallback ? extractViewId(callbackMsg, tokens) : std::string());
-
-            for (std::size_t i = 0; i < getQueue().size(); ++i)
+            // For the view callbacks we additionally need to ensure that the
+            // payload is about the same viewId (otherwise we'd merge them all
+            // views into one); _viewId is empty for the others.
+            for (std::size_t i = 0; i < _entries.size(); ++i)
             {
-                const auto& it = getQueue()[i];
-
-                // skip non-callbacks quickly
-                if (!LOOLProtocol::matchPrefix("callback", it))
-                    continue;
-
-                StringVector queuedTokens = Util::tokenize(it.data(), it.size());
-                if (queuedTokens.size() < 3)
-                    continue;
-
-                if (!isViewCallback
-                    && (queuedTokens.equals(1, tokens, 1) && queuedTokens.equals(2, tokens, 2)))
+                const Callback* queued = _entries[i]._callback.get();
+                if (queued && queued->sameTarget(callback) && queued->_viewId == callback._viewId)
                 {
-                    LOG_TRC("Remove obsolete callback: "
-                            << std::string(it.data(), it.size()) << " -> "
-                            << LOOLProtocol::getAbbreviatedMessage(callbackMsg));
-                    getQueue().erase(getQueue().begin() + i);
+                    LOG_TRC("Remove obsolete callback: " << queued->serialize() << " -> "
+                                                         << LOOLProtocol::getAbbreviatedMessage(callback._payload));
+                    remove(i);
                     break;
                 }
-                else if (isViewCallback
-                         && (queuedTokens.equals(1, tokens, 1)
-                             && queuedTokens.equals(2, tokens, 2)))
-                {
-                    // we additionally need to ensure that the payload is about
-                    // the same viewid (otherwise we'd merge them all views into
-                    // one)
-                    const std::string queuedViewId
-                        = extractViewId(std::string(it.data(), it.size()), queuedTokens);
-
-                    if (viewId == queuedViewId)
-                    {
-                        LOG_TRC("Remove obsolete view callback: "
-                                << std::string(it.data(), it.size()) << " -> "
-                                << LOOLProtocol::getAbbreviatedMessage(callbackMsg));
-                        getQueue().erase(getQueue().begin() + i);
-                        break;
-                    }
-                }
             }
         }
         break;
@@ -422,17 +641,17 @@ std::string TileQueue::removeCallbackDuplicate(const std::string& callbackMsg)
         break;
 
     } // switch
-
-    return std::string();
 }
 
-int TileQueue::priority(const std::string& tileMsg)
+int TileQueue::priority(const TileDesc& tile) const
 {
-    TileDesc tile = TileDesc::parse(tileMsg); //FIXME: Expensive, avoid.
-
     for (int i = static_cast<int>(_viewOrder.size()) - 1; i >= 0; --i)
     {
-        auto& cursor = _cursorPositions[_viewOrder[i]];
+        const auto it = _cursorPositions.find(_viewOrder[i]);
+        if (it == _cursorPositions.end())
+            continue;
+
+        const CursorPosition& cursor = it->second;
         if (tile.intersectsWithRect(cursor.getX(), cursor.getY(), cursor.getWidth(),
                                     cursor.getHeight()))
             return i;
@@ -441,122 +660,200 @@ int TileQueue::priority(const std::string& tileMsg)
     return -1;
 }
 
-void TileQueue::deprioritizePreviews()
+void TileQueue::updatePriorities()
+{
+    _inputTiles.assign(_viewOrder.size(), std::deque<std::uint64_t>());
+    for (const std::uint64_t seq : _classQueues[static_cast<std::size_t>(WorkClass::VisibleTiles)])
+    {
+        if (seq < _frontSeq || _entries[seq - _frontSeq]._removed)
+            continue;
+
+        Entry& entry = _entries[seq - _frontSeq];
+        entry._priority = priority(*entry._tile);
+        if (entry._priority >= 0)
+            _inputTiles[entry._priority].push_back(seq);
+    }
+}
+
+bool TileQueue::frontOf(WorkClass queueClass, std::uint64_t& seq)
 {
-    for (size_t i = 0; i < getQueue().size(); ++i)
+    std::deque<std::uint64_t>& queue = _classQueues[static_cast<std::size_t>(queueClass)];
+    while (!queue.empty()
+           && (queue.front() < _frontSeq || _entries[queue.front() - _frontSeq]._removed))
     {
-        const Payload front = getQueue().front();
-        const std::string message(front.data(), front.size());
+        queue.pop_front();
+    }
+
+    if (queue.empty())
+        return false;
+
+    seq = queue.front();
+    return true;
+}
+
+bool TileQueue::schedule(WorkClass& workClass, std::uint64_t& seq)
+{
+    bool found = false;
+    std::chrono::steady_clock::time_point deadline;
+    for (const WorkClass queueClass : { WorkClass::VisibleTiles, WorkClass::Callbacks,
+                                        WorkClass::Previews, WorkClass::Background })
+    {
+        std::uint64_t candidate = 0;
+        if (!frontOf(queueClass, candidate))
+            continue;
 
-        // stop at the first non-tile or non-'id' (preview) message
-        std::string id;
-        if (!LOOLProtocol::matchPrefix("tile", message) ||
-            !LOOLProtocol::getTokenStringFromMessage(message, "id", id))
+        WorkClass candidateClass = queueClass;
+        if (queueClass == WorkClass::VisibleTiles)
         {
-            break;
+            // The first tile at the cursor of the most recently edited view, if
+            // any, otherwise the one that was queued first.
+            for (auto it = _inputTiles.rbegin(); it != _inputTiles.rend(); ++it)
+            {
+                if (!it->empty())
+                {
+                    candidate = it->front();
+                    candidateClass = WorkClass::InputTiles;
+                    break;
+                }
+            }
         }
 
-        getQueue().erase(getQueue().begin());
-        getQueue().push_back(front);
+        const std::chrono::steady_clock::time_point candidateDeadline
+            = _entries[candidate - _frontSeq]._queued
+              + _latencyTargets[static_cast<std::size_t>(candidateClass)];
+        if (!found || candidateDeadline < deadline
+            || (candidateDeadline == deadline && candidate < seq))
+        {
+            found = true;
+            deadline = candidateDeadline;
+            workClass = candidateClass;
+            seq = candidate;
+        }
     }
+
+    return found;
 }
 
-TileQueue::Payload TileQueue::get_impl()
+void TileQueue::served(WorkClass workClass, std::chrono::steady_clock::time_point queued,
+                       std::chrono::steady_clock::time_point now)
 {
-    LOG_TRC("MessageQueue depth: " << getQueue().size());
-
-    const Payload front = getQueue().front();
+    const std::size_t index = static_cast<std::size_t>(workClass);
+    const auto wait = std::chrono::duration_cast<std::chrono::microseconds>(now - queued);
+
+    ClassStats& stats = _stats[index];
+    ++stats._served;
+    stats._totalWait += wait;
+    stats._maxWait = std::max(stats._maxWait, wait);
+    if (wait > _latencyTargets[index])
+        ++stats._late;
+}
 
-    std::string msg(front.data(), front.size());
+void TileQueue::dumpState(std::ostream& oss) const
+{
+    static const char* const names[] = { "inputTiles", "visibleTiles", "callbacks", "previews",
+                                         "background" };
 
-    std::string id;
-    bool isTile = LOOLProtocol::matchPrefix("tile", msg);
-    bool isPreview = isTile && LOOLProtocol::getTokenStringFromMessage(msg, "id", id);
-    if (!isTile || isPreview)
+    std::array<std::size_t, static_cast<std::size_t>(WorkClass::Count)> depths{};
+    for (const Entry& entry : _entries)
     {
-        // Don't combine non-tiles or tiles with id.
-        LOG_TRC("MessageQueue res: " << LOOLProtocol::getAbbreviatedMessage(msg));
-        getQueue().erase(getQueue().begin());
+        if (entry._removed)
+            continue;
 
-        // de-prioritize the other tiles with id - usually the previews in
-        // Impress
-        if (isPreview)
-            deprioritizePreviews();
+        WorkClass workClass = entry.getQueueClass();
+        if (entry._priority >= 0)
+            workClass = WorkClass::InputTiles;
 
-        return front;
+        depths[static_cast<std::size_t>(workClass)] += (entry._callback ? entry._callback->count() : 1);
     }
 
-    // We are handling a tile; first try to find one that is at the cursor's
-    // position, otherwise handle the one that is at the front
-    int prioritized = 0;
-    int prioritySoFar = -1;
-    for (size_t i = 0; i < getQueue().size(); ++i)
+    oss << "\ttileQueue:"
+        << "\n\t\tsize: " << _size;
+    for (std::size_t i = 0; i < depths.size(); ++i)
     {
-        auto& it = getQueue()[i];
-        const std::string prio(it.data(), it.size());
-
-        // avoid starving - stop the search when we reach a non-tile,
-        // otherwise we may keep growing the queue of unhandled stuff (both
-        // tiles and non-tiles)
-        if (!LOOLProtocol::matchPrefix("tile", prio) ||
-            LOOLProtocol::getTokenStringFromMessage(prio, "id", id))
-        {
-            break;
-        }
+        const ClassStats& stats = _stats[i];
+        oss << "\n\t\t" << names[i] << ':'
+            << "\n\t\t\tdepth: " << depths[i]
+            << "\n\t\t\ttarget: " << _latencyTargets[i].count() << " ms"
+            << "\n\t\t\tserved: " << stats._served
+            << "\n\t\t\tlate: " << stats._late
+            << "\n\t\t\tavg wait: "
+            << (stats._served ? stats._totalWait.count() / stats._served : 0) << " us"
+            << "\n\t\t\tmax wait: " << stats._maxWait.count() << " us";
+    }
 
-        const int p = priority(prio);
-        if (p > prioritySoFar)
-        {
-            prioritySoFar = p;
-            prioritized = i;
-            msg = prio;
+    oss << '\n';
+}
 
-            // found the highest priority already?
-            if (prioritySoFar == static_cast<int>(_viewOrder.size()) - 1)
-            {
-                break;
-            }
-        }
+TileQueue::Payload TileQueue::get_impl()
+{
+    compact();
+
+    LOG_TRC("MessageQueue depth: " << _size);
+
+    WorkClass workClass;
+    std::uint64_t seq;
+    if (!schedule(workClass, seq))
+        return Payload();
+
+    const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    const std::size_t pos = seq - _frontSeq;
+    Entry& entry = _entries[pos];
+    served(workClass, entry._queued, now);
+
+    if (entry._callback)
+    {
+        const std::string msg = takeCallback(pos)->serialize();
+        LOG_TRC("MessageQueue res: " << LOOLProtocol::getAbbreviatedMessage(msg));
+        return Payload(msg.data(), msg.data() + msg.size());
     }
 
-    getQueue().erase(getQueue().begin() + prioritized);
+    if (!entry.isTile() || entry.isPreview())
+    {
+        // Don't combine non-tiles or tiles with id.
+        Payload result = std::move(entry._message);
+        remove(pos);
+        LOG_TRC("MessageQueue res: " << LOOLProtocol::getAbbreviatedMessage(result));
+        return result;
+    }
 
     std::vector<TileDesc> tiles;
-    tiles.emplace_back(TileDesc::parse(msg));
-
-    // Combine as many tiles as possible with the top one.
-    for (size_t i = 0; i < getQueue().size(); )
+    tiles.emplace_back(*entry._tile);
+    remove(pos);
+
+    // Combine as many tiles of the same class as possible with the picked one,
+    // in the order they were queued. Only those of its row, or overlapping it,
+    // can be.
+    const TileDesc& first = tiles[0];
+    const WorkClass queueClass = first.getPrefetch() ? WorkClass::Background : WorkClass::VisibleTiles;
+    std::vector<std::uint64_t> candidates;
+    const auto last = _rowIndex.upper_bound(rowKey(first, first.getTilePosY() + first.getTileHeight()));
+    for (auto it = _rowIndex.lower_bound(rowKey(first, first.getTilePosY() - first.getTileHeight()));
+         it != last; ++it)
     {
-        auto& it = getQueue()[i];
-        msg = std::string(it.data(), it.size());
-        if (!LOOLProtocol::matchPrefix("tile", msg) ||
-            LOOLProtocol::getTokenStringFromMessage(msg, "id", id))
-        {
-            // Don't combine non-tiles or tiles with id.
-            ++i;
-            continue;
-        }
+        candidates.insert(candidates.end(), it->second.begin(), it->second.end());
+    }
+    std::sort(candidates.begin(), candidates.end());
 
-        TileDesc tile2 = TileDesc::parse(msg);
-        LOG_TRC("Combining candidate: " << LOOLProtocol::getAbbreviatedMessage(msg));
+    for (const std::uint64_t tileSeq : candidates)
+    {
+        const Entry& candidate = _entries[tileSeq - _frontSeq];
+        LOG_TRC("Combining candidate: " << candidate._tile->debugName());
 
         // Check if it's on the same row.
-        if (tiles[0].canCombine(tile2))
-        {
-            tiles.emplace_back(tile2);
-            getQueue().erase(getQueue().begin() + i);
-        }
-        else
+        if (tiles[0].canCombine(*candidate._tile))
         {
-            ++i;
+            served(candidate._priority >= 0 ? WorkClass::InputTiles : queueClass,
+                   candidate._queued, now);
+            tiles.emplace_back(*candidate._tile);
+            remove(tileSeq - _frontSeq);
         }
     }
 
-    LOG_TRC("Combined " << tiles.size() << " tiles, leaving " << getQueue().size() << " in queue.");
+    LOG_TRC("Combined " << tiles.size() << " tiles, leaving " << _size << " in queue.");
 
     if (tiles.size() == 1)
     {
-        msg = tiles[0].serialize("tile");
+        const std::string msg = tiles[0].serialize("tile");
         LOG_TRC("MessageQueue res: " << LOOLProtocol::getAbbreviatedMessage(msg));
         return Payload(msg.data(), msg.data() + msg.size());
     }
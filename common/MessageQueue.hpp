@@ -8,13 +8,25 @@
 #pragma once
 
 #include <algorithm>
+#include <array>
+#include <chrono>
 #include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <deque>
 #include <functional>
 #include <map>
+#include <memory>
 #include <mutex>
+#include <ostream>
 #include <string>
+#include <tuple>
+#include <unordered_map>
 #include <vector>
 
+#include <Rectangle.hpp>
+#include <TileDesc.hpp>
+
 /// Thread-safe message queue (FIFO).
 template <typename T>
 class MessageQueueBase
@@ -61,7 +73,7 @@ public:
     /// Get a message without waiting
     Payload pop()
     {
-        if (_queue.empty())
+        if (size_impl() == 0)
             return Payload();
         return get_impl();
     }
@@ -69,7 +81,13 @@ public:
     /// Anything in the queue ?
     bool isEmpty()
     {
-        return _queue.empty();
+        return size_impl() == 0;
+    }
+
+    /// Number of messages in the queue.
+    std::size_t size() const
+    {
+        return size_impl();
     }
 
     /// Thread safe removal of all the pending messages.
@@ -92,20 +110,25 @@ protected:
 
     virtual Payload get_impl()
     {
-        Payload result = _queue.front();
-        _queue.erase(_queue.begin());
+        Payload result = std::move(_queue.front());
+        _queue.pop_front();
         return result;
     }
 
-    void clear_impl()
+    virtual void clear_impl()
     {
         _queue.clear();
     }
 
-    std::vector<Payload>& getQueue() { return _queue; }
+    virtual std::size_t size_impl() const
+    {
+        return _queue.size();
+    }
+
+    std::deque<Payload>& getQueue() { return _queue; }
 
 private:
-    std::vector<Payload> _queue;
+    std::deque<Payload> _queue;
 };
 
 typedef MessageQueueBase<std::vector<char>> MessageQueue;
@@ -144,6 +167,113 @@ private:
     };
 
 public:
+    /// The classes of queued work. Each has a latency target, and the message
+    /// that is the most overdue for its class goes first.
+    enum class WorkClass
+    {
+        InputTiles, ///< Tiles at the cursor of the views being edited.
+        VisibleTiles, ///< Other tiles requested by the clients.
+        Callbacks, ///< Callbacks and other messages, kept in order.
+        Previews, ///< Tiles with 'id': slide previews and thumbnails.
+        Background, ///< Tiles rendered ahead of being visible ('prefetch').
+        Count
+    };
+
+    TileQueue();
+
+    /// Set the latency target of the class of work.
+    void setLatencyTarget(WorkClass workClass, std::chrono::milliseconds target)
+    {
+        _latencyTargets[static_cast<std::size_t>(workClass)] = target;
+    }
+
+    /// Queue depths and waiting times, per class of work.
+    void dumpState(std::ostream& oss) const;
+
+    /// A LOK callback, parsed once when queued, so that neither the
+    /// deduplication nor the dispatching tokenizes it or parses its JSON again.
+    class Callback
+    {
+    public:
+        /// viewId is the 'viewId' of the JSON payload of view cursor callbacks,
+        /// when the caller has parsed it already.
+        Callback(int view, int type, std::string payload,
+                 std::string viewId = std::string());
+
+        /// Parse a "callback <view> <type> <payload>" message, where view can be
+        /// 'all' or 'except-<view>'. Returns null if the message is invalid.
+        static std::unique_ptr<Callback> parse(const std::string& message);
+
+        /// The "callback <view> <type> <payload>" message.
+        std::string serialize() const;
+
+        /// Whether the callback goes to the given view.
+        bool isFor(int view) const
+        {
+            return _view < 0 ? view != _exceptView : view == _view;
+        }
+
+        int getView() const { return _view; }
+        int getType() const { return _type; }
+        const std::string& getPayload() const { return _payload; }
+
+    private:
+        friend class TileQueue;
+
+        /// Whether the two go to the same views, with the same type.
+        bool sameTarget(const Callback& other) const
+        {
+            return _type == other._type && _view == other._view
+                   && _exceptView == other._exceptView;
+        }
+
+        /// Whether this is a tile invalidation with a rectangle, to be
+        /// coalesced with the others of its part.
+        bool isInvalidation() const { return !_region.empty(); }
+
+        /// Number of messages to dispatch: one per rectangle of invalidations.
+        std::size_t count() const { return _region.empty() ? 1 : _region.size(); }
+
+        /// Add the rectangle to the invalidated region, merging it with the
+        /// ones it overlaps or touches if that doesn't invalidate much more.
+        /// Beyond maxRects rectangles, the region becomes its bounding box.
+        void addToRegion(Util::Rectangle rectangle, std::size_t maxRects);
+
+        /// Split off the first rectangle of the region.
+        std::unique_ptr<Callback> takeFirstRectangle();
+
+        /// Set _payload from the only rectangle of the region.
+        void updatePayload();
+
+        std::tuple<int, int, std::string> getRegionKey() const
+        {
+            return std::make_tuple(_view, _exceptView, _regionSuffix);
+        }
+
+        int _view; ///< Target view, -1 for all views.
+        int _exceptView; ///< With _view -1, the view to skip, if any.
+        int _type;
+        std::string _payload; ///< For invalidations, up to date only with one rectangle.
+
+        // Keys extracted once for deduplication, depending on the type.
+        std::string _viewId; ///< 'viewId' of view cursor callbacks.
+        std::string _unoCommand; ///< '.uno:' command of state changes.
+
+        /// The invalidated region, or empty if this is not an invalidation.
+        std::vector<Util::Rectangle> _region;
+        /// What follows the rectangle in the invalidation payload: the part, and
+        /// anything after it. With the target, it identifies the region.
+        std::string _regionSuffix;
+    };
+
+    /// Queue a callback of the given view, -1 for all views.
+    void putCallback(int view, int type, std::string payload,
+                     std::string viewId = std::string());
+
+    /// Dequeue the next message if it's a callback, without serializing it.
+    /// Returns null otherwise.
+    std::unique_ptr<Callback> popCallback();
+
     void updateCursorPosition(int viewId, int part, int x, int y, int width, int height)
     {
         const TileQueue::CursorPosition cursorPosition = CursorPosition(part, x, y, width, height);
@@ -167,6 +297,7 @@ public:
         }
 
         _viewOrder.push_back(viewId);
+        updatePriorities();
     }
 
     void removeCursorPosition(int viewId)
@@ -178,6 +309,7 @@ public:
         }
 
         _cursorPositions.erase(viewId);
+        updatePriorities();
     }
 
 protected:
@@ -185,28 +317,226 @@ protected:
 
     virtual Payload get_impl() override;
 
+    virtual void clear_impl() override;
+
+    virtual std::size_t size_impl() const override { return _size; }
+
 private:
+    /// A queued message. Tiles and callbacks are kept parsed, so that they
+    /// can be deduplicated, prioritized and combined without re-parsing.
+    struct Entry
+    {
+        Entry(Payload message, std::unique_ptr<TileDesc> tile,
+              std::unique_ptr<Callback> callback, std::chrono::steady_clock::time_point queued)
+            : _message(std::move(message))
+            , _tile(std::move(tile))
+            , _callback(std::move(callback))
+            , _queued(queued)
+            , _removed(false)
+            , _priority(-1)
+        {
+        }
+
+        bool isTile() const { return _tile != nullptr; }
+
+        /// Previews (tiles with 'id') are sent back verbatim and never combined.
+        bool isPreview() const { return _tile && _tile->getId() >= 0; }
+
+        /// The class the entry is queued in; tiles at a cursor are picked from
+        /// the VisibleTiles when scheduling.
+        WorkClass getQueueClass() const
+        {
+            if (!_tile)
+                return WorkClass::Callbacks;
+            if (_tile->getId() >= 0)
+                return WorkClass::Previews;
+            return _tile->getPrefetch() ? WorkClass::Background : WorkClass::VisibleTiles;
+        }
+
+        Payload _message; ///< Empty for callbacks and tiles that aren't previews.
+        std::unique_ptr<TileDesc> _tile; ///< Null for anything but tiles.
+        std::unique_ptr<Callback> _callback; ///< Null for anything but callbacks.
+        std::chrono::steady_clock::time_point _queued;
+        bool _removed; ///< Removed from the middle of the queue, skipped.
+        int _priority; ///< See priority(), for VisibleTiles; -1 otherwise.
+    };
+
+    /// How the messages of a class of work fared.
+    struct ClassStats
+    {
+        std::uint64_t _served = 0;
+        std::uint64_t _late = 0; ///< Served after the latency target.
+        std::chrono::microseconds _totalWait = std::chrono::microseconds::zero();
+        std::chrono::microseconds _maxWait = std::chrono::microseconds::zero();
+    };
+
+    /// What duplicate tile requests have in common: everything but the
+    /// version and what follows it on the wire.
+    struct TileKey
+    {
+        explicit TileKey(const TileDesc& tile)
+            : _normalizedViewId(tile.getNormalizedViewId())
+            , _part(tile.getPart())
+            , _width(tile.getWidth())
+            , _height(tile.getHeight())
+            , _tilePosX(tile.getTilePosX())
+            , _tilePosY(tile.getTilePosY())
+            , _tileWidth(tile.getTileWidth())
+            , _tileHeight(tile.getTileHeight())
+            , _oldWireId(tile.getOldWireId())
+            , _wireId(tile.getWireId())
+        {
+        }
+
+        bool operator==(const TileKey& other) const
+        {
+            return _tilePosX == other._tilePosX && _tilePosY == other._tilePosY
+                   && _part == other._part && _normalizedViewId == other._normalizedViewId
+                   && _width == other._width && _height == other._height
+                   && _tileWidth == other._tileWidth && _tileHeight == other._tileHeight
+                   && _oldWireId == other._oldWireId && _wireId == other._wireId;
+        }
+
+        int _normalizedViewId;
+        int _part;
+        int _width;
+        int _height;
+        int _tilePosX;
+        int _tilePosY;
+        int _tileWidth;
+        int _tileHeight;
+        TileWireId _oldWireId;
+        TileWireId _wireId;
+    };
+
+    struct TileKeyHash
+    {
+        std::size_t operator()(const TileKey& key) const
+        {
+            std::uint64_t hash = 14695981039346656037ULL;
+            for (const std::uint64_t value :
+                 { static_cast<std::uint64_t>(key._tilePosX), static_cast<std::uint64_t>(key._tilePosY),
+                   static_cast<std::uint64_t>(key._part), static_cast<std::uint64_t>(key._normalizedViewId),
+                   static_cast<std::uint64_t>(key._width), static_cast<std::uint64_t>(key._height),
+                   static_cast<std::uint64_t>(key._tileWidth), static_cast<std::uint64_t>(key._tileHeight),
+                   static_cast<std::uint64_t>(key._oldWireId), static_cast<std::uint64_t>(key._wireId) })
+            {
+                hash = (hash ^ value) * 1099511628211ULL;
+            }
+
+            return hash ^ (hash >> 32);
+        }
+    };
+
+    /// What the tiles that may be combined have in common, and their row.
+    using RowKey = std::tuple<int, int, int, int, int, int, bool, int>;
+
+    static RowKey rowKey(const TileDesc& tile, int tilePosY)
+    {
+        return std::make_tuple(tile.getNormalizedViewId(), tile.getPart(), tile.getWidth(),
+                               tile.getHeight(), tile.getTileWidth(), tile.getTileHeight(),
+                               tile.getPrefetch(), tilePosY);
+    }
+
+    /// Append a message, or a parsed tile or callback, to the queue.
+    void push(Payload message, std::unique_ptr<TileDesc> tile = nullptr,
+              std::unique_ptr<Callback> callback = nullptr);
+
+    void push(Entry entry);
+
+    /// Remove the entry at the given position in _entries, in O(1).
+    /// Returns its callback, if any.
+    std::unique_ptr<Callback> remove(std::size_t pos);
+
+    /// Drop the removed entries from the front of the queue, and, when they
+    /// dominate, from the middle too.
+    void compact();
+
     /// Search the queue for a duplicate tile and remove it (if present).
-    void removeTileDuplicate(const std::string& tileMsg);
+    void removeTileDuplicate(const TileDesc& tile);
+
+    /// Remove the tiles with the given versions, except previews.
+    void cancelTiles(const StringVector& versions);
 
     /// Search the queue for a duplicate callback and remove it (if present).
     ///
     /// This removes also callbacks that are made invalid by the current
-    /// message, like the new cursor position invalidates the old one etc.
-    ///
-    /// @return New message to put into the queue.  If empty, use what was in callbackMsg.
-    std::string removeCallbackDuplicate(const std::string& callbackMsg);
-
-    /// De-prioritize the previews (tiles with 'id') - move them to the end of
-    /// the queue.
-    void deprioritizePreviews();
-
-    /// Priority of the given tile message.
+    /// one, like the new cursor position invalidates the old one etc.
+    /// An invalidation takes over the region of its part, if no other
+    /// callback was queued since, to keep the order of the callbacks.
+    void removeCallbackDuplicate(Callback& callback);
+
+    /// Dequeue the callback at the given position, or its first rectangle
+    /// for invalidations.
+    std::unique_ptr<Callback> takeCallback(std::size_t pos);
+
+    /// Sequence number of the first live entry of the class, dropping the
+    /// removed ones before it. Returns false if there is none.
+    bool frontOf(WorkClass queueClass, std::uint64_t& seq);
+
+    /// Pick the next message to handle: of the front messages of the classes,
+    /// the one with the earliest deadline (queued time plus the latency target
+    /// of its class). Tiles at a cursor, highest priority first, are InputTiles.
+    /// Returns false if the queue is empty.
+    bool schedule(WorkClass& workClass, std::uint64_t& seq);
+
+    /// Account for a message of the class, queued at the given time, served now.
+    void served(WorkClass workClass, std::chrono::steady_clock::time_point queued,
+                std::chrono::steady_clock::time_point now);
+
+    /// Priority of the given tile.
     /// -1 means the lowest prio (the tile does not intersect any of the cursors),
     /// the higher the number, the bigger is priority [up to _viewOrder.size()-1].
-    int priority(const std::string& tileMsg);
+    int priority(const TileDesc& tile) const;
+
+    /// Recompute the priority of the queued VisibleTiles, once the cursors moved.
+    void updatePriorities();
 
 private:
+    /// The messages, in order, including the removed ones until compact().
+    std::deque<Entry> _entries;
+
+    /// Sequence number of _entries.front(); the entry with sequence number
+    /// seq is at _entries[seq - _frontSeq].
+    std::uint64_t _frontSeq = 0;
+
+    /// Number of messages in _entries that are not removed.
+    std::size_t _size = 0;
+
+    /// Sequence numbers of the entries of each class, in order, including
+    /// removed ones. InputTiles are queued with the VisibleTiles.
+    std::array<std::deque<std::uint64_t>, static_cast<std::size_t>(WorkClass::Count)> _classQueues;
+
+    std::array<std::chrono::milliseconds, static_cast<std::size_t>(WorkClass::Count)> _latencyTargets;
+
+    std::array<ClassStats, static_cast<std::size_t>(WorkClass::Count)> _stats;
+
+    /// Sequence numbers of the queued VisibleTiles at a cursor, in order, by
+    /// their priority: the InputTiles.
+    std::vector<std::deque<std::uint64_t>> _inputTiles;
+
+    /// Sequence numbers of the queued tiles but previews, in order, by row.
+    std::map<RowKey, std::deque<std::uint64_t>> _rowIndex;
+
+    /// Sequence numbers of the queued tiles.
+    std::unordered_map<TileKey, std::uint64_t, TileKeyHash> _tileIndex;
+
+    /// Sequence numbers of the queued tiles that canceltiles can remove, by
+    /// version. Versions are unique per tile in practice, but not by contract.
+    std::unordered_multimap<int, std::uint64_t> _versionIndex;
+
+    /// Sequence numbers of the queued invalidations, by target view (or -1
+    /// and the excepted view) and region suffix.
+    std::map<std::tuple<int, int, std::string>, std::uint64_t> _regionIndex;
+
+    /// Sequence number after the last message that invalidations can't be
+    /// moved past: anything but tiles and other invalidations.
+    std::uint64_t _regionBarrierSeq = 0;
+
+    /// The number of rectangles beyond which an invalidated region is
+    /// collapsed to its bounding box.
+    std::size_t _maxInvalidationRects;
+
     std::map<int, CursorPosition> _cursorPositions;
 
     /// Check the views in the order of how the editing (cursor movement) has
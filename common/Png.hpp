@@ -49,8 +49,13 @@
 #include <png.h>
 #include <zlib.h>
 
+#include <algorithm>
 #include <cassert>
 #include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <mutex>
 
 #ifdef IOS
 #include <Foundation/Foundation.h>
@@ -83,13 +88,30 @@ extern "C"
 }
 
 
-/* Unpremultiplies data and converts native endian ARGB => RGBA bytes */
-static void
-unpremultiply_data (png_structp /*png*/, png_row_infop row_info, png_bytep data)
+/// Lookup table of unpremultiplied channel values, indexed by alpha * 256 + value.
+/// Saves the three integer divisions per pixel that dominate unpremultiplication.
+inline const uint8_t* unpremultiplyTable()
 {
-    unsigned int i;
+    static const std::vector<uint8_t> table = []()
+    {
+        std::vector<uint8_t> values(256 * 256, 0);
+        for (unsigned alpha = 1; alpha < 256; ++alpha)
+        {
+            for (unsigned value = 0; value < 256; ++value)
+                values[alpha * 256 + value] = (value * 255 + alpha / 2) / alpha;
+        }
 
-    for (i = 0; i < row_info->rowbytes; i += 4)
+        return values;
+    }();
+
+    return table.data();
+}
+
+/* Unpremultiplies data and converts native endian ARGB => RGBA bytes */
+inline void unpremultiplyPixels(unsigned char* data, size_t bytes)
+{
+    const uint8_t* table = unpremultiplyTable();
+    for (size_t i = 0; i < bytes; i += 4)
     {
         uint8_t *b = &data[i];
         uint32_t pixel;
@@ -97,20 +119,77 @@ unpremultiply_data (png_structp /*png*/, png_row_infop row_info, png_bytep data)
 
         std::memcpy (&pixel, b, sizeof (uint32_t));
         alpha = (pixel & 0xff000000) >> 24;
-        if (alpha == 0)
+        if (alpha == 0xff)
+        {
+            // Opaque, by far the most common; only the byte order changes.
+            b[0] = (pixel & 0xff0000) >> 16;
+            b[1] = (pixel & 0x00ff00) >>  8;
+            b[2] = (pixel & 0x0000ff) >>  0;
+            b[3] = alpha;
+        }
+        else if (alpha == 0)
         {
             b[0] = b[1] = b[2] = b[3] = 0;
         }
         else
         {
-            b[0] = (((pixel & 0xff0000) >> 16) * 255 + alpha / 2) / alpha;
-            b[1] = (((pixel & 0x00ff00) >>  8) * 255 + alpha / 2) / alpha;
-            b[2] = (((pixel & 0x0000ff) >>  0) * 255 + alpha / 2) / alpha;
+            const uint8_t* row = table + alpha * 256;
+            b[0] = row[(pixel & 0xff0000) >> 16];
+            b[1] = row[(pixel & 0x00ff00) >>  8];
+            b[2] = row[(pixel & 0x0000ff) >>  0];
             b[3] = alpha;
         }
     }
 }
 
+static void
+unpremultiply_data (png_structp /*png*/, png_row_infop row_info, png_bytep data)
+{
+    unpremultiplyPixels(data, row_info->rowbytes);
+}
+
+/// The available PNG encoders.
+enum class Encoder
+{
+    LibPng, //< libpng with the default zlib strategy.
+    Fast    //< Our own filter and deflate pipeline, see impl_encodeSubBufferToFastPNG.
+};
+
+/// How tiles are encoded, as set by per_document.png_encoder and
+/// per_document.png_compression_level in loolwsd.xml.
+struct EncoderSettings
+{
+    Encoder _encoder;
+    int _level;
+};
+
+inline const EncoderSettings& getEncoderSettings()
+{
+    static const EncoderSettings settings = []()
+    {
+#if MOBILEAPP
+        EncoderSettings result { Encoder::LibPng, Z_BEST_SPEED };
+#else
+        // Level 4 gives virtually identical compression
+        // ratio to level 6, but is between 5-10% faster.
+        // Level 3 runs almost twice as fast, but the
+        // output is typically 2-3x larger.
+        EncoderSettings result { Encoder::LibPng, 4 };
+#endif
+        const char* encoder = std::getenv("LOOL_PNG_ENCODER");
+        if (encoder && std::strcmp(encoder, "fast") == 0)
+            result._encoder = Encoder::Fast;
+
+        const char* level = std::getenv("LOOL_PNG_COMPRESSION_LEVEL");
+        if (level)
+            result._level = std::min(std::max(std::atoi(level), Z_BEST_SPEED), Z_BEST_COMPRESSION);
+
+        return result;
+    }();
+
+    return settings;
+}
+
 /// This function uses setjmp which may clobbers non-trivial objects.
 /// So we can't use logging or create complex C++ objects in this frame.
 /// Specifically, logging uses std::string objects, and GCC gives the following:
@@ -121,7 +200,8 @@ unpremultiply_data (png_structp /*png*/, png_row_infop row_info, png_bytep data)
 /// png_write_row(), so can't use const here for pixmap.
 inline bool impl_encodeSubBufferToPNG(unsigned char* pixmap, size_t startX, size_t startY,
                                       int width, int height, int bufferWidth, int bufferHeight,
-                                      std::vector<char>& output, LibreOfficeKitTileMode mode)
+                                      std::vector<char>& output, LibreOfficeKitTileMode mode,
+                                      int level)
 {
     if (bufferWidth < width || bufferHeight < height)
     {
@@ -138,19 +218,7 @@ inline bool impl_encodeSubBufferToPNG(unsigned char* pixmap, size_t startX, size
         return false;
     }
 
-#if MOBILEAPP
-    png_set_compression_level(png_ptr, Z_BEST_SPEED);
-#else
-    // Level 4 gives virtually identical compression
-    // ratio to level 6, but is between 5-10% faster.
-    // Level 3 runs almost twice as fast, but the
-    // output is typically 2-3x larger.
-    png_set_compression_level(png_ptr, 4);
-#endif
-
-#ifdef IOS
-    auto initialSize = output.size();
-#endif
+    png_set_compression_level(png_ptr, level);
 
     png_set_IHDR(png_ptr, info_ptr, width, height, 8, PNG_COLOR_TYPE_RGB_ALPHA, PNG_INTERLACE_NONE,
                  PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
@@ -175,15 +243,113 @@ inline bool impl_encodeSubBufferToPNG(unsigned char* pixmap, size_t startX, size
 
     png_destroy_write_struct(&png_ptr, &info_ptr);
 
-#ifdef IOS
-    auto base64 = [[NSData dataWithBytesNoCopy:output.data() + initialSize length:(output.size() - initialSize) freeWhenDone:NO] base64EncodedDataWithOptions:0];
+    return true;
+}
 
-    const char dataURLStart[] = "data:image/png;base64,";
+/// Appends a PNG chunk: big-endian length, type, data and the CRC of type and data.
+inline void writePNGChunk(std::vector<char>& output, const char* type,
+                          const unsigned char* data, size_t size)
+{
+    const unsigned char header[8] = {
+        static_cast<unsigned char>(size >> 24), static_cast<unsigned char>(size >> 16),
+        static_cast<unsigned char>(size >> 8), static_cast<unsigned char>(size),
+        static_cast<unsigned char>(type[0]), static_cast<unsigned char>(type[1]),
+        static_cast<unsigned char>(type[2]), static_cast<unsigned char>(type[3]) };
+    output.insert(output.end(), header, header + sizeof(header));
+    if (size > 0)
+        output.insert(output.end(), data, data + size);
+
+    uLong crc = crc32(0, header + 4, 4);
+    if (size > 0)
+        crc = crc32(crc, data, size);
+    const char trailer[4] = {
+        static_cast<char>(crc >> 24), static_cast<char>(crc >> 16),
+        static_cast<char>(crc >> 8), static_cast<char>(crc) };
+    output.insert(output.end(), trailer, trailer + sizeof(trailer));
+}
 
-    output.resize(initialSize);
-    output.insert(output.end(), dataURLStart, dataURLStart + sizeof(dataURLStart)-1);
-    output.insert(output.end(), (char*)base64.bytes, (char*)base64.bytes + base64.length);
-#endif
+/// Encodes tiles without libpng, for speed over size.
+/// Document tiles are mostly flat backgrounds with text, so each row uses
+/// either the Up filter, when it repeats the previous row, or the Sub filter,
+/// which turns horizontal runs into zeros. Those are deflated with the
+/// run-length strategy, which is much cheaper than full LZ77 matching.
+inline bool impl_encodeSubBufferToFastPNG(unsigned char* pixmap, size_t startX, size_t startY,
+                                          int width, int height, int bufferWidth, int bufferHeight,
+                                          std::vector<char>& output, LibreOfficeKitTileMode mode,
+                                          int level)
+{
+    if (width <= 0 || height <= 0 || bufferWidth < width || bufferHeight < height)
+        return false;
+
+    const size_t initialSize = output.size();
+    static const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+    output.insert(output.end(), signature, signature + sizeof(signature));
+
+    // 8 bits per channel, RGBA, no interlacing.
+    const unsigned char ihdr[13] = {
+        static_cast<unsigned char>(width >> 24), static_cast<unsigned char>(width >> 16),
+        static_cast<unsigned char>(width >> 8), static_cast<unsigned char>(width),
+        static_cast<unsigned char>(height >> 24), static_cast<unsigned char>(height >> 16),
+        static_cast<unsigned char>(height >> 8), static_cast<unsigned char>(height),
+        8, PNG_COLOR_TYPE_RGB_ALPHA, 0, 0, 0 };
+    writePNGChunk(output, "IHDR", ihdr, sizeof(ihdr));
+
+    z_stream stream;
+    std::memset(&stream, 0, sizeof(stream));
+    if (deflateInit2(&stream, level, Z_DEFLATED, 15, 8, Z_RLE) != Z_OK)
+    {
+        output.resize(initialSize);
+        return false;
+    }
+
+    const size_t rowBytes = width * 4;
+    std::vector<unsigned char> prevRow(rowBytes);
+    std::vector<unsigned char> curRow(rowBytes);
+    std::vector<unsigned char> filtered(rowBytes + 1);
+    std::vector<unsigned char> idat(deflateBound(&stream, (rowBytes + 1) * height));
+    stream.next_out = idat.data();
+    stream.avail_out = idat.size();
+
+    int res = Z_OK;
+    for (int y = 0; y < height; ++y)
+    {
+        const size_t position = ((startY + y) * bufferWidth * 4) + (startX * 4);
+        std::memcpy(curRow.data(), pixmap + position, rowBytes);
+        if (mode == LOK_TILEMODE_BGRA)
+            unpremultiplyPixels(curRow.data(), rowBytes);
+
+        if (y > 0 && curRow == prevRow)
+        {
+            filtered[0] = PNG_FILTER_VALUE_UP;
+            std::memset(&filtered[1], 0, rowBytes);
+        }
+        else
+        {
+            filtered[0] = PNG_FILTER_VALUE_SUB;
+            std::memcpy(&filtered[1], curRow.data(), 4);
+            for (size_t i = 4; i < rowBytes; ++i)
+                filtered[i + 1] = curRow[i] - curRow[i - 4];
+        }
+
+        stream.next_in = filtered.data();
+        stream.avail_in = filtered.size();
+        res = deflate(&stream, y + 1 == height ? Z_FINISH : Z_NO_FLUSH);
+        if (res == Z_STREAM_ERROR)
+            break;
+
+        std::swap(prevRow, curRow);
+    }
+
+    const size_t idatSize = stream.total_out;
+    deflateEnd(&stream);
+    if (res != Z_STREAM_END)
+    {
+        output.resize(initialSize);
+        return false;
+    }
+
+    writePNGChunk(output, "IDAT", idat.data(), idatSize);
+    writePNGChunk(output, "IEND", nullptr, 0);
 
     return true;
 }
@@ -192,12 +358,34 @@ inline bool impl_encodeSubBufferToPNG(unsigned char* pixmap, size_t startX, size
 /// png_write_row(), so can't use const here for pixmap.
 inline bool encodeSubBufferToPNG(unsigned char* pixmap, size_t startX, size_t startY, int width,
                                  int height, int bufferWidth, int bufferHeight,
-                                 std::vector<char>& output, LibreOfficeKitTileMode mode)
+                                 std::vector<char>& output, LibreOfficeKitTileMode mode,
+                                 Encoder encoder, int level)
 {
     const auto start = std::chrono::steady_clock::now();
 
-    const bool res = impl_encodeSubBufferToPNG(pixmap, startX, startY, width, height, bufferWidth,
-                                               bufferHeight, output, mode);
+#ifdef IOS
+    auto initialSize = output.size();
+#endif
+
+    const bool res = (encoder == Encoder::Fast)
+        ? impl_encodeSubBufferToFastPNG(pixmap, startX, startY, width, height, bufferWidth,
+                                        bufferHeight, output, mode, level)
+        : impl_encodeSubBufferToPNG(pixmap, startX, startY, width, height, bufferWidth,
+                                    bufferHeight, output, mode, level);
+
+#ifdef IOS
+    if (res)
+    {
+        auto base64 = [[NSData dataWithBytesNoCopy:output.data() + initialSize length:(output.size() - initialSize) freeWhenDone:NO] base64EncodedDataWithOptions:0];
+
+        const char dataURLStart[] = "data:image/png;base64,";
+
+        output.resize(initialSize);
+        output.insert(output.end(), dataURLStart, dataURLStart + sizeof(dataURLStart)-1);
+        output.insert(output.end(), (char*)base64.bytes, (char*)base64.bytes + base64.length);
+    }
+#endif
+
     if (Log::traceEnabled())
     {
         const auto end = std::chrono::steady_clock::now();
@@ -218,6 +406,16 @@ inline bool encodeSubBufferToPNG(unsigned char* pixmap, size_t startX, size_t st
     return res;
 }
 
+/// Encodes with the configured encoder and compression level.
+inline bool encodeSubBufferToPNG(unsigned char* pixmap, size_t startX, size_t startY, int width,
+                                 int height, int bufferWidth, int bufferHeight,
+                                 std::vector<char>& output, LibreOfficeKitTileMode mode)
+{
+    const EncoderSettings& settings = getEncoderSettings();
+    return encodeSubBufferToPNG(pixmap, startX, startY, width, height, bufferWidth, bufferHeight,
+                                output, mode, settings._encoder, settings._level);
+}
+
 inline
 bool encodeBufferToPNG(unsigned char* pixmap, int width, int height,
                        std::vector<char>& output, LibreOfficeKitTileMode mode)
@@ -253,6 +451,208 @@ uint64_t hashSubBuffer(unsigned char* pixmap, size_t startX, size_t startY,
     return hash1;
 }
 
+namespace RowHash
+{
+// The xxHash64 primes and round; see https://github.com/Cyan4973/xxHash
+static const uint64_t Prime1 = 0x9E3779B185EBCA87ULL;
+static const uint64_t Prime2 = 0xC2B2AE3D27D4EB4FULL;
+static const uint64_t Prime3 = 0x165667B19E3779F9ULL;
+static const uint64_t Prime4 = 0x85EBCA77C2B2AE63ULL;
+static const uint64_t Prime5 = 0x27D4EB2F165667C5ULL;
+
+inline uint64_t rotl(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+inline uint64_t mix(uint64_t acc, uint64_t input)
+{
+    return rotl(acc + input * Prime2, 31) * Prime1;
+}
+
+inline uint64_t mergeRound(uint64_t acc, uint64_t lane)
+{
+    return (acc ^ mix(0, lane)) * Prime1 + Prime4;
+}
+
+inline uint64_t avalanche(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= Prime2;
+    h ^= h >> 29;
+    h *= Prime3;
+    h ^= h >> 32;
+    return h;
+}
+
+/// Hashes bytes in four independent 64-bit lanes, 32 bytes at a time, which
+/// the CPU overlaps and compilers may vectorise.
+inline uint64_t hash(const unsigned char* data, size_t size, uint64_t seed)
+{
+    const unsigned char* p = data;
+    const unsigned char* const end = data + size;
+    uint64_t h;
+
+    if (size >= 32)
+    {
+        uint64_t lanes[4] = { seed + Prime1 + Prime2, seed + Prime2, seed, seed - Prime1 };
+        for (; p + 32 <= end; p += 32)
+        {
+            uint64_t input[4];
+            std::memcpy(input, p, sizeof(input));
+            for (int i = 0; i < 4; ++i)
+                lanes[i] = mix(lanes[i], input[i]);
+        }
+
+        h = rotl(lanes[0], 1) + rotl(lanes[1], 7) + rotl(lanes[2], 12) + rotl(lanes[3], 18);
+        for (int i = 0; i < 4; ++i)
+            h = mergeRound(h, lanes[i]);
+    }
+    else
+        h = seed + Prime5;
+
+    h += size;
+
+    for (; p + 8 <= end; p += 8)
+    {
+        uint64_t input;
+        std::memcpy(&input, p, sizeof(input));
+        h = rotl(h ^ mix(0, input), 27) * Prime1 + Prime4;
+    }
+
+    for (; p + 4 <= end; p += 4)
+    {
+        uint32_t input;
+        std::memcpy(&input, p, sizeof(input));
+        h = rotl(h ^ (input * Prime1), 23) * Prime2 + Prime3;
+    }
+
+    return avalanche(h);
+}
+}
+
+/// Hashes each row of the sub-buffer into rowHashes (if given, height entries),
+/// and the whole sub-buffer from those, reading the pixels only once.
+/// The row hashes let DeltaGenerator match rows without hashing them again.
+inline
+uint64_t hashSubBufferRows(const unsigned char* pixmap, size_t startX, size_t startY,
+                           long width, long height, int bufferWidth, int bufferHeight,
+                           uint64_t* rowHashes)
+{
+    if (bufferWidth < width || bufferHeight < height)
+        return 0; // magic invalid hash.
+
+    // Rows are hashed in small batches, to hash the hashes as we go.
+    static const long Batch = 32;
+    uint64_t batch[Batch];
+    uint64_t hash = RowHash::Prime5 ^ (static_cast<uint64_t>(width) << 32 | height);
+
+    for (long y = 0; y < height; y += Batch)
+    {
+        const long rows = std::min(Batch, height - y);
+        for (long i = 0; i < rows; ++i)
+        {
+            const size_t position = ((startY + y + i) * bufferWidth * 4) + (startX * 4);
+            batch[i] = RowHash::hash(pixmap + position, width * 4, 1073741789);
+        }
+
+        if (rowHashes)
+            std::memcpy(rowHashes + y, batch, rows * sizeof(uint64_t));
+        hash = RowHash::hash(reinterpret_cast<const unsigned char*>(batch),
+                             rows * sizeof(uint64_t), hash);
+    }
+
+    return hash ? hash : 1;
+}
+
+/// Checks whether the sub-buffer is of a single colour, if so sets colour to its pixel value.
+inline
+bool isSolidColour(const unsigned char* pixmap, size_t startX, size_t startY,
+                   long width, long height, int bufferWidth, uint32_t& colour)
+{
+    if (width <= 0 || height <= 0)
+        return false;
+
+    std::memcpy(&colour, pixmap + (startY * bufferWidth + startX) * 4, sizeof(uint32_t));
+    for (long y = 0; y < height; ++y)
+    {
+        const unsigned char* row = pixmap + ((startY + y) * bufferWidth + startX) * 4;
+        for (long x = 0; x < width; ++x)
+        {
+            uint32_t pixel;
+            std::memcpy(&pixel, row + x * 4, sizeof(uint32_t));
+            if (pixel != colour)
+                return false;
+        }
+    }
+
+    return true;
+}
+
+/// The hash of a solid colour tile, without going through its pixels.
+inline
+uint64_t hashSolidColour(uint32_t colour, long width, long height)
+{
+    const uint64_t key[2] = { colour, (static_cast<uint64_t>(width) << 32) | static_cast<uint64_t>(height) };
+    return SpookyHash::Hash64(key, sizeof(key), 1073741789);
+}
+
+/// Encodes a solid colour tile as a 1-bit palette PNG of its single colour.
+/// Every row is zero then, so the compressed image data only depends on the
+/// size and is built once; the tile itself is a few dozen bytes.
+inline
+bool encodeSolidColourToPNG(uint32_t colour, int width, int height,
+                            std::vector<char>& output, LibreOfficeKitTileMode mode)
+{
+    if (width <= 0 || height <= 0)
+        return false;
+
+    static std::mutex mutex;
+    static std::map<std::pair<int, int>, std::vector<unsigned char>> idats;
+
+    std::vector<unsigned char> idat;
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        std::vector<unsigned char>& cached = idats[std::make_pair(width, height)];
+        if (cached.empty())
+        {
+            // A filter byte and one bit per pixel, all zero.
+            const std::vector<unsigned char> rows(((width + 7) / 8 + 1) * height, 0);
+            uLongf size = compressBound(rows.size());
+            cached.resize(size);
+            if (compress2(cached.data(), &size, rows.data(), rows.size(), Z_BEST_COMPRESSION) != Z_OK)
+            {
+                cached.clear();
+                return false;
+            }
+
+            cached.resize(size);
+        }
+
+        idat = cached;
+    }
+
+    unsigned char rgba[4];
+    std::memcpy(rgba, &colour, sizeof(uint32_t));
+    if (mode == LOK_TILEMODE_BGRA)
+        unpremultiplyPixels(rgba, sizeof(rgba));
+
+    static const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+    output.insert(output.end(), signature, signature + sizeof(signature));
+
+    const unsigned char ihdr[13] = {
+        static_cast<unsigned char>(width >> 24), static_cast<unsigned char>(width >> 16),
+        static_cast<unsigned char>(width >> 8), static_cast<unsigned char>(width),
+        static_cast<unsigned char>(height >> 24), static_cast<unsigned char>(height >> 16),
+        static_cast<unsigned char>(height >> 8), static_cast<unsigned char>(height),
+        1, PNG_COLOR_TYPE_PALETTE, 0, 0, 0 };
+    writePNGChunk(output, "IHDR", ihdr, sizeof(ihdr));
+    writePNGChunk(output, "PLTE", rgba, 3);
+    if (rgba[3] != 0xff)
+        writePNGChunk(output, "tRNS", rgba + 3, 1);
+    writePNGChunk(output, "IDAT", idat.data(), idat.size());
+    writePNGChunk(output, "IEND", nullptr, 0);
+
+    return true;
+}
+
 static
 void readTileData(png_structp png_ptr, png_bytep data, png_size_t length)
 {
@@ -298,6 +698,14 @@ std::vector<png_bytep> decodePNG(std::stringstream& stream, png_uint_32& height,
     width = png_get_image_width(ptrPNG, ptrInfo);
     height = png_get_image_height(ptrPNG, ptrInfo);
 
+    // Solid colour tiles come as palette images, always expand to RGBA.
+    png_set_expand(ptrPNG);
+    if (!(png_get_color_type(ptrPNG, ptrInfo) & PNG_COLOR_MASK_ALPHA) &&
+        !png_get_valid(ptrPNG, ptrInfo, PNG_INFO_tRNS))
+    {
+        png_set_add_alpha(ptrPNG, 0xff, PNG_FILLER_AFTER);
+    }
+
     png_set_interlace_handling(ptrPNG);
     png_read_update_info(ptrPNG, ptrInfo);
 
@@ -173,6 +173,47 @@ namespace LOOLProtocol
     {
         return getTokenKeyword(Util::tokenize(message), name, map, value);
     }
+
+    static const char BatchPrefix[] = "batch:";
+
+    void appendToBatch(std::vector<char>& batch, const char* data, std::size_t size)
+    {
+        if (batch.empty())
+            batch.assign(BatchPrefix, BatchPrefix + sizeof(BatchPrefix) - 1);
+
+        const std::string header = '\n' + std::to_string(size) + '\n';
+        batch.insert(batch.end(), header.begin(), header.end());
+        batch.insert(batch.end(), data, data + size);
+    }
+
+    bool splitBatch(const char* data, std::size_t size, std::vector<std::vector<char>>& messages)
+    {
+        const std::size_t prefixSize = sizeof(BatchPrefix) - 1;
+        if (size < prefixSize || std::memcmp(data, BatchPrefix, prefixSize) != 0)
+            return false;
+
+        std::size_t pos = prefixSize;
+        while (pos < size)
+        {
+            // '\n' <length> '\n' <message>
+            if (data[pos] != '\n')
+                return false;
+
+            const char* end = static_cast<const char*>(std::memchr(data + pos + 1, '\n', size - pos - 1));
+            if (!end)
+                return false;
+
+            uint64_t length = 0;
+            if (!stringToUInt64(std::string(data + pos + 1, end), length)
+                || length > static_cast<uint64_t>(data + size - end - 1))
+                return false;
+
+            messages.emplace_back(end + 1, end + 1 + length);
+            pos = end + 1 + length - data;
+        }
+
+        return true;
+    }
 };
 
 /* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -229,6 +229,19 @@ namespace LOOLProtocol
                 token != "userinactive");
     }
 
+    /// Returns true if the token is a command that may edit the
+    /// document, when sent by a session that is allowed to.
+    inline
+    bool tokenIndicatesEditing(const std::string& token)
+    {
+        return token == "key" || token == "textinput" || token == "windowkey" ||
+               token == "mouse" || token == "windowmouse" || token == "windowgesture" ||
+               token == "uno" || token == "paste" || token == "insertfile" ||
+               token == "completefunction" || token == "removetextcontext" ||
+               token == "dialogevent" || token == "formfieldevent" ||
+               token == "moveselectedclientparts";
+    }
+
     /// Returns the first line of a message.
     inline
     std::string getFirstLine(const char *message, const int length)
@@ -285,6 +298,14 @@ namespace LOOLProtocol
     {
         return getAbbreviatedMessage(message.data(), message.size());
     }
+
+    /// Append a message to a "batch:" frame, which carries several
+    /// messages, each preceded by its length. Starts the frame if empty.
+    void appendToBatch(std::vector<char>& batch, const char* data, std::size_t size);
+
+    /// Split a "batch:" frame into its messages.
+    /// Returns false if the frame is not a batch, or is malformed.
+    bool splitBatch(const char* data, std::size_t size, std::vector<std::vector<char>>& messages);
 };
 
 /* vim:set shiftwidth=4 softtabstop=4 expandtab: */
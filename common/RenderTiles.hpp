@@ -7,22 +7,37 @@
 
 #pragma once
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <list>
 #include <memory>
-#include <queue>
+#include <mutex>
 #include <thread>
+#include <type_traits>
 #include <unordered_map>
 #include <vector>
 
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
 #ifdef IOS
 #import <fcntl.h>
 #import <sys/mman.h>
 #import <unistd.h>
 #endif
 
+#include "Delta.hpp"
 #include "Png.hpp"
 #include "Rectangle.hpp"
 #include "TileDesc.hpp"
+#include "TileShm.hpp"
 
 #if ENABLE_DEBUG
 #  define ADD_DEBUG_RENDERID (" renderid=" + Util::UniqueId() + '\n')
@@ -30,9 +45,13 @@
 #  define ADD_DEBUG_RENDERID ("\n")
 #endif
 
-/// A quick & dirty cache of the last few PNGs
-/// and their hashes to avoid re-compression
-/// wherever possible.
+/// A cache of recent PNGs and their hashes to avoid
+/// re-compression wherever possible.
+/// This is a segmented LRU: new entries go on probation and are
+/// promoted to the protected segment when hit again, so repeated
+/// content (table cells, slide backgrounds) survives a sweep of
+/// one-off tiles. Both segments are budgeted in bytes and evict
+/// from their least recently used end in constant time.
 class PngCache
 {
 public:
@@ -40,30 +59,16 @@ public:
 private:
     struct CacheEntry {
     private:
-        size_t    _hitCount;
         TileWireId _wireId;
         CacheData _data;
     public:
-        CacheEntry(const CacheData &data, TileWireId id) :
-            _hitCount(1),   // Every entry is used at least once; prevent removal at birth.
+        CacheEntry(const CacheData &data, TileWireId id,
+                   std::list<TileBinaryHash>::iterator position) :
             _wireId(id),
-            _data(data)
-        {
-        }
-
-        size_t getHitCount() const
-        {
-            return _hitCount;
-        }
-
-        void incrementHitCount()
+            _data(data),
+            _inProtected(false),
+            _position(position)
         {
-            ++_hitCount;
-        }
-
-        void decrementHitCount()
-        {
-            --_hitCount;
         }
 
         const CacheData& getData() const
@@ -75,16 +80,27 @@ private:
         {
             return _wireId;
         }
+
+        /// In the protected segment, rather than on probation.
+        bool _inProtected;
+        /// Position in the list of its segment.
+        std::list<TileBinaryHash>::iterator _position;
     } ;
-    size_t _cacheSize;
-    static const size_t CacheSizeSoftLimit = (1024 * 4 * 32); // 128k of cache
-    static const size_t CacheSizeHardLimit = CacheSizeSoftLimit * 2;
     static const size_t CacheWidHardLimit = 4096;
+    /// Byte budget of the whole cache and its protected segment.
+    size_t _maxCacheSize;
+    size_t _maxProtectedSize;
+    size_t _cacheSize;
+    size_t _protectedSize;
     size_t _cacheHits;
     size_t _cacheTests;
+    size_t _cacheEvictions;
     TileWireId _nextId;
 
     std::unordered_map< TileBinaryHash, CacheEntry > _cache;
+    /// Most recently used first.
+    std::list< TileBinaryHash > _probation;
+    std::list< TileBinaryHash > _protected;
     // This uses little storage so can be much larger
     std::unordered_map< TileBinaryHash, TileWireId > _hashToWireId;
 
@@ -94,10 +110,14 @@ private:
             LOG_DBG("cache clear " << _cache.size() << " items total size " <<
                     _cacheSize << " current hits " << _cacheHits);
         _cache.clear();
+        _probation.clear();
+        _protected.clear();
         _hashToWireId.clear();
         _cacheSize = 0;
+        _protectedSize = 0;
         _cacheHits = 0;
         _cacheTests = 0;
+        _cacheEvictions = 0;
         _nextId = 1;
     }
 
@@ -111,44 +131,46 @@ private:
         return id;
     }
 
-public:
-    // Performed only after a complete combinetiles
-    void balanceCache()
+    /// Moves the least recently used protected entries back on probation.
+    void demoteProtected()
     {
-        // A normalish PNG image size for text in a writer document is
-        // around 4k for a content tile, and sub 1k for a background one.
-        if (_cacheSize > CacheSizeHardLimit)
+        while (_protectedSize > _maxProtectedSize)
         {
-            size_t avgHits = 0;
-            for (auto it = _cache.begin(); it != _cache.end(); ++it)
-                avgHits += it->second.getHitCount();
-
-            LOG_DBG("PNG cache has " << _cache.size() << " items, total size " <<
-                    _cacheSize << ", current hits " << avgHits << ", total hit rate " <<
-                    (_cacheHits * 100. / _cacheTests) << "% at balance start.");
-            avgHits /= _cache.size();
-
-            for (auto it = _cache.begin(); it != _cache.end();)
-            {
-                if ((_cacheSize > CacheSizeSoftLimit && it->second.getHitCount() == 0) ||
-                    (_cacheSize > CacheSizeHardLimit && it->second.getHitCount() > 0 && it->second.getHitCount() <= avgHits))
-                {
-                    // Shrink cache when we exceed the size to maximize
-                    // the chance of hitting these entries in the future.
-                    _cacheSize -= it->second.getData()->size();
-                    it = _cache.erase(it);
-                }
-                else
-                {
-                    if (it->second.getHitCount() > 0)
-                        it->second.decrementHitCount();
-                    ++it;
-                }
-            }
+            const TileBinaryHash hash = _protected.back();
+            CacheEntry& entry = _cache.find(hash)->second;
+            _protected.pop_back();
+            _protectedSize -= entry.getData()->size();
+            _probation.push_front(hash);
+            entry._inProtected = false;
+            entry._position = _probation.begin();
+        }
+    }
 
-            LOG_DBG("PNG cache has " << _cache.size() << " items with total size of " <<
-                    _cacheSize << " bytes after balance.");
+    /// Evicts the least recently used entries on probation, then protected ones, to fit the budget.
+    void evict()
+    {
+        while (_cacheSize > _maxCacheSize && !_cache.empty())
+        {
+            std::list<TileBinaryHash>& segment = _probation.empty() ? _protected : _probation;
+            auto it = _cache.find(segment.back());
+            const size_t size = it->second.getData()->size();
+            if (it->second._inProtected)
+                _protectedSize -= size;
+            _cacheSize -= size;
+            segment.pop_back();
+            _cache.erase(it);
+            ++_cacheEvictions;
         }
+    }
+
+public:
+    // Performed only after a complete combinetiles
+    void balanceCache()
+    {
+        LOG_DBG("PNG cache has " << _cache.size() << " items, total size " << _cacheSize <<
+                ", protected size " << _protectedSize << ", total hit rate " <<
+                (_cacheTests ? _cacheHits * 100. / _cacheTests : 0) << "%, evictions " <<
+                _cacheEvictions << '.');
 
         if (_hashToWireId.size() > CacheWidHardLimit)
         {
@@ -177,11 +199,24 @@ public:
             {
                 ++_cacheHits;
                 LOG_DBG("PNG cache with hash " << hash << " hit.");
+                CacheEntry& entry = it->second;
                 output.insert(output.end(),
-                              it->second.getData()->begin(),
-                              it->second.getData()->end());
-                it->second.incrementHitCount();
-                imgSize = it->second.getData()->size();
+                              entry.getData()->begin(),
+                              entry.getData()->end());
+                imgSize = entry.getData()->size();
+
+                // Promote to most recently used of the protected segment.
+                if (entry._inProtected)
+                {
+                    _protected.splice(_protected.begin(), _protected, entry._position);
+                }
+                else
+                {
+                    _protected.splice(_protected.begin(), _probation, entry._position);
+                    entry._inProtected = true;
+                    _protectedSize += imgSize;
+                    demoteProtected();
+                }
 
                 return true;
             }
@@ -191,10 +226,15 @@ public:
         return false;
     }
 
-    void addToCache(const CacheData &data, TileWireId wid, const TileBinaryHash hash)
+    /// The size of the cached PNG of the tile, or 0 if it isn't cached.
+    size_t getCachedSize(const TileBinaryHash hash) const
     {
-        CacheEntry newEntry(data, wid);
+        const auto it = hash ? _cache.find(hash) : _cache.end();
+        return it != _cache.end() ? it->second.getData()->size() : 0;
+    }
 
+    void addToCache(const CacheData &data, TileWireId wid, const TileBinaryHash hash)
+    {
         if (hash)
         {
             // Adding duplicates causes grim wid mixups
@@ -202,14 +242,51 @@ public:
             assert(_cache.find(hash) == _cache.end());
 
             data->shrink_to_fit();
-            _cache.emplace(hash, newEntry);
+            _probation.push_front(hash);
+            _cache.emplace(hash, CacheEntry(data, wid, _probation.begin()));
             _cacheSize += data->size();
+            evict();
         }
     }
 
+    /// Sets the byte budget, of which 80% is for entries that were hit at least once.
+    void setMaxCacheSize(size_t maxCacheSize)
+    {
+        _maxCacheSize = maxCacheSize;
+        _maxProtectedSize = maxCacheSize / 5 * 4;
+        demoteProtected();
+        evict();
+    }
+
+    size_t getCacheSize() const { return _cacheSize; }
+    size_t getCacheHits() const { return _cacheHits; }
+    size_t getCacheMisses() const { return _cacheTests - _cacheHits; }
+    size_t getCacheEvictions() const { return _cacheEvictions; }
+
+    void dumpState(std::ostream& oss)
+    {
+        oss << "\tpngCache:"
+            << "\n\t\tsize: " << _cacheSize << " of " << _maxCacheSize << " bytes"
+            << "\n\t\tprotected: " << _protectedSize << " of " << _maxProtectedSize << " bytes"
+            << "\n\t\tentries: " << _cache.size()
+            << "\n\t\thits: " << getCacheHits()
+            << "\n\t\tmisses: " << getCacheMisses()
+            << "\n\t\tevictions: " << _cacheEvictions
+            << "\n\t\twids: " << _hashToWireId.size()
+            << '\n';
+    }
+
     PngCache()
     {
         clearCache();
+
+        // The budget is in KB, a normalish PNG image size for text in
+        // a writer document is around 4k for a content tile.
+        size_t maxCacheSize = 4 * 1024 * 1024;
+        const char *max = getenv("LOOL_PNG_CACHE_SIZE_KB");
+        if (max)
+            maxCacheSize = std::strtoul(max, nullptr, 10) * 1024;
+        setMaxCacheSize(maxCacheSize);
     }
 
     TileWireId hashToWireId(TileBinaryHash hash)
@@ -229,37 +306,146 @@ public:
     }
 };
 
+/// A job for the ThreadPool, kept inline so that queueing it doesn't allocate.
+/// Anything callable that fits in MaxSize bytes will do.
+class ThreadJob
+{
+    static const size_t MaxSize = 128;
+
+    typename std::aligned_storage<MaxSize, alignof(std::max_align_t)>::type _storage;
+    void (*_run)(void *fn);
+    /// Moves the callable from src to dst, or destroys src when dst is null.
+    void (*_manage)(void *dst, void *src);
+
+    template <typename Fn> static void run(void *fn) { (*static_cast<Fn *>(fn))(); }
+
+    template <typename Fn> static void manage(void *dst, void *src)
+    {
+        if (dst)
+            new (dst) Fn(std::move(*static_cast<Fn *>(src)));
+        static_cast<Fn *>(src)->~Fn();
+    }
+
+public:
+    ThreadJob() :
+        _run(nullptr),
+        _manage(nullptr)
+    {
+    }
+
+    template <typename Fn,
+              typename = typename std::enable_if<
+                  !std::is_same<typename std::decay<Fn>::type, ThreadJob>::value>::type>
+    ThreadJob(Fn &&fn)
+    {
+        typedef typename std::decay<Fn>::type Callable;
+        static_assert(sizeof(Callable) <= MaxSize, "Job too large, capture less by value");
+        static_assert(alignof(Callable) <= alignof(std::max_align_t), "Job over-aligned");
+        new (&_storage) Callable(std::forward<Fn>(fn));
+        _run = &run<Callable>;
+        _manage = &manage<Callable>;
+    }
+
+    ThreadJob(ThreadJob &&other) :
+        _run(other._run),
+        _manage(other._manage)
+    {
+        if (_manage)
+            _manage(&_storage, &other._storage);
+        other._run = nullptr;
+        other._manage = nullptr;
+    }
+
+    ThreadJob &operator=(ThreadJob &&other)
+    {
+        if (this != &other)
+        {
+            this->~ThreadJob();
+            new (this) ThreadJob(std::move(other));
+        }
+        return *this;
+    }
+
+    ThreadJob(const ThreadJob &) = delete;
+    ThreadJob &operator=(const ThreadJob &) = delete;
+
+    ~ThreadJob()
+    {
+        if (_manage)
+            _manage(nullptr, &_storage);
+    }
+
+    explicit operator bool() const { return _run != nullptr; }
+
+    void operator()() { _run(&_storage); }
+};
+
+/// Runs batches of jobs, tile encoding in particular, on a set of threads.
+/// Jobs are dealt out to per-thread queues; threads that run out steal from the
+/// back of the others' queues, and so does the caller while it waits. Only as
+/// many threads are woken as there are jobs, fewer when the host is overloaded.
 class ThreadPool {
+    /// The jobs dealt to one thread. Taken from the front by their owner, stolen
+    /// from the back by others. Never shrinks, so it doesn't allocate once warm.
+    struct Queue
+    {
+        Queue() : _head(0) {}
+
+        std::mutex _mutex;
+        std::vector<ThreadJob> _jobs;
+        size_t _head;
+    };
+
+    /// The first queue is the caller's, then one for each thread.
+    std::vector<std::unique_ptr<Queue>> _queues;
+    /// Jobs pushed since the last start, which no thread may run yet, as
+    /// the caller may still be using what they use. Only the caller's.
+    std::vector<ThreadJob> _staged;
+    std::vector<std::thread> _threads;
     std::mutex _mutex;
     std::condition_variable _cond;
     std::condition_variable _complete;
-    typedef std::function<void()> ThreadFn;
-    std::queue<ThreadFn> _work;
-    std::vector<std::thread> _threads;
-    size_t _working;
-    bool   _shutdown;
+    /// Jobs waiting in a queue.
+    std::atomic<size_t> _queued;
+    /// Jobs waiting or running.
+    std::atomic<size_t> _pending;
+    size_t _nextQueue;
+    bool _shutdown;
+    /// How many of the threads we may wake, given the load on the host.
+    size_t _loadLimit;
+    std::chrono::steady_clock::time_point _lastLoadCheck;
+
 public:
     ThreadPool()
-        : _working(0),
-          _shutdown(false)
+        : _queued(0),
+          _pending(0),
+          _nextQueue(0),
+          _shutdown(false),
+          _loadLimit(0)
     {
         int maxConcurrency = 2;
 #if MOBILEAPP && !defined(GTKAPP)
         maxConcurrency = std::max<int>(std::thread::hardware_concurrency(), 2);
 #else
+        // Never more than the CPUs we may run on; all of those only when asked with 0.
+        const int cpus = getAvailableCpus();
+        maxConcurrency = std::min(4, cpus);
         const char *max = getenv("MAX_CONCURRENCY");
         if (max)
-            maxConcurrency = atoi(max);
+            maxConcurrency = atoi(max) > 0 ? std::min(atoi(max), cpus) : cpus;
 #endif
         LOG_TRC("PNG compression thread pool size " << maxConcurrency);
+        for (int i = 0; i < std::max(maxConcurrency, 1); ++i)
+            _queues.emplace_back(new Queue());
         for (int i = 1; i < maxConcurrency; ++i)
-            _threads.push_back(std::thread(&ThreadPool::work, this));
+            _threads.push_back(std::thread(&ThreadPool::work, this, i));
+        _loadLimit = _threads.size();
     }
     ~ThreadPool()
     {
         {
             std::unique_lock< std::mutex > lock(_mutex);
-            assert(_working == 0);
+            assert(_pending == 0);
             _shutdown = true;
         }
         _cond.notify_all();
@@ -267,87 +453,379 @@ public:
             it.join();
     }
 
+    /// The number of CPUs this process may use: its affinity mask, further
+    /// limited by any cgroup CPU quota. The jail hides the latter, so this
+    /// is first called before entering it, and remembered.
+    static int getAvailableCpus()
+    {
+        static const int cpus = []() {
+            int count = std::max<int>(std::thread::hardware_concurrency(), 1);
+#ifdef __linux__
+            cpu_set_t set;
+            if (sched_getaffinity(0, sizeof(set), &set) == 0)
+                count = std::max(CPU_COUNT(&set), 1);
+
+            long quota = -1;
+            long period = 0;
+            std::ifstream cgroup2("/sys/fs/cgroup/cpu.max");
+            std::string quotaStr;
+            if (cgroup2 >> quotaStr >> period)
+            {
+                if (quotaStr != "max")
+                    quota = std::atol(quotaStr.c_str());
+            }
+            else
+            {
+                std::ifstream cfsQuota("/sys/fs/cgroup/cpu/cpu.cfs_quota_us");
+                std::ifstream cfsPeriod("/sys/fs/cgroup/cpu/cpu.cfs_period_us");
+                if (!(cfsQuota >> quota) || !(cfsPeriod >> period))
+                    quota = -1;
+            }
+
+            if (quota > 0 && period > 0)
+                count = std::max<int>(std::min<long>(count, (quota + period - 1) / period), 1);
+#endif
+            LOG_INF("Found " << count << " CPUs available for rendering.");
+            return count;
+        }();
+        return cpus;
+    }
+
+    /// Opened before entering the jail, as that may lack /proc.
+    static int getLoadAvgFile()
+    {
+#ifdef __linux__
+        static const int fd = open("/proc/loadavg", O_RDONLY | O_CLOEXEC);
+        return fd;
+#else
+        return -1;
+#endif
+    }
+
+    /// Gathers what the jail will hide from us later.
+    static void initialize()
+    {
+        getAvailableCpus();
+        getLoadAvgFile();
+    }
+
     size_t count() const
     {
-        return _work.size();
+        return _queued;
     }
 
-    void pushWorkUnlocked(const ThreadFn &fn)
+    /// Queues a job, to run once started.
+    void pushWork(ThreadJob &&job)
     {
-        _work.push(fn);
+        _staged.push_back(std::move(job));
     }
 
-    void runOne(std::unique_lock< std::mutex >& lock)
+    /// Hands the queued work to the threads and returns at once,
+    /// so the caller can get on with something else meanwhile.
+    void start()
     {
-        assert(!_work.empty());
+        publish();
 
-        ThreadFn fn = _work.front();
-        _work.pop();
-        _working++;
-        lock.unlock();
+        const size_t queued = _queued;
+        if (_threads.empty() || queued == 0)
+            return;
 
-        fn();
+        updateLoadLimit();
 
-        lock.lock();
-        _working--;
-        if (_work.empty() && _working == 0)
-            _complete.notify_all();
+        std::unique_lock< std::mutex > lock(_mutex);
+        const size_t wake = std::min(queued, _loadLimit);
+        for (size_t i = 0; i < wake; ++i)
+            _cond.notify_one();
     }
 
-    void run()
+    /// Helps with whatever work is still queued, then waits for the rest.
+    void wait()
     {
+        publish();
+        runJobs(0);
+
         std::unique_lock< std::mutex > lock(_mutex);
-        assert(_working == 0);
+        _complete.wait(lock, [this]() { return _pending == 0; } );
 
-        // Avoid notifying threads if we don't need to.
-        bool useThreads = _threads.size() > 1 && _work.size() > 1;
-        if (useThreads)
-            _cond.notify_all();
+        assert(_queued == 0);
+        _nextQueue = 0;
+    }
 
-        while(!_work.empty())
-            runOne(lock);
+private:
+    /// Deals the staged jobs out to the queues, where the threads find them.
+    void publish()
+    {
+        if (_staged.empty())
+            return;
 
-        if (useThreads && (_working > 0 || !_work.empty()))
-            _complete.wait(lock, [this]() { return _working == 0 && _work.empty(); } );
+        _pending += _staged.size();
+        for (ThreadJob &job : _staged)
+        {
+            Queue &queue = *_queues[_nextQueue++ % _queues.size()];
+            {
+                std::unique_lock< std::mutex > lock(queue._mutex);
+                queue._jobs.push_back(std::move(job));
+            }
+            ++_queued;
+        }
+        _staged.clear();
+    }
 
-        assert(_working==0);
-        assert(_work.empty());
+    /// Backs off, in proportion, when there are more runnable tasks than CPUs.
+    void updateLoadLimit()
+    {
+        const auto now = std::chrono::steady_clock::now();
+        if (now - _lastLoadCheck < std::chrono::seconds(1))
+            return;
+        _lastLoadCheck = now;
+
+        const int fd = getLoadAvgFile();
+        char buffer[64];
+        const ssize_t size = fd >= 0 ? pread(fd, buffer, sizeof(buffer) - 1, 0) : -1;
+        if (size <= 0)
+            return;
+        buffer[size] = '\0';
+
+        const double load = std::atof(buffer);
+        const double cpus = getAvailableCpus();
+        _loadLimit = _threads.size();
+        if (load > cpus)
+            _loadLimit = std::max<size_t>(1, _loadLimit * cpus / load);
+        LOG_TRC("Load average " << load << " on " << cpus << " CPUs, waking up to " <<
+                _loadLimit << " of " << _threads.size() << " threads.");
     }
 
-    void work()
+    /// Takes a job from our own queue, else steals one from another's.
+    bool takeJob(size_t index, ThreadJob &job)
     {
-        std::unique_lock< std::mutex > lock(_mutex);
-        while (!_shutdown)
+        for (size_t i = 0; i < _queues.size(); ++i)
+        {
+            Queue &queue = *_queues[(index + i) % _queues.size()];
+            std::unique_lock< std::mutex > lock(queue._mutex);
+            if (queue._head == queue._jobs.size())
+                continue;
+
+            if (i == 0)
+            {
+                job = std::move(queue._jobs[queue._head++]);
+            }
+            else
+            {
+                job = std::move(queue._jobs.back());
+                queue._jobs.pop_back();
+            }
+
+            if (queue._head == queue._jobs.size())
+            {
+                queue._jobs.clear();
+                queue._head = 0;
+            }
+
+            --_queued;
+            return true;
+        }
+
+        return false;
+    }
+
+    void runJobs(size_t index)
+    {
+        ThreadJob job;
+        while (takeJob(index, job))
+        {
+            job();
+            job = ThreadJob();
+
+            if (--_pending == 0)
+            {
+                std::unique_lock< std::mutex > lock(_mutex);
+                _complete.notify_all();
+            }
+        }
+    }
+
+    void work(size_t index)
+    {
+        for (;;)
         {
-            _cond.wait(lock);
-            if (!_shutdown && !_work.empty())
-                runOne(lock);
+            runJobs(index);
+
+            std::unique_lock< std::mutex > lock(_mutex);
+            _cond.wait(lock, [this]() { return _shutdown || _queued > 0; });
+            if (_shutdown)
+                break;
         }
     }
 };
 
-namespace RenderTiles
+/// Recycles the large, page-aligned buffers that tile combines are
+/// painted into, and the buffer the encoded tiles are collected in.
+/// Rapid scrolling renders one combine after another of much the same
+/// size; allocating each afresh costs a page fault per 4k of pixmap.
+class PixmapPool
 {
-    struct Buffer {
-        unsigned char *_data;
-        Buffer()
+    /// Beyond this many idle bytes, buffers are returned to the system.
+    static const size_t MaxPooledBytes = 64 * 1024 * 1024;
+    /// Buffers this large are offered to transparent huge pages.
+    static const size_t HugePageSize = 2 * 1024 * 1024;
+
+    std::mutex _mutex;
+    /// Idle buffers and their capacity, least recently released first.
+    std::vector<std::pair<unsigned char *, size_t>> _free;
+    size_t _pooledBytes;
+    size_t _allocatedBytes;
+    size_t _peakAllocatedBytes;
+    size_t _acquires;
+    size_t _reuses;
+    size_t _unmaps;
+    std::vector<char> _output;
+
+    static size_t roundUp(size_t size)
+    {
+        const size_t align = size >= HugePageSize ? HugePageSize : getpagesize();
+        return (size + align - 1) / align * align;
+    }
+
+    void unmap(unsigned char *data, size_t capacity)
+    {
+        munmap(data, capacity);
+        _allocatedBytes -= capacity;
+        ++_unmaps;
+    }
+
+public:
+    PixmapPool() :
+        _pooledBytes(0),
+        _allocatedBytes(0),
+        _peakAllocatedBytes(0),
+        _acquires(0),
+        _reuses(0),
+        _unmaps(0)
+    {
+    }
+
+    ~PixmapPool()
+    {
+        for (const auto& it : _free)
+            munmap(it.first, it.second);
+    }
+
+    /// Returns a page-aligned buffer of at least size bytes and its real capacity.
+    /// Newly mapped buffers are always zero; recycled ones only when asked.
+    unsigned char *acquire(size_t size, bool clear, size_t& capacity)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        ++_acquires;
+
+        // Best fit, so a small combine doesn't pin down a large buffer.
+        auto best = _free.end();
+        for (auto it = _free.begin(); it != _free.end(); ++it)
+        {
+            if (it->second >= size && (best == _free.end() || it->second < best->second))
+                best = it;
+        }
+
+        if (best != _free.end())
+        {
+            unsigned char *data = best->first;
+            capacity = best->second;
+            _pooledBytes -= capacity;
+            _free.erase(best);
+            ++_reuses;
+            lock.unlock();
+
+            if (clear)
+                std::memset(data, 0, size);
+            return data;
+        }
+
+        capacity = roundUp(size);
+        void *data = mmap(nullptr, capacity, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (data == MAP_FAILED)
+        {
+            LOG_SYS("Failed to map " << capacity << " bytes for a pixmap");
+            throw std::bad_alloc();
+        }
+#ifdef MADV_HUGEPAGE
+        if (capacity >= HugePageSize)
+            madvise(data, capacity, MADV_HUGEPAGE);
+#endif
+        _allocatedBytes += capacity;
+        _peakAllocatedBytes = std::max(_peakAllocatedBytes, _allocatedBytes);
+        return static_cast<unsigned char *>(data);
+    }
+
+    void release(unsigned char *data, size_t capacity)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        if (capacity > MaxPooledBytes)
         {
-            _data = nullptr;
+            unmap(data, capacity);
+            return;
         }
-        Buffer(size_t x, size_t y) :
-            Buffer()
+
+        while (_pooledBytes + capacity > MaxPooledBytes && !_free.empty())
         {
-            allocate(x, y);
+            _pooledBytes -= _free.front().second;
+            unmap(_free.front().first, _free.front().second);
+            _free.erase(_free.begin());
         }
-        void allocate(size_t x, size_t y)
+
+        _free.emplace_back(data, capacity);
+        _pooledBytes += capacity;
+    }
+
+    /// Hands out the output buffer for encoded tiles, empty but keeping its capacity.
+    std::vector<char> takeOutput()
+    {
+        std::vector<char> output;
+        std::unique_lock<std::mutex> lock(_mutex);
+        output.swap(_output);
+        output.clear();
+        return output;
+    }
+
+    void returnOutput(std::vector<char>& output)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        if (output.capacity() <= MaxPooledBytes)
+            _output.swap(output);
+    }
+
+    void dumpState(std::ostream& oss)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        oss << "\tpixmapPool:"
+            << "\n\t\tfree: " << _free.size() << " buffers of " << _pooledBytes << " bytes"
+            << "\n\t\tallocated: " << _allocatedBytes << " bytes, peak " << _peakAllocatedBytes
+            << "\n\t\tacquires: " << _acquires
+            << "\n\t\treuses: " << _reuses
+            << "\n\t\tunmaps: " << _unmaps
+            << "\n\t\toutput capacity: " << _output.capacity()
+            << '\n';
+    }
+};
+
+namespace RenderTiles
+{
+    /// A pixmap borrowed from a PixmapPool for the duration of a render.
+    class Buffer {
+        PixmapPool& _pool;
+        unsigned char *_data;
+        size_t _capacity;
+    public:
+        Buffer(PixmapPool& pool, size_t x, size_t y, bool clear) :
+            _pool(pool),
+            _data(nullptr),
+            _capacity(0)
         {
-            assert(!_data);
-            _data = static_cast<unsigned char *>(calloc(x * y, 4));
+            _data = _pool.acquire(x * y * 4, clear, _capacity);
         }
         ~Buffer()
         {
             if (_data)
-                free (_data);
+                _pool.release(_data, _capacity);
         }
         unsigned char *data() { return _data; }
     };
@@ -466,169 +944,324 @@ namespace RenderTiles
 
 #endif
 
-    bool doRender(std::shared_ptr<lok::Document> document,
-                  TileCombined &tileCombined,
-                  PngCache &pngCache,
-                  ThreadPool &pngPool,
-                  bool combined,
-                  const std::function<void (unsigned char *data,
-                                            int offsetX, int offsetY,
-                                            size_t pixmapWidth, size_t pixmapHeight,
-                                            int pixelWidth, int pixelHeight,
-                                            LibreOfficeKitTileMode mode)>& blendWatermark,
-                  const std::function<void (const char *buffer, size_t length)>& outputMessage)
-    {
-        auto& tiles = tileCombined.getTiles();
-
-        // Calculate the area we cover
-        Util::Rectangle renderArea;
-        std::vector<Util::Rectangle> tileRecs;
-        tileRecs.reserve(tiles.size());
-
-        for (auto& tile : tiles)
+    /// A group of neighbouring tiles, painted in a single call.
+    struct Area
+    {
+        Area(PixmapPool& pixmapPool, const Util::Rectangle& renderArea,
+             size_t pixmapWidth, size_t pixmapHeight) :
+            _renderArea(renderArea),
+            _pixmapWidth(pixmapWidth),
+            _pixmapHeight(pixmapHeight),
+            // paintPartTile() erases the whole area before painting into it,
+            // so a recycled pixmap needn't be cleared first.
+            _pixmap(pixmapPool, pixmapWidth, pixmapHeight, false)
         {
-            Util::Rectangle rectangle(tile.getTilePosX(), tile.getTilePosY(),
-                                      tileCombined.getTileWidth(), tileCombined.getTileHeight());
-
-            if (tileRecs.empty())
-            {
-                renderArea = rectangle;
-            }
-            else
-            {
-                renderArea.extend(rectangle);
-            }
-
-            tileRecs.push_back(rectangle);
         }
 
-        assert(tiles.size() == tileRecs.size());
-
-        const size_t tilesByX = renderArea.getWidth() / tileCombined.getTileWidth();
-        const size_t tilesByY = renderArea.getHeight() / tileCombined.getTileHeight();
-        const int pixelWidth = tileCombined.getWidth();
-        const int pixelHeight = tileCombined.getHeight();
-        const size_t pixmapWidth = tilesByX * pixelWidth;
-        const size_t pixmapHeight = tilesByY * pixelHeight;
-
-        if (pixmapWidth > 4096 || pixmapHeight > 4096)
-            LOG_WRN("Unusual extremely large tile combine of size " << pixmapWidth << 'x' << pixmapHeight);
-
-        RenderTiles::Buffer pixmap(pixmapWidth, pixmapHeight);
-
-        // Render the whole area
-        const double area = pixmapWidth * pixmapHeight;
-        const auto start = std::chrono::steady_clock::now();
-        LOG_TRC("Calling paintPartTile(" << (void*)pixmap.data() << ')');
-        document->paintPartTile(pixmap.data(),
-                                tileCombined.getPart(),
-                                pixmapWidth, pixmapHeight,
-                                renderArea.getLeft(), renderArea.getTop(),
-                                renderArea.getWidth(), renderArea.getHeight());
-        auto duration = std::chrono::steady_clock::now() - start;
-        const auto elapsedMs = std::chrono::duration_cast<std::chrono::milliseconds>(duration);
-        const double elapsedMics = elapsedMs.count() * 1000.; // Need MPixels/sec, use Pixels/mics.
-        LOG_DBG("paintPartTile at ("
-                << renderArea.getLeft() << ", " << renderArea.getTop() << "), ("
-                << renderArea.getWidth() << ", " << renderArea.getHeight() << ") "
-                << " rendered in " << elapsedMs << " (" << area / elapsedMics << " MP/s).");
-
-#ifdef IOS
+        const Util::Rectangle _renderArea;
+        const size_t _pixmapWidth;
+        const size_t _pixmapHeight;
+        Buffer _pixmap;
+    };
 
-        for (int i = 0; i < tiles.size(); i++)
+    /// A tile combine on its way through the pipeline: painted by LOK on
+    /// the main thread, then encoded by the PNG pool while the main thread
+    /// already paints the next one, and finally sent in order.
+    struct Render
+    {
+        Render(PixmapPool& pixmapPool, const TileCombined& tileCombined, bool combined) :
+            _tileCombined(tileCombined),
+            _combined(combined),
+            _output(pixmapPool.takeOutput()),
+            _zeroCheckStart(0),
+            _tileCount(0)
         {
-            static int bmpFileCounter = 0;
-            const int bmpId = bmpFileCounter++;
+        }
 
-            const size_t positionX = (tileRecs[i].getLeft() - renderArea.getLeft()) / tileCombined.getTileWidth();
-            const size_t positionY = (tileRecs[i].getTop() - renderArea.getTop()) / tileCombined.getTileHeight();
+        TileCombined _tileCombined;
+        bool _combined;
+        std::vector<Util::Rectangle> _tileRecs;
+        std::vector<std::unique_ptr<Area>> _areas;
+        /// The index in _areas of the area each tile was painted in.
+        std::vector<size_t> _tileAreas;
+        std::chrono::steady_clock::time_point _start;
+
+        /// Encoded tiles, appended to by the PNG pool under _pngMutex.
+        std::vector<char> _output;
+        std::vector<TileDesc> _renderedTiles;
+        std::vector<TileDesc> _duplicateTiles;
+        std::vector<TileBinaryHash> _duplicateHashes;
+        /// Tiles before this one in _renderedTiles were not encoded by the pool.
+        size_t _zeroCheckStart;
+        size_t _tileCount;
+        std::mutex _pngMutex;
+    };
 
-            const int offsetX = positionX * pixelWidth;
-            const int offsetY = positionY * pixelHeight;
+    /// Groups tiles into rectangles, each to be painted in one call.
+    /// Painting the tiles between two requested ones is a waste, but so is the
+    /// overhead of every paintPartTile call, so groups are merged greedily for
+    /// as long as painting their bounding box costs less than painting them apart.
+    /// Returns the index in areas of the group of each tile.
+    static std::vector<size_t> clusterTiles(const std::vector<Util::Rectangle>& tileRecs,
+                                            int tileWidth, int tileHeight,
+                                            std::vector<Util::Rectangle>& areas)
+    {
+        // The overhead of a paintPartTile call, in painted tiles.
+        static const long PaintCallCost = 2;
+
+        const auto cost = [tileWidth, tileHeight](const Util::Rectangle& area) {
+            return static_cast<long>(area.getWidth() / tileWidth) * (area.getHeight() / tileHeight)
+                + PaintCallCost;
+        };
+
+        std::vector<size_t> tileAreas(tileRecs.size(), 0);
+        areas.clear();
+        if (tileRecs.empty())
+            return tileAreas;
+
+        // Usually the tiles form a full rectangle, with nothing to gain.
+        Util::Rectangle bounds = tileRecs[0];
+        for (Util::Rectangle rectangle : tileRecs)
+            bounds.extend(rectangle);
+        if (cost(bounds) - PaintCallCost <= static_cast<long>(tileRecs.size()))
+        {
+            areas.push_back(bounds);
+            return tileAreas;
+        }
 
-            NSString *mmapFileBaseName = [NSString stringWithFormat:@"%d.bmp", bmpId];
-            NSURL *mmapFileURL = [[NSFileManager.defaultManager temporaryDirectory] URLByAppendingPathComponent:mmapFileBaseName];
+        // Start from the runs of adjacent tiles in each row, which merging
+        // would join first anyway, as it wastes nothing.
+        std::vector<size_t> order(tileRecs.size());
+        for (size_t i = 0; i < order.size(); ++i)
+            order[i] = i;
+        std::sort(order.begin(), order.end(), [&tileRecs](size_t a, size_t b) {
+                return tileRecs[a].getTop() < tileRecs[b].getTop() ||
+                    (tileRecs[a].getTop() == tileRecs[b].getTop() &&
+                     tileRecs[a].getLeft() < tileRecs[b].getLeft());
+            });
+        for (size_t i : order)
+        {
+            const Util::Rectangle& rectangle = tileRecs[i];
+            if (areas.empty() || areas.back().getTop() != rectangle.getTop() ||
+                areas.back().getRight() < rectangle.getLeft())
+                areas.push_back(rectangle);
+            else
+                areas.back().setRight(std::max(areas.back().getRight(), rectangle.getRight()));
+            tileAreas[i] = areas.size() - 1;
+        }
 
-            int fd = open([[mmapFileURL path] UTF8String], O_RDWR|O_CREAT, 0666);
-            if (fd == -1)
+        for (;;)
+        {
+            long bestSaving = -1;
+            size_t bestI = 0;
+            size_t bestJ = 0;
+            for (size_t i = 0; i < areas.size(); ++i)
             {
-                LOG_SYS("Could not create file " << [[mmapFileURL path] UTF8String]);
-                return false;
+                for (size_t j = i + 1; j < areas.size(); ++j)
+                {
+                    Util::Rectangle merged = areas[i];
+                    merged.extend(areas[j]);
+                    const long saving = cost(areas[i]) + cost(areas[j]) - cost(merged);
+                    if (saving > bestSaving)
+                    {
+                        bestSaving = saving;
+                        bestI = i;
+                        bestJ = j;
+                    }
+                }
             }
 
-            const size_t mmapFileSize = bmpFileSize(pixelWidth, pixelHeight);
+            if (bestSaving < 0)
+                break;
 
-            if (lseek(fd, mmapFileSize-1, SEEK_SET) == -1)
+            areas[bestI].extend(areas[bestJ]);
+            areas.erase(areas.begin() + bestJ);
+            for (size_t& index : tileAreas)
             {
-                LOG_SYS("Could not seek in file " << [[mmapFileURL path] UTF8String]);
-                return false;
+                if (index == bestJ)
+                    index = bestI;
+                else if (index > bestJ)
+                    --index;
             }
+        }
 
-            if (write(fd, "", 1) == -1)
-            {
-                LOG_SYS("Could not write at end of " << [[mmapFileURL path] UTF8String]);
-                return false;
-            }
+        return tileAreas;
+    }
 
-            char *mmapMemory = (char *)mmap(NULL, mmapFileSize, PROT_READ|PROT_WRITE, MAP_FILE|MAP_SHARED, fd, 0);
-            if (mmapMemory == MAP_FAILED)
-            {
-                LOG_SYS("Could not map in file " << [[mmapFileURL path] UTF8String]);
-                close(fd);
-                return false;
-            }
+    /// Paints a tile combine into pixmaps from the pool; the first stage of rendering.
+    std::unique_ptr<Render> paintTiles(std::shared_ptr<lok::Document> document,
+                                       const TileCombined &tileCombined,
+                                       bool combined,
+                                       PixmapPool &pixmapPool)
+    {
+        const auto& tiles = tileCombined.getTiles();
 
-            close(fd);
+        std::unique_ptr<Render> render(new Render(pixmapPool, tileCombined, combined));
+        render->_start = std::chrono::steady_clock::now();
 
-            generateBmpHeader(mmapMemory, pixelWidth, pixelHeight);
+        std::vector<Util::Rectangle>& tileRecs = render->_tileRecs;
+        tileRecs.reserve(tiles.size());
+        for (auto& tile : tiles)
+        {
+            tileRecs.emplace_back(tile.getTilePosX(), tile.getTilePosY(),
+                                  tileCombined.getTileWidth(), tileCombined.getTileHeight());
+        }
 
-            for (int y = 0; y < pixelHeight; y++)
-                memcpy(mmapMemory + sizeof(BITMAPFILEHEADER) + sizeof(BITMAPV5HEADER) + y * pixelWidth * 4,
-                       pixmap.data() + (offsetY + y) * pixmapWidth * 4 + offsetX * 4,
-                       pixelWidth * 4);
+        assert(tiles.size() == tileRecs.size());
 
-            if (munmap(mmapMemory, mmapFileSize) == -1)
-            {
-                LOG_SYS("Could not unmap file " << [[mmapFileURL path] UTF8String]);
-                return false;
-            }
+        // Calculate the areas we cover
+        std::vector<Util::Rectangle> renderAreas;
+        render->_tileAreas = clusterTiles(tileRecs, tileCombined.getTileWidth(),
+                                          tileCombined.getTileHeight(), renderAreas);
 
-            std::string tileMsg = tiles[i].serialize("tile:", ADD_DEBUG_RENDERID) + std::string([[mmapFileURL absoluteString] UTF8String]);
-            outputMessage(tileMsg.c_str(), tileMsg.length());
+        std::vector<size_t> tilesPerArea(renderAreas.size(), 0);
+        for (size_t index : render->_tileAreas)
+            ++tilesPerArea[index];
+
+        for (size_t i = 0; i < renderAreas.size(); ++i)
+        {
+            const Util::Rectangle& renderArea = renderAreas[i];
+            const size_t tilesByX = renderArea.getWidth() / tileCombined.getTileWidth();
+            const size_t tilesByY = renderArea.getHeight() / tileCombined.getTileHeight();
+            const int pixelWidth = tileCombined.getWidth();
+            const int pixelHeight = tileCombined.getHeight();
+            const size_t pixmapWidth = tilesByX * pixelWidth;
+            const size_t pixmapHeight = tilesByY * pixelHeight;
+
+            if (pixmapWidth > 4096 || pixmapHeight > 4096)
+                LOG_WRN("Unusual extremely large tile combine of size " << pixmapWidth << 'x' << pixmapHeight);
+
+            render->_areas.emplace_back(new Area(pixmapPool, renderArea, pixmapWidth, pixmapHeight));
+            Buffer& pixmap = render->_areas.back()->_pixmap;
+
+            // Render the whole area
+            const double area = pixmapWidth * pixmapHeight;
+            const double wasted = 100. * (tilesByX * tilesByY - tilesPerArea[i]) / (tilesByX * tilesByY);
+            const auto start = std::chrono::steady_clock::now();
+            LOG_TRC("Calling paintPartTile(" << (void*)pixmap.data() << ')');
+            document->paintPartTile(pixmap.data(),
+                                    tileCombined.getPart(),
+                                    pixmapWidth, pixmapHeight,
+                                    renderArea.getLeft(), renderArea.getTop(),
+                                    renderArea.getWidth(), renderArea.getHeight());
+            const auto duration = std::chrono::steady_clock::now() - start;
+            const auto elapsedMs = std::chrono::duration_cast<std::chrono::milliseconds>(duration);
+            const double elapsedMics = elapsedMs.count() * 1000.; // Need MPixels/sec, use Pixels/mics.
+            LOG_DBG("paintPartTile at ("
+                    << renderArea.getLeft() << ", " << renderArea.getTop() << "), ("
+                    << renderArea.getWidth() << ", " << renderArea.getHeight() << ") "
+                    << " rendered in " << elapsedMs << " (" << area / elapsedMics << " MP/s), "
+                    << wasted << "% of pixels not requested, area " << i + 1 << " of "
+                    << renderAreas.size() << '.');
         }
 
-#else
+        return render;
+    }
+
+    /// Hashes the tiles of a painted combine, finds what can be skipped, sent as a
+    /// delta or taken from the cache, and starts the PNG pool on the rest.
+    /// The pool must be idle: the previous combine finished.
+    void encodeTiles(Render &render,
+                     std::shared_ptr<lok::Document> document,
+                     PngCache &pngCache,
+                     ThreadPool &pngPool,
+                     DeltaGenerator &deltaGen,
+                     const std::function<void (unsigned char *data,
+                                               int offsetX, int offsetY,
+                                               size_t pixmapWidth, size_t pixmapHeight,
+                                               int pixelWidth, int pixelHeight,
+                                               LibreOfficeKitTileMode mode)>& blendWatermark)
+    {
+#ifndef IOS
+        const TileCombined& tileCombined = render._tileCombined;
+        const auto& tiles = tileCombined.getTiles();
+        const int pixelWidth = tileCombined.getWidth();
+        const int pixelHeight = tileCombined.getHeight();
+
+        std::vector<char>& output = render._output;
+        std::vector<TileDesc>& renderedTiles = render._renderedTiles;
+        std::vector<TileDesc>& duplicateTiles = render._duplicateTiles;
+        std::vector<TileBinaryHash>& duplicateHashes = render._duplicateHashes;
 
         const auto mode = static_cast<LibreOfficeKitTileMode>(document->getTileMode());
 
-        const size_t pixmapSize = 4 * pixmapWidth * pixmapHeight;
-        std::vector<char> output;
-        output.reserve(pixmapSize);
+        // Blending and hashing touch every pixel, so they run on the pool. Anything
+        // that decides or allocates wire ids stays serial below, in tile order.
+        struct TileHash
+        {
+            uint64_t _hash;
+            uint32_t _solidColour;
+            bool _solid;
+        };
+        std::vector<TileHash> tileHashes(tiles.size());
+        // The hash of each row of each tile, for delta detection.
+        std::vector<uint64_t> rowHashes(tiles.size() * pixelHeight);
+
+        for (size_t i = 0; i < tiles.size(); ++i)
+        {
+            Area& paintedArea = *render._areas[render._tileAreas[i]];
+            const Util::Rectangle& renderArea = paintedArea._renderArea;
+            const size_t pixmapWidth = paintedArea._pixmapWidth;
+            const size_t pixmapHeight = paintedArea._pixmapHeight;
+            unsigned char *pixmap = paintedArea._pixmap.data();
+            const Util::Rectangle& tileRect = render._tileRecs[i];
+
+            const int offsetX = (tileRect.getLeft() - renderArea.getLeft()) / tileCombined.getTileWidth() * pixelWidth;
+            const int offsetY = (tileRect.getTop() - renderArea.getTop()) / tileCombined.getTileHeight() * pixelHeight;
+
+            TileHash& tileHash = tileHashes[i];
+            uint64_t *tileRowHashes = &rowHashes[i * pixelHeight];
+            const auto hashTile = [=,&tileHash,&blendWatermark]() {
+                blendWatermark(pixmap, offsetX, offsetY,
+                               pixmapWidth, pixmapHeight,
+                               pixelWidth, pixelHeight,
+                               mode);
+
+                // Margins and empty cells are mostly of a single colour, no need to hash or compress those.
+                // The check bails out at the first pixel of another colour, so it's cheap for the rest.
+                tileHash._solidColour = 0;
+                tileHash._solid = Png::isSolidColour(pixmap, offsetX, offsetY,
+                                                     pixelWidth, pixelHeight, pixmapWidth,
+                                                     tileHash._solidColour);
+                tileHash._hash = tileHash._solid
+                    ? Png::hashSolidColour(tileHash._solidColour, pixelWidth, pixelHeight)
+                    : Png::hashSubBufferRows(pixmap, offsetX, offsetY,
+                                             pixelWidth, pixelHeight, pixmapWidth, pixmapHeight,
+                                             tileRowHashes);
+            };
+
+            // Any watermark is rendered by LOK on its first use, so do that here.
+            if (i == 0)
+                hashTile();
+            else
+                pngPool.pushWork(hashTile);
+        }
+
+        pngPool.start();
+        pngPool.wait();
 
         // Compress the area as tiles
-        std::vector<TileDesc> renderedTiles;
-        std::vector<TileDesc> duplicateTiles;
-        std::vector<TileBinaryHash> duplicateHashes;
         std::vector<TileWireId> renderingIds;
 
         size_t tileIndex = 0;
 
-        std::mutex pngMutex;
-
-        for (Util::Rectangle& tileRect : tileRecs)
+        for (const Util::Rectangle& tileRect : render._tileRecs)
         {
+            Area& paintedArea = *render._areas[render._tileAreas[tileIndex]];
+            const Util::Rectangle& renderArea = paintedArea._renderArea;
+            const size_t pixmapWidth = paintedArea._pixmapWidth;
+            const size_t pixmapHeight = paintedArea._pixmapHeight;
+            unsigned char *pixmap = paintedArea._pixmap.data();
+
             const size_t positionX = (tileRect.getLeft() - renderArea.getLeft()) / tileCombined.getTileWidth();
             const size_t positionY = (tileRect.getTop() - renderArea.getTop()) / tileCombined.getTileHeight();
 
             const int offsetX = positionX * pixelWidth;
             const int offsetY = positionY * pixelHeight;
-            blendWatermark(pixmap.data(), offsetX, offsetY,
-                           pixmapWidth, pixmapHeight,
-                           pixelWidth, pixelHeight,
-                           mode);
 
-            const uint64_t hash = Png::hashSubBuffer(pixmap.data(), offsetX, offsetY,
-                                                     pixelWidth, pixelHeight, pixmapWidth, pixmapHeight);
+            const uint32_t solidColour = tileHashes[tileIndex]._solidColour;
+            const bool solid = tileHashes[tileIndex]._solid;
+            const uint64_t hash = tileHashes[tileIndex]._hash;
 
             TileWireId wireId = pngCache.hashToWireId(hash);
             TileWireId oldWireId = tiles[tileIndex].getOldWireId();
@@ -646,6 +1279,27 @@ namespace RenderTiles
 
             bool skipCompress = false;
             size_t imgSize = -1;
+            if (hash != 0 && !solid && tiles[tileIndex].getAllowDelta())
+            {
+                // Keep every tile the client may hold, to build later deltas against.
+                // Prefer the PNG if we have it cached and it is smaller.
+                const size_t pngSize = pngCache.getCachedSize(hash);
+                const size_t deltaStart = output.size();
+                if (deltaGen.createDelta(pixmap, offsetX, offsetY, pixelWidth, pixelHeight,
+                                         pixmapWidth, pixmapHeight, output, wireId, oldWireId, mode,
+                                         &rowHashes[tileIndex * pixelHeight],
+                                         pngSize && pngSize < DeltaGenerator::MaxDeltaSize
+                                             ? pngSize : DeltaGenerator::MaxDeltaSize))
+                {
+                    imgSize = output.size() - deltaStart;
+                    LOG_TRC("Delta for tile #" << tileIndex << " against oldWireId: " << oldWireId <<
+                            " wireId: " << wireId << " is " << imgSize << " bytes.");
+                    pushRendered(renderedTiles, tiles[tileIndex], wireId, imgSize);
+                    tileIndex++;
+                    continue;
+                }
+            }
+
             if (pngCache.copyFromCache(hash, output, imgSize))
             {
                 pushRendered(renderedTiles, tiles[tileIndex], wireId, imgSize);
@@ -670,18 +1324,31 @@ namespace RenderTiles
                 }
             }
 
+            if (!skipCompress && solid)
+            {
+                PngCache::CacheData data(new std::vector< char >() );
+                if (Png::encodeSolidColourToPNG(solidColour, pixelWidth, pixelHeight, *data, mode))
+                {
+                    LOG_TRC("Solid colour tile #" << tileIndex << " is " << data->size() << " bytes.");
+                    output.insert(output.end(), data->begin(), data->end());
+                    pngCache.addToCache(data, wireId, hash);
+                    pushRendered(renderedTiles, tiles[tileIndex], wireId, data->size());
+                    skipCompress = true;
+                }
+            }
+
             if (!skipCompress)
             {
                 renderingIds.push_back(wireId);
 
-                // Queue to be executed later in parallel inside 'run'
-                pngPool.pushWorkUnlocked([=,&output,&pixmap,&tiles,&renderedTiles,&pngCache,&pngMutex](){
+                // Queue to be executed in parallel once started, finished inside 'wait'
+                pngPool.pushWork([=,&render,&pngCache](){
 
                         PngCache::CacheData data(new std::vector< char >() );
                         data->reserve(pixmapWidth * pixmapHeight * 1);
 
                         LOG_DBG("Encode a new png for tile #" << tileIndex);
-                        if (!Png::encodeSubBufferToPNG(pixmap.data(), offsetX, offsetY, pixelWidth, pixelHeight,
+                        if (!Png::encodeSubBufferToPNG(pixmap, offsetX, offsetY, pixelWidth, pixelHeight,
                                                        pixmapWidth, pixmapHeight, *data, mode))
                         {
                             // FIXME: Return error.
@@ -691,10 +1358,11 @@ namespace RenderTiles
                         }
 
                         LOG_DBG("Tile " << tileIndex << " is " << data->size() << " bytes.");
-                        std::unique_lock<std::mutex> pngLock(pngMutex);
-                        output.insert(output.end(), data->begin(), data->end());
+                        std::unique_lock<std::mutex> pngLock(render._pngMutex);
+                        render._output.insert(render._output.end(), data->begin(), data->end());
                         pngCache.addToCache(data, wireId, hash);
-                        pushRendered(renderedTiles, tiles[tileIndex], wireId, data->size());
+                        pushRendered(render._renderedTiles, render._tileCombined.getTiles()[tileIndex],
+                                     wireId, data->size());
                     });
             }
 
@@ -703,12 +1371,110 @@ namespace RenderTiles
             tileIndex++;
         }
 
+        render._tileCount = tileIndex;
+
         // empty ones come first
-        size_t zeroCheckStart = renderedTiles.size();
+        render._zeroCheckStart = renderedTiles.size();
+
+        pngPool.start();
+#endif
+    }
+
+    /// Waits for the PNG pool to encode a combine, and sends its tiles.
+    /// With tileShm, the tiles go through it when they fit, and the message
+    /// carries only their position as shm=.
+    /// Returns false when there was nothing to send.
+    bool finishTiles(Render &render,
+                     PngCache &pngCache,
+                     ThreadPool &pngPool,
+                     PixmapPool &pixmapPool,
+                     TileShm *tileShm,
+                     const std::function<void (const char *buffer, size_t length)>& outputMessage)
+    {
+        const TileCombined& tileCombined = render._tileCombined;
+
+#ifdef IOS
+        const auto& tiles = tileCombined.getTiles();
+        const std::vector<Util::Rectangle>& tileRecs = render._tileRecs;
+        const int pixelWidth = tileCombined.getWidth();
+        const int pixelHeight = tileCombined.getHeight();
+
+        for (int i = 0; i < tiles.size(); i++)
+        {
+            static int bmpFileCounter = 0;
+            const int bmpId = bmpFileCounter++;
+
+            Area& paintedArea = *render._areas[render._tileAreas[i]];
+            const Util::Rectangle& renderArea = paintedArea._renderArea;
+            const size_t pixmapWidth = paintedArea._pixmapWidth;
+            Buffer& pixmap = paintedArea._pixmap;
+
+            const size_t positionX = (tileRecs[i].getLeft() - renderArea.getLeft()) / tileCombined.getTileWidth();
+            const size_t positionY = (tileRecs[i].getTop() - renderArea.getTop()) / tileCombined.getTileHeight();
+
+            const int offsetX = positionX * pixelWidth;
+            const int offsetY = positionY * pixelHeight;
+
+            NSString *mmapFileBaseName = [NSString stringWithFormat:@"%d.bmp", bmpId];
+            NSURL *mmapFileURL = [[NSFileManager.defaultManager temporaryDirectory] URLByAppendingPathComponent:mmapFileBaseName];
+
+            int fd = open([[mmapFileURL path] UTF8String], O_RDWR|O_CREAT, 0666);
+            if (fd == -1)
+            {
+                LOG_SYS("Could not create file " << [[mmapFileURL path] UTF8String]);
+                return false;
+            }
+
+            const size_t mmapFileSize = bmpFileSize(pixelWidth, pixelHeight);
+
+            if (lseek(fd, mmapFileSize-1, SEEK_SET) == -1)
+            {
+                LOG_SYS("Could not seek in file " << [[mmapFileURL path] UTF8String]);
+                return false;
+            }
+
+            if (write(fd, "", 1) == -1)
+            {
+                LOG_SYS("Could not write at end of " << [[mmapFileURL path] UTF8String]);
+                return false;
+            }
+
+            char *mmapMemory = (char *)mmap(NULL, mmapFileSize, PROT_READ|PROT_WRITE, MAP_FILE|MAP_SHARED, fd, 0);
+            if (mmapMemory == MAP_FAILED)
+            {
+                LOG_SYS("Could not map in file " << [[mmapFileURL path] UTF8String]);
+                close(fd);
+                return false;
+            }
+
+            close(fd);
+
+            generateBmpHeader(mmapMemory, pixelWidth, pixelHeight);
+
+            for (int y = 0; y < pixelHeight; y++)
+                memcpy(mmapMemory + sizeof(BITMAPFILEHEADER) + sizeof(BITMAPV5HEADER) + y * pixelWidth * 4,
+                       pixmap.data() + (offsetY + y) * pixmapWidth * 4 + offsetX * 4,
+                       pixelWidth * 4);
+
+            if (munmap(mmapMemory, mmapFileSize) == -1)
+            {
+                LOG_SYS("Could not unmap file " << [[mmapFileURL path] UTF8String]);
+                return false;
+            }
 
-        pngPool.run();
+            std::string tileMsg = tiles[i].serialize("tile:", ADD_DEBUG_RENDERID) + std::string([[mmapFileURL absoluteString] UTF8String]);
+            outputMessage(tileMsg.c_str(), tileMsg.length());
+        }
 
-        for (size_t i = zeroCheckStart; i < renderedTiles.size(); ++i)
+#else
+        std::vector<char>& output = render._output;
+        std::vector<TileDesc>& renderedTiles = render._renderedTiles;
+        const std::vector<TileDesc>& duplicateTiles = render._duplicateTiles;
+        const std::vector<TileBinaryHash>& duplicateHashes = render._duplicateHashes;
+
+        pngPool.wait();
+
+        for (size_t i = render._zeroCheckStart; i < renderedTiles.size(); ++i)
         {
             if (renderedTiles[i].getImgSize() == 0)
             {
@@ -734,36 +1500,63 @@ namespace RenderTiles
 
         pngCache.balanceCache();
 
-        duration = std::chrono::steady_clock::now() - start;
+        const auto duration = std::chrono::steady_clock::now() - render._start;
         const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(duration);
-        LOG_DBG("rendering tiles at (" << renderArea.getLeft() << ", " << renderArea.getTop()
-                                       << "), (" << renderArea.getWidth() << ", "
-                                       << renderArea.getHeight() << ") "
-                                       << " took " << elapsed << " (including the paintPartTile).");
+        LOG_DBG("rendering " << render._tileRecs.size() << " tiles in " << render._areas.size()
+                             << " areas took " << elapsed << " (from the paintPartTile until sent).");
 
-        if (tileIndex == 0)
+        if (render._tileCount == 0)
             return false;
 
-        std::string tileMsg;
-        if (combined)
+        // The binary header, or the text one to read the traffic of the kit.
+        static const bool textHeaders = std::getenv("LOOL_TEXT_TILE_HEADERS") != nullptr;
+        const auto serializeHeader = [&](const std::vector<TileDesc>& tiles, bool inShm, std::uint64_t shmPos) -> std::string
+        {
+            if (!textHeaders)
+                return tileCombined.serializeBinary(tiles, inShm, shmPos);
+
+            const std::string suffix = (inShm ? " shm=" + std::to_string(shmPos) : std::string()) + ADD_DEBUG_RENDERID;
+            return render._combined ? tileCombined.serialize("tilecombine:", suffix, tiles)
+                                    : tiles[0].serialize("tile:", suffix);
+        };
+
+        std::uint64_t shmPos = 0;
+        if (render._combined)
         {
-            tileMsg = tileCombined.serialize("tilecombine:", ADD_DEBUG_RENDERID, renderedTiles);
+            const bool inShm = tileShm && tileShm->write(output.data(), output.size(), shmPos);
+            const std::string tileMsg = serializeHeader(renderedTiles, inShm, shmPos);
 
-            LOG_TRC("Sending back painted tiles for " << tileMsg << " of size " << output.size() << " bytes) for: " << tileMsg);
+            LOG_TRC("Sending back painted tiles " << (inShm ? "through shm" : "inline") << " of size "
+                    << output.size() << " bytes for: " << tileCombined.serialize("tilecombine:", "", renderedTiles));
 
-            std::unique_ptr<char[]> response;
-            const size_t responseSize = tileMsg.size() + output.size();
-            response.reset(new char[responseSize]);
-            std::copy(tileMsg.begin(), tileMsg.end(), response.get());
-            std::copy(output.begin(), output.end(), response.get() + tileMsg.size());
-            outputMessage(response.get(), responseSize);
+            if (inShm)
+            {
+                outputMessage(tileMsg.data(), tileMsg.size());
+            }
+            else
+            {
+                std::unique_ptr<char[]> response;
+                const size_t responseSize = tileMsg.size() + output.size();
+                response.reset(new char[responseSize]);
+                std::copy(tileMsg.begin(), tileMsg.end(), response.get());
+                std::copy(output.begin(), output.end(), response.get() + tileMsg.size());
+                outputMessage(response.get(), responseSize);
+            }
         }
         else
         {
             size_t outputOffset = 0;
             for (auto &i : renderedTiles)
             {
-                tileMsg = i.serialize("tile:", ADD_DEBUG_RENDERID);
+                const bool inShm = tileShm && tileShm->write(output.data() + outputOffset, i.getImgSize(), shmPos);
+                const std::string tileMsg = serializeHeader(std::vector<TileDesc>(1, i), inShm, shmPos);
+                if (inShm)
+                {
+                    outputMessage(tileMsg.data(), tileMsg.size());
+                    outputOffset += i.getImgSize();
+                    continue;
+                }
+
                 const size_t responseSize = tileMsg.size() + i.getImgSize();
                 std::unique_ptr<char[]> response;
                 response.reset(new char[responseSize]);
@@ -773,6 +1566,8 @@ namespace RenderTiles
                 outputOffset += i.getImgSize();
             }
         }
+
+        pixmapPool.returnOutput(output);
 #endif
         return true;
     }
@@ -52,7 +52,9 @@ Session::Session(const std::shared_ptr<ProtocolHandlerInterface> &protocol,
     _isAllowChangeComments(false),
     _haveDocPassword(false),
     _isDocPasswordProtected(false),
-    _watermarkOpacity(0.2)
+    _watermarkOpacity(0.2),
+    _tileDeltas(false),
+    _tileCombine(false)
 {
 }
 
@@ -190,6 +192,16 @@ void Session::parseDocOptions(const StringVector& tokens, int& part, std::string
             _spellOnline = value;
             ++offset;
         }
+        else if (name == "tiledeltas")
+        {
+            _tileDeltas = (value == "true");
+            ++offset;
+        }
+        else if (name == "tilecombine")
+        {
+            _tileCombine = (value == "true");
+            ++offset;
+        }
     }
 
     Util::mapAnonymized(_userId, _userIdAnonym);
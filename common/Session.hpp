@@ -209,7 +209,7 @@ public:
 
     const std::string& getJailedFilePathAnonym() const { return _jailedFilePathAnonym; }
 
-    int  getCanonicalViewId() { return _canonicalViewId; }
+    int  getCanonicalViewId() const { return _canonicalViewId; }
     // Only called by kit.
     void setCanonicalViewId(int viewId) { _canonicalViewId = viewId; }
     // Only called by wsd.
@@ -222,6 +222,12 @@ public:
 
     const std::string& getSpellOnline() const { return _spellOnline; }
 
+    /// Whether the client can apply incremental tile deltas.
+    bool getTileDeltas() const { return _tileDeltas; }
+
+    /// Whether the client can split the 'tilecombine:' responses.
+    bool getTileCombine() const { return _tileCombine; }
+
 protected:
     Session(const std::shared_ptr<ProtocolHandlerInterface> &handler,
             const std::string& name, const std::string& id, bool readonly);
@@ -322,6 +328,12 @@ private:
 
     /// The start value of Auto Spell Checking wheter it is enabled or disabled on start.
     std::string _spellOnline;
+
+    /// The client can apply incremental tile deltas against a tile it already has.
+    bool _tileDeltas;
+
+    /// The client can split several tiles sent in one 'tilecombine:' frame.
+    bool _tileCombine;
 };
 
 /* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -0,0 +1,156 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#include <config.h>
+
+#include "TileShm.hpp"
+
+#include <atomic>
+#include <cstring>
+#include <new>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "Log.hpp"
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "The position is shared between processes.");
+
+/// At the start of the segment, on a cache line of its own.
+struct alignas(64) TileShm::Header
+{
+    /// Position before which WSD uses nothing any more.
+    /// Written by WSD, read by the kit.
+    std::atomic<std::uint64_t> _free;
+};
+
+std::shared_ptr<TileShm> TileShm::create(std::size_t size)
+{
+#ifdef __linux__
+    if (size <= sizeof(Header))
+        return nullptr;
+
+    const int fd = memfd_create("loolkit-tiles", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0)
+    {
+        LOG_SYS("Failed to create the shared memory for tiles.");
+        return nullptr;
+    }
+
+    // WSD maps it too, so it must never shrink under it.
+    if (ftruncate(fd, size) != 0 || fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) != 0)
+    {
+        LOG_SYS("Failed to size the shared memory for tiles.");
+        close(fd);
+        return nullptr;
+    }
+
+    void* mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mapping == MAP_FAILED)
+    {
+        LOG_SYS("Failed to map the shared memory for tiles.");
+        close(fd);
+        return nullptr;
+    }
+
+    new (mapping) Header();
+    return std::shared_ptr<TileShm>(new TileShm(fd, static_cast<char*>(mapping), size));
+#else
+    (void)size;
+    return nullptr;
+#endif
+}
+
+std::shared_ptr<TileShm> TileShm::attach(int fd)
+{
+#ifdef __linux__
+    struct stat st;
+    const int seals = fcntl(fd, F_GET_SEALS);
+    if (seals < 0 || !(seals & F_SEAL_SHRINK) || fstat(fd, &st) != 0
+        || st.st_size <= static_cast<off_t>(sizeof(Header)))
+    {
+        LOG_ERR("Invalid shared memory for tiles, fd " << fd << '.');
+        close(fd);
+        return nullptr;
+    }
+
+    void* mapping = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mapping == MAP_FAILED)
+    {
+        LOG_SYS("Failed to map the shared memory for tiles.");
+        close(fd);
+        return nullptr;
+    }
+
+    return std::shared_ptr<TileShm>(new TileShm(fd, static_cast<char*>(mapping), st.st_size));
+#else
+    close(fd);
+    return nullptr;
+#endif
+}
+
+TileShm::TileShm(int fd, char* mapping, std::size_t size)
+    : _fd(fd)
+    , _mapping(mapping)
+    , _mappingSize(size)
+    , _header(reinterpret_cast<Header*>(mapping))
+    , _data(mapping + sizeof(Header))
+    , _capacity(size - sizeof(Header))
+    , _head(0)
+    , _received(0)
+{
+}
+
+TileShm::~TileShm()
+{
+    munmap(_mapping, _mappingSize);
+    close(_fd);
+}
+
+bool TileShm::write(const char* data, std::size_t size, std::uint64_t& pos)
+{
+    if (size == 0 || size > _capacity)
+        return false;
+
+    // A range never wraps around the end.
+    std::uint64_t start = _head;
+    const std::size_t offset = start % _capacity;
+    if (offset + size > _capacity)
+        start += _capacity - offset;
+
+    if (start + size - _header->_free.load(std::memory_order_acquire) > _capacity)
+        return false;
+
+    std::memcpy(_data + start % _capacity, data, size);
+    _head = start + size;
+    pos = start;
+    return true;
+}
+
+std::shared_ptr<TileShm::Block> TileShm::receive(std::uint64_t pos, std::size_t size)
+{
+    if (size == 0 || size > _capacity || pos < _received || pos % _capacity + size > _capacity)
+    {
+        LOG_ERR("Invalid range of the shared memory for tiles: " << size << " bytes at " << pos
+                                                                 << '.');
+        return nullptr;
+    }
+
+    _inUse.insert(pos);
+    _received = pos + size;
+    return std::make_shared<Block>(shared_from_this(), pos, _data + pos % _capacity, size);
+}
+
+void TileShm::release(std::uint64_t pos)
+{
+    _inUse.erase(pos);
+    _header->_free.store(_inUse.empty() ? _received : *_inUse.begin(), std::memory_order_release);
+}
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -0,0 +1,104 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <set>
+
+/// A memfd shared by a kit with WSD, through which the rendered tiles are
+/// handed over without copying them into the socket, and out of it again.
+///
+/// The kit writes the tiles of each render to the segment, used as a ring,
+/// and sends only their position. WSD copies them to its cache once, and
+/// publishes the oldest position it still uses, before which the kit can
+/// write again. When the ring is full, the kit sends the tiles inline.
+/// Each side uses it from a single thread.
+class TileShm : public std::enable_shared_from_this<TileShm>
+{
+    struct Header;
+
+public:
+    /// A range of the segment received by WSD. It can be written over again
+    /// once this and all the ranges received before it are destroyed.
+    class Block
+    {
+    public:
+        Block(std::shared_ptr<TileShm> shm, std::uint64_t pos, const char* data, std::size_t size)
+            : _shm(std::move(shm))
+            , _pos(pos)
+            , _data(data)
+            , _size(size)
+        {
+        }
+
+        ~Block() { _shm->release(_pos); }
+
+        Block(const Block&) = delete;
+        Block& operator=(const Block&) = delete;
+
+        const char* data() const { return _data; }
+        std::size_t size() const { return _size; }
+
+    private:
+        const std::shared_ptr<TileShm> _shm;
+        const std::uint64_t _pos;
+        const char* const _data;
+        const std::size_t _size;
+    };
+
+    /// Create a segment of the given size, in the kit.
+    /// Returns null if that fails.
+    static std::shared_ptr<TileShm> create(std::size_t size);
+
+    /// Map the segment the kit created, in WSD. Takes over the fd.
+    /// Returns null if it is not a sealed segment.
+    static std::shared_ptr<TileShm> attach(int fd);
+
+    ~TileShm();
+
+    TileShm(const TileShm&) = delete;
+    TileShm& operator=(const TileShm&) = delete;
+
+    int getFD() const { return _fd; }
+
+    /// The bytes available for the tiles.
+    std::size_t getCapacity() const { return _capacity; }
+
+    /// Copy the data to the segment, in the kit. Returns false if it doesn't
+    /// fit, otherwise sets pos to the position to send to WSD.
+    bool write(const char* data, std::size_t size, std::uint64_t& pos);
+
+    /// Take the range the kit wrote at pos, in WSD, in the order written.
+    /// Returns null if the range is invalid.
+    std::shared_ptr<Block> receive(std::uint64_t pos, std::size_t size);
+
+private:
+    TileShm(int fd, char* mapping, std::size_t size);
+
+    /// Forget the range received at pos, and publish the oldest one in use.
+    void release(std::uint64_t pos);
+
+    const int _fd;
+    char* const _mapping;
+    const std::size_t _mappingSize;
+    Header* const _header;
+    char* const _data;
+    const std::size_t _capacity;
+
+    /// Where the kit writes next.
+    std::uint64_t _head;
+
+    /// The positions of the ranges WSD received and still uses, and the end
+    /// of the last one received.
+    std::set<std::uint64_t> _inUse;
+    std::uint64_t _received;
+};
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -7,9 +7,14 @@
 
 #pragma once
 
+#include <algorithm>
+#include <cstring>
+#include <memory>
 #include <vector>
 #include <assert.h>
+#include <zlib.h>
 #include <Log.hpp>
+#include <Png.hpp>
 
 #ifndef TILE_WIRE_ID
 #  define TILE_WIRE_ID
@@ -19,34 +24,15 @@
 /// A quick and dirty delta generator for last tile changes
 class DeltaGenerator {
 
-    struct DeltaBitmapRow {
-    private:
-        uint64_t _crc;
-        std::vector<uint32_t> _pixels;
-
-    public:
-        bool identical(const DeltaBitmapRow &other) const
-        {
-            if (_crc != other._crc)
-                return false;
-            return _pixels == other._pixels;
-        }
-
-        const std::vector<uint32_t>& getPixels() const
-        {
-            return _pixels;
-        }
-
-        std::vector<uint32_t>& getPixels()
-        {
-            return _pixels;
-        }
-    };
-
+    /// A previous tile: its pixels in one block, and a hash of each row.
     struct DeltaData {
-        void setWid(TileWireId wid)
+        DeltaData(TileWireId wid, int width, int height) :
+            _wid(wid),
+            _width(width),
+            _height(height),
+            _rowHashes(height),
+            _pixels(width * height)
         {
-            _wid = wid;
         }
 
         TileWireId getWid() const
@@ -54,48 +40,51 @@ class DeltaGenerator {
             return _wid;
         }
 
-        void setWidth(int width)
-        {
-            _width = width;
-        }
-
         int getWidth() const
         {
             return _width;
         }
 
-        void setHeight(int height)
-        {
-            _height = height;
-        }
-
         int getHeight() const
         {
             return _height;
         }
 
-        const std::vector<DeltaBitmapRow>& getRows() const
+        const uint32_t* getRow(int y) const
         {
-            return _rows;
+            return &_pixels[y * _width];
         }
 
-        std::vector<DeltaBitmapRow>& getRows()
+        /// Whether row y here has the same pixels as row otherY of other.
+        bool identical(int y, const DeltaData &other, int otherY) const
         {
-            return _rows;
+            return _rowHashes[y] == other._rowHashes[otherY] &&
+                std::memcmp(getRow(y), other.getRow(otherY), _width * 4) == 0;
         }
 
     private:
+        friend class DeltaGenerator;
         TileWireId _wid;
         int _width;
         int _height;
-        std::vector<DeltaBitmapRow> _rows;
+        std::vector<uint64_t> _rowHashes;
+        std::vector<uint32_t> _pixels;
     };
+    /// Most recently used last; each entry costs the raw size of a tile (256KB at 256x256).
     std::vector<std::shared_ptr<DeltaData>> _deltaEntries;
 
+    /// How many previous tiles we keep around to build deltas against.
+    static const size_t MaxDeltaEntries = 64;
+
+    /// The operations of the delta being built, before compression.
+    std::vector<char> _ops;
+
     bool makeDelta(
         const DeltaData &prev,
         const DeltaData &cur,
-        std::vector<char>& output)
+        std::vector<char>& output,
+        LibreOfficeKitTileMode mode,
+        size_t maxSize)
     {
         // TODO: should we split and compress alpha separately ?
         if (prev.getWidth() != cur.getWidth() || prev.getHeight() != cur.getHeight())
@@ -105,7 +94,12 @@ class DeltaGenerator {
             return false;
         }
 
-        output.push_back('D');
+        // Beyond a byte per pixel the operations won't compress to a few KB,
+        // so stop building them there.
+        std::vector<char>& ops = _ops;
+        ops.clear();
+        const size_t maxOpsSize = cur.getWidth() * cur.getHeight();
+
         LOG_TRC("building delta of a " << cur.getWidth() << 'x' << cur.getHeight() << " bitmap");
 
         // row move/copy src/dest is a byte.
@@ -119,7 +113,7 @@ class DeltaGenerator {
         for (int y = 0; y < prev.getHeight(); ++y)
         {
             // Life is good where rows match:
-            if (prev.getRows()[y].identical(cur.getRows()[y]))
+            if (prev.identical(y, cur, y))
                 continue;
 
             // Hunt for other rows
@@ -127,27 +121,27 @@ class DeltaGenerator {
             for (int yn = 0; yn < prev.getHeight() && !matched; ++yn)
             {
                 size_t match = (y + lastMatchOffset + yn) % prev.getHeight();
-                if (prev.getRows()[match].identical(cur.getRows()[y]))
+                if (prev.identical(match, cur, y))
                 {
                     // TODO: if offsets are >256 - use 16bits?
                     if (lastCopy > 0)
                     {
-                        char cnt = output[lastCopy];
-                        if (output[lastCopy + 1] + cnt == (char)(match) &&
-                            output[lastCopy + 2] + cnt == (char)(y))
+                        char cnt = ops[lastCopy];
+                        if (ops[lastCopy + 1] + cnt == (char)(match) &&
+                            ops[lastCopy + 2] + cnt == (char)(y))
                         {
-                            output[lastCopy]++;
+                            ops[lastCopy]++;
                             matched = true;
                             continue;
                         }
                     }
 
                     lastMatchOffset = match - y;
-                    output.push_back('c');   // copy-row
-                    lastCopy = output.size();
-                    output.push_back(1);     // count
-                    output.push_back(match); // src
-                    output.push_back(y);     // dest
+                    ops.push_back('c');   // copy-row
+                    lastCopy = ops.size();
+                    ops.push_back(1);     // count
+                    ops.push_back(match); // src
+                    ops.push_back(y);     // dest
 
                     matched = true;
                     continue;
@@ -157,39 +151,67 @@ class DeltaGenerator {
                 continue;
 
             // Our row is just that different:
-            const DeltaBitmapRow &curRow = cur.getRows()[y];
-            const DeltaBitmapRow &prevRow = prev.getRows()[y];
+            const uint32_t *curRow = cur.getRow(y);
+            const uint32_t *prevRow = prev.getRow(y);
             for (int x = 0; x < prev.getWidth();)
             {
                 int same;
                 for (same = 0; same + x < prev.getWidth() &&
-                         prevRow.getPixels()[x+same] == curRow.getPixels()[x+same];)
+                         prevRow[x+same] == curRow[x+same];)
                     ++same;
 
                 x += same;
 
                 int diff;
                 for (diff = 0; diff + x < prev.getWidth() &&
-                         (prevRow.getPixels()[x+diff] == curRow.getPixels()[x+diff] || diff < 2) &&
+                         (prevRow[x+diff] == curRow[x+diff] || diff < 2) &&
                          diff < 254;)
                     ++diff;
                 if (diff > 0)
                 {
-                    output.push_back('d');
-                    output.push_back(y);
-                    output.push_back(x);
-                    output.push_back(diff);
-
-                    size_t dest = output.size();
-                    output.resize(dest + diff * 4);
-                    memcpy(&output[dest], &curRow.getPixels()[x], diff * 4);
+                    ops.push_back('d');
+                    ops.push_back(y);
+                    ops.push_back(x);
+                    ops.push_back(diff);
+
+                    size_t dest = ops.size();
+                    ops.resize(dest + diff * 4);
+                    memcpy(&ops[dest], &curRow[x], diff * 4);
+                    if (mode == LOK_TILEMODE_BGRA)
+                        Png::unpremultiplyPixels(reinterpret_cast<unsigned char *>(&ops[dest]),
+                                                 diff * 4);
 
                     LOG_TRC("different " << diff << "pixels");
                     x += diff;
                 }
             }
+
+            if (ops.size() > maxOpsSize)
+            {
+                LOG_TRC("delta is too large, over " << maxOpsSize << " bytes at row " << y);
+                return false;
+            }
         }
 
+        // Worth it only while smaller than a PNG; compress2 fails when the
+        // result doesn't fit in what is left of maxSize after the 'D'.
+        if (maxSize < 2)
+            return false;
+
+        const size_t start = output.size();
+        output.resize(start + maxSize);
+        output[start] = 'D';
+        uLongf size = maxSize - 1;
+        if (compress2(reinterpret_cast<Bytef*>(&output[start + 1]), &size,
+                      reinterpret_cast<const Bytef*>(ops.data()), ops.size(),
+                      Z_DEFAULT_COMPRESSION) != Z_OK)
+        {
+            LOG_TRC("delta of " << ops.size() << " bytes does not compress below " << maxSize);
+            output.resize(start);
+            return false;
+        }
+
+        output.resize(start + 1 + size);
         return true;
     }
 
@@ -197,43 +219,39 @@ class DeltaGenerator {
         TileWireId wid,
         unsigned char* pixmap, size_t startX, size_t startY,
         int width, int height,
-        int bufferWidth, int bufferHeight)
+        int bufferWidth, int bufferHeight,
+        const uint64_t* rowHashes)
     {
-        auto data = std::make_shared<DeltaData>();
-        data->setWid(wid);
+        auto data = std::make_shared<DeltaData>(wid, width, height);
 
         assert (startX + width <= (size_t)bufferWidth);
         assert (startY + height <= (size_t)bufferHeight);
 
-        (void)bufferHeight;
-
         LOG_TRC("Converting pixel data to delta data of size "
                 << (width * height * 4) << " width " << width
                 << " height " << height);
 
-        data->setWidth(width);
-        data->setHeight(height);
-        data->getRows().resize(height);
+        // The row hashes usually come for free, from hashing the tile.
+        if (rowHashes)
+            std::copy(rowHashes, rowHashes + height, data->_rowHashes.begin());
+        else
+            Png::hashSubBufferRows(pixmap, startX, startY, width, height,
+                                   bufferWidth, bufferHeight, data->_rowHashes.data());
+
         for (int y = 0; y < height; ++y)
         {
-            DeltaBitmapRow &row = data->getRows()[y];
-            size_t position = ((startY + y) * bufferWidth * 4) + (startX * 4);
-            int32_t *src = reinterpret_cast<int32_t *>(pixmap + position);
-
-            // We get the hash ~for free as we copy - with a cheap hash.
-            uint64_t crc = 0x7fffffff - 1;
-            row.getPixels().resize(width);
-            for (int x = 0; x < width; ++x)
-            {
-                crc = (crc << 7) + crc + src[x];
-                row.getPixels()[x] = src[x];
-            }
+            const size_t position = ((startY + y) * bufferWidth * 4) + (startX * 4);
+            std::memcpy(&data->_pixels[y * width], pixmap + position, width * 4);
         }
 
         return data;
     }
 
   public:
+    /// A delta is compressed, and sent only while it takes at most this,
+    /// well below a typical PNG of a tile with content.
+    static const size_t MaxDeltaSize = 4096;
+
     DeltaGenerator() {}
 
     /**
@@ -241,30 +259,59 @@ class DeltaGenerator {
      *   if so - returns @true and appends the delta to @output
      * stores @pixmap, and other data to accelerate delta
      * creation in a limited size cache.
+     * Pixels in the delta are unpremultiplied RGBA, just like
+     * the PNG encoder would produce for the given @mode.
+     * @rowHashes, if given, are those from Png::hashSubBufferRows.
+     * Gives up when the compressed delta is over @maxSize bytes.
      */
     bool createDelta(
         unsigned char* pixmap, size_t startX, size_t startY,
         int width, int height,
         int bufferWidth, int bufferHeight,
         std::vector<char>& output,
-        TileWireId wid, TileWireId oldWid)
+        TileWireId wid, TileWireId oldWid,
+        LibreOfficeKitTileMode mode,
+        const uint64_t* rowHashes = nullptr,
+        size_t maxSize = MaxDeltaSize)
     {
-        // First store a copy for later:
-        if (_deltaEntries.size() > 6) // FIXME: hard-coded ...
+        std::shared_ptr<DeltaData> old;
+        if (oldWid != 0 && oldWid != wid)
+        {
+            const auto it = std::find_if(_deltaEntries.begin(), _deltaEntries.end(),
+                                         [oldWid](const std::shared_ptr<DeltaData>& entry)
+                                         { return entry->getWid() == oldWid; });
+            if (it != _deltaEntries.end())
+                old = *it;
+        }
+
+        // Store a copy for later; identical content has the same wid.
+        _deltaEntries.erase(std::remove_if(_deltaEntries.begin(), _deltaEntries.end(),
+                                           [wid](const std::shared_ptr<DeltaData>& entry)
+                                           { return entry->getWid() == wid; }),
+                            _deltaEntries.end());
+        if (_deltaEntries.size() >= MaxDeltaEntries)
             _deltaEntries.erase(_deltaEntries.begin());
 
         std::shared_ptr<DeltaData> update =
             dataToDeltaData(wid, pixmap, startX, startY, width, height,
-                            bufferWidth, bufferHeight);
+                            bufferWidth, bufferHeight, rowHashes);
         _deltaEntries.push_back(update);
 
-        for (auto &old : _deltaEntries)
-        {
-            if (oldWid == old->getWid())
-                return makeDelta(*old, *update, output);
-        }
+        if (old)
+            return makeDelta(*old, *update, output, mode, maxSize);
         return false;
     }
+
+    /// Forget all stored tiles, eg. when wire-ids are reset.
+    void clear()
+    {
+        _deltaEntries.clear();
+    }
+
+    size_t getEntryCount() const
+    {
+        return _deltaEntries.size();
+    }
 };
 
 /* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -43,6 +43,7 @@
 #include <string>
 #include <sstream>
 #include <thread>
+#include <vector>
 
 #define LOK_USE_UNSTABLE_API
 #include <LibreOfficeKit/LibreOfficeKitInit.h>
@@ -68,6 +69,7 @@
 #include <Png.hpp>
 #include <Rectangle.hpp>
 #include <TileDesc.hpp>
+#include <TileShm.hpp>
 #include <Unit.hpp>
 #include <UserMessages.hpp>
 #include <Util.hpp>
@@ -134,6 +136,9 @@ static uint64_t AnonymizationSalt = 82589933;
 /// system root, not the jail.
 static std::string JailRoot;
 
+/// The segment the rendered tiles are handed to WSD through, if any.
+static std::shared_ptr<TileShm> TileTransport;
+
 #if !MOBILEAPP
 
 static LokHookFunction2* initFunction = nullptr;
@@ -477,6 +482,7 @@ public:
         _isLoading(0),
         _editorId(-1),
         _editorChangeWarning(false),
+        _batchCallbacks(false),
         _mobileAppDocId(mobileAppDocId),
         _inputProcessingEnabled(true)
     {
@@ -587,6 +593,7 @@ public:
                 if (it->second->isCloseFrame())
                 {
                     deadSessions.push_back(it->second);
+                    _viewIdToSession.erase(it->second->getViewId());
                     it = _sessions.erase(it);
                 }
                 else
@@ -692,16 +699,32 @@ public:
                                                pixelWidth, pixelHeight, mode);
         };
 
+        // Paint while the PNG pool is still encoding the previous combine,
+        // then send that one before we need the pool again.
+        std::unique_ptr<RenderTiles::Render> render =
+            RenderTiles::paintTiles(_loKitDocument, tileCombined, combined, _pixmapPool);
+
+        finishRender();
+
+        RenderTiles::encodeTiles(*render, _loKitDocument, _pngCache, _pngPool, _deltaGen, blenderFunc);
+        _pendingRender = std::move(render);
+    }
+
+    /// Waits for the tiles still being encoded, if any, and sends them.
+    void finishRender()
+    {
+        if (!_pendingRender)
+            return;
+
         const auto postMessageFunc = [&](const char* buffer, std::size_t length) {
             postMessage(buffer, length, WSOpCode::Binary);
         };
 
-        if (!RenderTiles::doRender(_loKitDocument, tileCombined, _pngCache, _pngPool, combined,
-                                   blenderFunc, postMessageFunc))
-        {
+        if (!RenderTiles::finishTiles(*_pendingRender, _pngCache, _pngPool, _pixmapPool,
+                                      TileTransport.get(), postMessageFunc))
             LOG_DBG("All tiles skipped, not producing empty tilecombine: message");
-            return;
-        }
+
+        _pendingRender.reset();
     }
 
     bool sendTextFrame(const std::string& message)
@@ -713,6 +736,13 @@ public:
     {
         try
         {
+            if (_batchCallbacks && opCode == WSOpCode::Text)
+            {
+                _callbackFrames.emplace_back(buffer, buffer + length);
+                return true;
+            }
+
+            flushCallbacks();
             return postMessage(buffer, length, opCode);
         }
         catch (const Exception& exc)
@@ -724,6 +754,31 @@ public:
         return false;
     }
 
+    /// Sends the frames of the callbacks dispatched since the last flush,
+    /// in one frame if there are several.
+    void flushCallbacks()
+    {
+        _batchCallbacks = false;
+        if (_callbackFrames.empty())
+            return;
+
+        if (_callbackFrames.size() == 1)
+        {
+            postMessage(_callbackFrames[0].data(), _callbackFrames[0].size(), WSOpCode::Text);
+        }
+        else
+        {
+            std::vector<char> batch;
+            for (const std::vector<char>& frame : _callbackFrames)
+                LOOLProtocol::appendToBatch(batch, frame.data(), frame.size());
+
+            LOG_TRC("Sending " << _callbackFrames.size() << " callback frames in one.");
+            postMessage(batch.data(), batch.size(), WSOpCode::Text);
+        }
+
+        _callbackFrames.clear();
+    }
+
     void alertAllUsers(const std::string& cmd, const std::string& kind) override
     {
         alertAllUsers("errortoall: cmd=" + cmd + " kind=" + kind);
@@ -785,7 +840,7 @@ public:
         std::shared_ptr<TileQueue> tileQueue = descriptor->getDoc()->getTileQueue();
         assert(tileQueue && "Null TileQueue.");
 
-        const std::string payload = p ? p : "(nil)";
+        std::string payload = p ? p : "(nil)";
         LOG_TRC("Document::ViewCallback [" << descriptor->getViewId() <<
                 "] [" << lokCallbackTypeToString(type) <<
                 "] [" << payload << "].");
@@ -853,10 +908,10 @@ public:
         {
             // no point in handling invalidations or page resizes per-view,
             // all views have to be in sync
-            tileQueue->put("callback all " + std::to_string(type) + ' ' + payload);
+            tileQueue->putCallback(-1, type, std::move(payload));
         }
         else
-            tileQueue->put("callback " + std::to_string(descriptor->getViewId()) + ' ' + std::to_string(type) + ' ' + payload);
+            tileQueue->putCallback(descriptor->getViewId(), type, std::move(payload), std::move(targetViewId));
 
         LOG_TRC("Document::ViewCallback end.");
     }
@@ -866,7 +921,7 @@ private:
     /// Helper method to broadcast callback and its payload to all clients
     void broadcastCallbackToClients(const int type, const std::string& payload)
     {
-        _tileQueue->put("callback all " + std::to_string(type) + ' ' + payload);
+        _tileQueue->putCallback(-1, type, payload);
     }
 
     /// Load a document (or view) and register callbacks.
@@ -1279,6 +1334,7 @@ private:
 
         const int viewId = _loKitDocument->getView();
         session->setViewId(viewId);
+        _viewIdToSession[viewId] = session;
 
         _sessionUserInfo[viewId] = UserInfo(session->getViewUserId(), session->getViewUserName(),
                                             session->getViewUserExtraInfo(), session->isReadOnly());
@@ -1339,6 +1395,7 @@ private:
                     // Tell them we're going quietly.
                     session->sendTextFrame("disconnected:");
 
+                    _viewIdToSession.erase(session->getViewId());
                     _sessions.erase(it);
                     const std::size_t count = _sessions.size();
                     LOG_DBG("Have " << count << " child" << (count == 1 ? "" : "ren") <<
@@ -1443,12 +1500,30 @@ public:
                     break;
                 }
 
+                // Callbacks come parsed, don't serialize them. The frames of
+                // consecutive ones are sent to WSD in one.
+                const std::unique_ptr<TileQueue::Callback> callback = _tileQueue->popCallback();
+                if (callback)
+                {
+                    finishRender();
+                    _batchCallbacks = true;
+                    dispatchCallback(*callback);
+                    continue;
+                }
+
+                flushCallbacks();
+
                 const TileQueue::Payload input = _tileQueue->pop();
 
                 LOG_TRC("Kit handling queue message: " << LOOLProtocol::getAbbreviatedMessage(input));
 
                 const StringVector tokens = Util::tokenize(input.data(), input.size());
 
+                // Only consecutive tile requests are pipelined, anything else
+                // may depend on, or invalidate, the tiles rendered before it.
+                if (!tokens.equals(0, "tile") && !tokens.equals(0, "tilecombine"))
+                    finishRender();
+
                 if (tokens.equals(0, "eof"))
                 {
                     LOG_INF("Received EOF. Finishing.");
@@ -1467,81 +1542,14 @@ public:
                 {
                     forwardToChild(tokens[0], input);
                 }
-                else if (tokens.equals(0, "callback"))
-                {
-                    if (tokens.size() >= 3)
-                    {
-                        bool broadcast = false;
-                        int viewId = -1;
-                        int exceptViewId = -1;
-
-                        const std::string& target = tokens[1];
-                        if (target == "all")
-                        {
-                            broadcast = true;
-                        }
-                        else if (LOOLProtocol::matchPrefix("except-", target))
-                        {
-                            exceptViewId = std::stoi(target.substr(7));
-                            broadcast = true;
-                        }
-                        else
-                        {
-                            viewId = std::stoi(target);
-                        }
-
-                        const int type = std::stoi(tokens[2]);
-
-                        // payload is the rest of the message
-                        const std::size_t offset = tokens[0].length() + tokens[1].length()
-                                                   + tokens[2].length() + 3; // + delims
-                        const std::string payload(input.data() + offset, input.size() - offset);
-
-                        // Forward the callback to the same view, demultiplexing is done by the LibreOffice core.
-                        // TODO: replace with a map to be faster.
-                        bool isFound = false;
-                        for (auto& it : _sessions)
-                        {
-                            std::shared_ptr<ChildSession> session = it.second;
-                            if (session && ((broadcast && (session->getViewId() != exceptViewId)) || (!broadcast && (session->getViewId() == viewId))))
-                            {
-                                if (!it.second->isCloseFrame())
-                                {
-                                    isFound = true;
-                                    session->loKitCallback(type, payload);
-                                }
-                                else
-                                {
-                                    LOG_ERR("Session-thread of session [" << session->getId() << "] for view [" <<
-                                            viewId << "] is not running. Dropping [" << lokCallbackTypeToString(type) <<
-                                            "] payload [" << payload << "].");
-                                }
-
-                                if (!broadcast)
-                                {
-                                    break;
-                                }
-                            }
-                        }
-
-                        if (!isFound)
-                        {
-                            LOG_WRN("Document::ViewCallback. Session [" << viewId <<
-                                    "] is no longer active to process [" << lokCallbackTypeToString(type) <<
-                                    "] [" << payload << "] message to Master Session.");
-                        }
-                    }
-                    else
-                    {
-                        LOG_ERR("Invalid callback message: [" << LOOLProtocol::getAbbreviatedMessage(input) << "].");
-                    }
-                }
                 else
                 {
                     LOG_ERR("Unexpected request: [" << LOOLProtocol::getAbbreviatedMessage(input) << "].");
                 }
             }
 
+            flushCallbacks();
+            finishRender();
         }
         catch (const std::exception& exc)
         {
@@ -1562,6 +1570,63 @@ public:
     }
 
 private:
+    /// Forward the callback to its view(s), demultiplexing is done by the LibreOffice core.
+    void dispatchCallback(const TileQueue::Callback& callback)
+    {
+        const int type = callback.getType();
+        const std::string& payload = callback.getPayload();
+        const bool broadcast = (callback.getView() < 0);
+
+        LOG_TRC("Kit handling queue callback [" << callback.getView() << "] [" <<
+                lokCallbackTypeToString(type) << "].");
+
+        bool isFound = false;
+        if (!broadcast)
+        {
+            const auto it = _viewIdToSession.find(callback.getView());
+            const std::shared_ptr<ChildSession> session
+                = (it != _viewIdToSession.end() ? it->second.lock() : nullptr);
+            if (session)
+                isFound = dispatchCallback(*session, callback);
+        }
+        else
+        {
+            for (auto& it : _sessions)
+            {
+                const std::shared_ptr<ChildSession>& session = it.second;
+                if (session && callback.isFor(session->getViewId())
+                    && dispatchCallback(*session, callback))
+                {
+                    isFound = true;
+                }
+            }
+        }
+
+        if (!isFound)
+        {
+            LOG_WRN("Document::ViewCallback. Session [" << callback.getView() <<
+                    "] is no longer active to process [" << lokCallbackTypeToString(type) <<
+                    "] [" << payload << "] message to Master Session.");
+        }
+    }
+
+    /// Hand the callback to the session, unless it's closing.
+    /// Returns whether it was.
+    bool dispatchCallback(ChildSession& session, const TileQueue::Callback& callback)
+    {
+        if (session.isCloseFrame())
+        {
+            LOG_ERR("Session-thread of session [" << session.getId() << "] for view [" <<
+                    callback.getView() << "] is not running. Dropping [" <<
+                    lokCallbackTypeToString(callback.getType()) << "] payload [" <<
+                    callback.getPayload() << "].");
+            return false;
+        }
+
+        session.loKitCallback(callback.getType(), callback.getPayload());
+        return true;
+    }
+
     /// Return access to the lok::Office instance.
     std::shared_ptr<lok::Office> getLOKit() override
     {
@@ -1612,11 +1677,13 @@ public:
 
         // dumpState:
         // TODO: _websocketHandler - but this is an odd one.
-        // TODO: std::shared_ptr<TileQueue> _tileQueue;
-        // TODO: PngCache _pngCache;
         // TODO: std::map<int, std::unique_ptr<CallbackDescriptor>> _viewIdToCallbackDescr;
         // ThreadPool _pngPool;
 
+        _tileQueue->dumpState(oss);
+        _pngCache.dumpState(oss);
+        _pixmapPool.dumpState(oss);
+
         _sessions.dumpState(oss);
 
         // TODO: std::map<int, std::chrono::steady_clock::time_point> _lastUpdatedAt;
@@ -1648,6 +1715,9 @@ private:
 
     PngCache _pngCache;
 
+    /// Previous versions of tiles to build deltas against.
+    DeltaGenerator _deltaGen;
+
     // Document password provided
     std::string _docPassword;
     // Whether password was provided or not
@@ -1661,6 +1731,9 @@ private:
     mutable std::mutex _mutex;
 
     ThreadPool _pngPool;
+    PixmapPool _pixmapPool;
+    /// The tile combine being encoded while we paint the next one.
+    std::unique_ptr<RenderTiles::Render> _pendingRender;
 
     std::condition_variable _cvLoading;
     std::atomic_size_t _isLoading;
@@ -1668,6 +1741,12 @@ private:
     bool _editorChangeWarning;
     std::map<int, std::unique_ptr<CallbackDescriptor>> _viewIdToCallbackDescr;
     SessionMap<ChildSession> _sessions;
+    /// The sessions with a view, by view id.
+    std::map<int, std::weak_ptr<ChildSession>> _viewIdToSession;
+
+    /// Whether the frames sent are callbacks to batch in _callbackFrames.
+    bool _batchCallbacks;
+    std::vector<std::vector<char>> _callbackFrames;
 
     std::map<int, std::chrono::steady_clock::time_point> _lastUpdatedAt;
     std::map<int, int> _speedCount;
@@ -1978,6 +2057,12 @@ protected:
         {
             Log::logger().setLevel(tokens[1]);
         }
+        else if (tokens.size() == 2 && tokens.equals(0, "tileshm") && tokens.equals(1, "off"))
+        {
+            // WSD couldn't map the segment, so it can't take the tiles from it.
+            LOG_WRN("Sending the tiles inline, WSD has no shared memory for them.");
+            TileTransport.reset();
+        }
         else
         {
             LOG_ERR("Bad or unknown token [" << tokens[0] << ']');
@@ -2270,6 +2355,18 @@ void lokit_main(
             if (ProcSMapsFile < 0)
                 LOG_SYS("Failed to open /proc/self/smaps. Memory stats will be missing.");
 
+            const char* tileShmSizeKb = std::getenv("LOOL_TILE_SHM_SIZE_KB");
+            const std::size_t tileShmSize = tileShmSizeKb ? std::strtoul(tileShmSizeKb, nullptr, 10) * 1024 : 0;
+            if (tileShmSize > 0)
+            {
+                TileTransport = TileShm::create(tileShmSize);
+                if (!TileTransport)
+                    LOG_WRN("Failed to create the shared memory for tiles. Tiles will be sent inline.");
+            }
+
+            // The CPU quota and load average are out of sight in the jail.
+            ThreadPool::initialize();
+
             LOG_INF("chroot(\"" << jailPathStr << "\")");
             if (chroot(jailPathStr.c_str()) == -1)
             {
@@ -2389,6 +2486,16 @@ void lokit_main(
             free(versionInfo);
         }
 
+        // The segment for the tiles is passed after the smaps file, if any.
+        std::vector<int> shareFDs;
+        if (ProcSMapsFile >= 0)
+            shareFDs.push_back(ProcSMapsFile);
+        if (TileTransport)
+        {
+            shareFDs.push_back(TileTransport->getFD());
+            pathAndQuery.append("&tileshm=1");
+        }
+
 #else // MOBILEAPP
 
 #ifndef IOS
@@ -2429,7 +2536,7 @@ void lokit_main(
             std::make_shared<KitWebSocketHandler>("child_ws", loKit, jailId, mainKit, numericIdentifier);
 
 #if !MOBILEAPP
-        mainKit->insertNewUnixSocket(MasterLocation, pathAndQuery, websocketHandler, ProcSMapsFile);
+        mainKit->insertNewUnixSocket(MasterLocation, pathAndQuery, websocketHandler, shareFDs);
 #else
         mainKit->insertNewFakeSocket(docBrokerSocket, websocketHandler);
 #endif
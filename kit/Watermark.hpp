@@ -16,6 +16,7 @@
 #include <cstdlib>
 #include <string>
 #include <cmath>
+#include <mutex>
 
 class Watermark final
 {
@@ -46,7 +47,10 @@ public:
         const int width = tileWidth * 0.8;
         const int height = tileHeight * 0.8;
 
+        // Tiles are blended in parallel; only the first renders the pixmap.
+        std::unique_lock<std::mutex> lock(_mutex);
         const std::vector<unsigned char>* pixmap = getPixmap(width, height);
+        lock.unlock();
 
         if (pixmap && tilePixmap)
         {
@@ -223,6 +227,7 @@ private:
     int _width;
     int _height;
     std::vector<unsigned char> _pixmap;
+    std::mutex _mutex;
 };
 
 /* vim:set shiftwidth=4 softtabstop=4 expandtab: */
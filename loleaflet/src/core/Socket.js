@@ -195,6 +195,12 @@ L.Socket = L.Class.extend({
 		if (window.deviceFormFactor) {
 			msg += ' deviceFormFactor=' + window.deviceFormFactor;
 		}
+		if (window.DecompressionStream) {
+			msg += ' tiledeltas=true';
+		}
+		if (!window.ThisIsAMobileApp) {
+			msg += ' tilecombine=true';
+		}
 		if (this._map.options.renderingOptions) {
 			var options = {
 				'rendering': this._map.options.renderingOptions
@@ -281,6 +287,10 @@ L.Socket = L.Class.extend({
 				index++;
 			}
 			textMsg = String.fromCharCode.apply(null, imgBytes.subarray(0, index));
+			if (textMsg.startsWith('tilecombine:')) {
+				this._onTileCombineMsg(textMsg, imgBytes.subarray(index + 1));
+				return;
+			}
 		}
 
 		this._logSocket('INCOMING', textMsg);
@@ -868,7 +878,6 @@ L.Socket = L.Class.extend({
 
 			if (data.length > 0 && data[0] == 68 /* D */)
 			{
-				console.log('Socket: got a delta !');
 				img = data;
 			}
 			else
@@ -918,6 +927,44 @@ L.Socket = L.Class.extend({
 		}
 	},
 
+	// Handle the cached tiles sent together in one frame as a 'tile:' message each.
+	_onTileCombineMsg: function (textMsg, data) {
+		var listNames = ['tileposx', 'tileposy', 'imgsize', 'ver', 'oldwid', 'wid'];
+		var lists = {};
+		var common = '';
+		var tokens = textMsg.substring('tilecombine:'.length).trim().split(' ');
+		for (var i = 0; i < tokens.length; i++) {
+			var name = tokens[i].substring(0, tokens[i].indexOf('='));
+			if (listNames.indexOf(name) >= 0) {
+				lists[name] = tokens[i].substring(name.length + 1).split(',');
+			}
+			else {
+				common += ' ' + tokens[i];
+			}
+		}
+
+		var offset = 0;
+		for (var k = 0; k < lists.imgsize.length; k++) {
+			var header = 'tile:' + common;
+			for (var n = 0; n < listNames.length; n++) {
+				if (lists[listNames[n]]) {
+					header += ' ' + listNames[n] + '=' + lists[listNames[n]][k];
+				}
+			}
+			header += '\n';
+
+			var size = parseInt(lists.imgsize[k]);
+			var frame = new Uint8Array(header.length + size);
+			for (var j = 0; j < header.length; j++) {
+				frame[j] = header.charCodeAt(j);
+			}
+			frame.set(data.subarray(offset, offset + size), header.length);
+			offset += size;
+
+			this._onMessage({data: frame.buffer});
+		}
+	},
+
 	_tryToDelayMessage: function(textMsg) {
 		var delayed = false;
 		if (textMsg.startsWith('window:') ||
@@ -1211,6 +1258,9 @@ L.Socket = L.Class.extend({
 			else if (tokens[i].startsWith('wid=')) {
 				command.wireId = this.getParameterValue(tokens[i]);
 			}
+			else if (tokens[i].startsWith('oldwid=')) {
+				command.oldWireId = this.getParameterValue(tokens[i]);
+			}
 			else if (tokens[i].substring(0, 6) === 'title=') {
 				command.title = tokens[i].substring(6);
 			}
@@ -3,6 +3,8 @@
  * L.CanvasTileLayer is a L.TileLayer with canvas based rendering.
  */
 
+/* global Promise Response DecompressionStream */
+
 L.TileCoordData = L.Class.extend({
 
 	initialize: function (left, top, zoom, part) {
@@ -1392,12 +1394,26 @@ L.CanvasTileLayer = L.TileLayer.extend({
 			});
 		}
 		else if (tile && typeof (img) == 'object') {
-			console.error('Not implemented');
+			// 'Uint8Array' delta
+			if (this._tiles[key]._invalidCount > 0) {
+				this._tiles[key]._invalidCount -= 1;
+			}
+			if (tile.wireId === tileMsgObj.oldWireId) {
+				this._queueDelta(tile, img, coords);
+				tile.wireId = tileMsgObj.wireId;
+			}
+			else {
+				// We don't have the base of this delta, ask for the whole tile.
+				tile.wireId = undefined;
+				this._addTiles([coords]);
+			}
 		}
 		else if (tile) {
 			if (this._tiles[key]._invalidCount > 0) {
 				this._tiles[key]._invalidCount -= 1;
 			}
+			// Any delta still being inflated was against the image this replaces.
+			tile._images = (tile._images || 0) + 1;
 			tile.el.src = img;
 			tile.wireId = tileMsgObj.wireId;
 		}
@@ -1408,6 +1424,69 @@ L.CanvasTileLayer = L.TileLayer.extend({
 		this._map._socket.sendMessage('tileprocessed tile=' + tileID);
 	},
 
+	// Inflates a delta (see 'tile:' in protocol.txt), and applies it once those
+	// received before it for the tile are.
+	_queueDelta: function (tile, delta, coords) {
+		var ops = new Response(new Blob([delta.subarray(1)]).stream()
+			.pipeThrough(new DecompressionStream('deflate'))).arrayBuffer();
+		var images = tile._images;
+		tile._deltas = Promise.all([ops, tile._deltas]).then(L.bind(function (results) {
+			// Unless a whole image replaced the one it applies to meanwhile.
+			if (tile._images === images) {
+				this._applyDelta(tile, new Uint8Array(results[0]));
+			}
+		}, this)).catch(L.bind(function (error) {
+			console.error('Failed to apply a delta: ' + error);
+			tile.wireId = undefined;
+			this._addTiles([coords]);
+		}, this));
+	},
+
+	// Applies the inflated operations of a delta on top of the current image of the tile.
+	_applyDelta: function (tile, ops) {
+		if (!tile.el.complete) {
+			// The previous image or delta is still being decoded, apply on top of that.
+			tile.el.addEventListener('load', L.bind(this._applyDelta, this, tile, ops), { once: true });
+			return;
+		}
+
+		var canvas = document.createElement('canvas');
+		canvas.width = this._tileWidthPx;
+		canvas.height = this._tileHeightPx;
+		var ctx = canvas.getContext('2d');
+		ctx.drawImage(tile.el, 0, 0);
+
+		var imgData = ctx.getImageData(0, 0, canvas.width, canvas.height);
+		var oldData = new Uint8ClampedArray(imgData.data);
+		var rowBytes = canvas.width * 4;
+
+		for (var i = 0; i < ops.length;) {
+			switch (ops[i]) {
+			case 99: // 'c': copy rows
+				var count = ops[i + 1];
+				var src = ops[i + 2] * rowBytes;
+				var dest = ops[i + 3] * rowBytes;
+				imgData.data.set(oldData.subarray(src, src + count * rowBytes), dest);
+				i += 4;
+				break;
+			case 100: // 'd': new run of pixels
+				var offset = ops[i + 1] * rowBytes + ops[i + 2] * 4;
+				var span = ops[i + 3] * 4;
+				i += 4;
+				imgData.data.set(ops.subarray(i, i + span), offset);
+				i += span;
+				break;
+			default:
+				console.error('Unknown delta code ' + ops[i] + ' at offset ' + i);
+				i = ops.length;
+				break;
+			}
+		}
+
+		ctx.putImageData(imgData, 0, 0);
+		tile.el.src = canvas.toDataURL('image/png');
+	},
+
 	_coordsToPixBounds: function (coords) {
 		// coords.x and coords.y are the pixel coordinates of the top-left corner of the tile.
 		var topLeft = new L.Point(coords.x, coords.y);
@@ -446,7 +446,8 @@ void SocketPoll::insertNewWebSocketSync(
 // should this be a static method in the WebsocketHandler(?)
 void SocketPoll::clientRequestWebsocketUpgrade(const std::shared_ptr<StreamSocket>& socket,
                                                const std::shared_ptr<ProtocolHandlerInterface>& websocketHandler,
-                                               const std::string &pathAndQuery, const int shareFD)
+                                               const std::string &pathAndQuery,
+                                               const std::vector<int>& shareFDs)
 {
     // cf. WebSocketHandler::upgradeToWebSocket (?)
     // send Sec-WebSocket-Key: <hmm> ... Sec-WebSocket-Protocol: chat, Sec-WebSocket-Version: 13
@@ -465,12 +466,12 @@ void SocketPoll::clientRequestWebsocketUpgrade(const std::shared_ptr<StreamSocke
         "Sec-WebSocket-Version:13\r\n"
         "User-Agent: " WOPI_AGENT_STRING "\r\n"
         "\r\n";
-    if (shareFD == -1)
+    if (shareFDs.empty())
         socket->send(oss.str());
     else
     {
         std::string request = oss.str();
-        socket->sendFD(request.c_str(), request.size(), shareFD);
+        socket->sendFD(request.c_str(), request.size(), shareFDs);
     }
     websocketHandler->onConnect(socket);
 }
@@ -479,7 +480,7 @@ void SocketPoll::insertNewUnixSocket(
     const std::string &location,
     const std::string &pathAndQuery,
     const std::shared_ptr<ProtocolHandlerInterface>& websocketHandler,
-    const int shareFD)
+    const std::vector<int>& shareFDs)
 {
     int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
 
@@ -502,7 +503,7 @@ void SocketPoll::insertNewUnixSocket(
         if (socket)
         {
             LOG_DBG("Connected to local UDS " << location << " #" << socket->getFD());
-            clientRequestWebsocketUpgrade(socket, websocketHandler, pathAndQuery, shareFD);
+            clientRequestWebsocketUpgrade(socket, websocketHandler, pathAndQuery, shareFDs);
             insertNewSocket(socket);
         }
     }
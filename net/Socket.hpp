@@ -28,6 +28,7 @@
 #include <mutex>
 #include <sstream>
 #include <thread>
+#include <vector>
 
 #include "Common.hpp"
 #include "FakeSocket.hpp"
@@ -699,7 +700,7 @@ public:
         const std::string &location,
         const std::string &pathAndQuery,
         const std::shared_ptr<ProtocolHandlerInterface>& websocketHandler,
-        const int shareFD = -1);
+        const std::vector<int>& shareFDs = std::vector<int>());
 #else
     void insertNewFakeSocket(
         int peerSocket,
@@ -757,10 +758,11 @@ protected:
 
 private:
     /// Generate the request to connect & upgrade this socket to a given path
-    /// and sends a file descriptor along request if is != -1.
+    /// and sends the file descriptors along the request, if any.
     void clientRequestWebsocketUpgrade(const std::shared_ptr<StreamSocket>& socket,
                                        const std::shared_ptr<ProtocolHandlerInterface>& websocketHandler,
-                                       const std::string &pathAndQuery, const int shareFD = -1);
+                                       const std::string &pathAndQuery,
+                                       const std::vector<int>& shareFDs = std::vector<int>());
 
     /// Initialize the poll fds array with the right events
     void setupPollFds(std::chrono::steady_clock::time_point now,
@@ -836,7 +838,6 @@ public:
         _closed(false),
         _sentHTTPContinue(false),
         _shutdownSignalled(false),
-        _incomingFD(-1),
         _readType(readType),
         _inputProcessingEnabled(true)
     {
@@ -916,10 +917,15 @@ public:
     /// Adds Date and User-Agent.
     void send(Poco::Net::HTTPResponse& response);
 
-    /// Sends data with file descriptor as control data.
+    /// The most file descriptors sent or received with some data.
+    static constexpr std::size_t MaxFDs = 4;
+
+    /// Sends data with file descriptors as control data.
     /// Can be used only with Unix sockets.
-    void sendFD(const char* data, const uint64_t len, int fd)
+    void sendFD(const char* data, const uint64_t len, const std::vector<int>& fds)
     {
+        assert(!fds.empty() && fds.size() <= MaxFDs);
+
         assertCorrectThread();
 
         // Flush existing non-ancillary data
@@ -939,15 +945,16 @@ public:
         msg.msg_iov = &iov[0];
         msg.msg_iovlen = 1;
 
-        char adata[CMSG_SPACE(sizeof(int))];
+        const std::size_t fdsSize = fds.size() * sizeof(int);
+        alignas(cmsghdr) char adata[CMSG_SPACE(MaxFDs * sizeof(int))];
         cmsghdr *cmsg = (cmsghdr*)adata;
         cmsg->cmsg_type = SCM_RIGHTS;
         cmsg->cmsg_level = SOL_SOCKET;
-        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
-        *(int *)CMSG_DATA(cmsg) = fd;
+        cmsg->cmsg_len = CMSG_LEN(fdsSize);
+        std::memcpy(CMSG_DATA(cmsg), fds.data(), fdsSize);
 
         msg.msg_control = const_cast<char*>(adata);
-        msg.msg_controllen = CMSG_LEN(sizeof(int));
+        msg.msg_controllen = CMSG_LEN(fdsSize);
         msg.msg_flags = 0;
 
         sendmsg(getFD(), &msg, 0);
@@ -1082,9 +1089,10 @@ public:
         return _outBuffer;
     }
 
-    int getIncomingFD()
+    /// The file descriptors received with the data, in the order sent.
+    const std::vector<int>& getIncomingFDs() const
     {
-        return _incomingFD;
+        return _incomingFDs;
     }
 
     bool processInputEnabled() const { return _inputProcessingEnabled; }
@@ -1218,14 +1226,13 @@ public:
     void dumpState(std::ostream& os) override;
 
 protected:
-    /// Reads data with file descriptor as control data if received.
+    /// Reads data with file descriptors as control data if received.
     /// Can be used only with Unix sockets.
-    int readFD(char* buf, int len, int& fd)
+    int readFD(char* buf, int len, std::vector<int>& fds)
     {
         msghdr msg;
         iovec iov[1];
-        /// We don't expect more than one FD
-        char ctrl[CMSG_SPACE(sizeof(int))];
+        alignas(cmsghdr) char ctrl[CMSG_SPACE(MaxFDs * sizeof(int))];
         int ctrlLen = sizeof(ctrl);
 
         iov[0].iov_base = buf;
@@ -1243,9 +1250,11 @@ protected:
         if (ret > 0 && msg.msg_controllen)
         {
             cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
-            if (cmsg && cmsg->cmsg_type == SCM_RIGHTS && cmsg->cmsg_len == CMSG_LEN(sizeof(int)))
+            if (cmsg && cmsg->cmsg_type == SCM_RIGHTS && cmsg->cmsg_len >= CMSG_LEN(sizeof(int)))
             {
-                fd = *(int*)CMSG_DATA(cmsg);
+                const std::size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                fds.resize(count);
+                std::memcpy(fds.data(), CMSG_DATA(cmsg), count * sizeof(int));
                 if (_readType == UseRecvmsgExpectFD)
                 {
                     _readType = NormalRead;
@@ -1262,7 +1271,7 @@ protected:
         assertCorrectThread();
 #if !MOBILEAPP
         if (_readType == UseRecvmsgExpectFD)
-            return readFD(buf, len, _incomingFD);
+            return readFD(buf, len, _incomingFDs);
 
 #if ENABLE_DEBUG
         if (simulateSocketError(true))
@@ -1331,7 +1340,7 @@ protected:
 
     /// True when shutdown was requested via shutdown().
     bool _shutdownSignalled;
-    int _incomingFD;
+    std::vector<int> _incomingFDs;
     ReadType _readType;
     std::atomic_bool _inputProcessingEnabled;
 };
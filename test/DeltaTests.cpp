@@ -20,11 +20,19 @@ class DeltaTests : public CPPUNIT_NS::TestFixture
 
     CPPUNIT_TEST(testDeltaSequence);
     CPPUNIT_TEST(testRandomDeltas);
+    CPPUNIT_TEST(testUnpremultiply);
+    CPPUNIT_TEST(testPngEncoders);
+    CPPUNIT_TEST(testSolidColourPng);
+    CPPUNIT_TEST(testTileHashing);
 
     CPPUNIT_TEST_SUITE_END();
 
     void testDeltaSequence();
     void testRandomDeltas();
+    void testUnpremultiply();
+    void testPngEncoders();
+    void testSolidColourPng();
+    void testTileHashing();
 
     std::vector<char> loadPng(const char *relpath,
                               png_uint_32& height,
@@ -51,7 +59,7 @@ class DeltaTests : public CPPUNIT_NS::TestFixture
     std::vector<char> applyDelta(
         const std::vector<char> &pixmap,
         png_uint_32 width, png_uint_32 height,
-        const std::vector<char> &delta);
+        const std::vector<char> &compressed);
 
     void assertEqual(const std::vector<char> &a,
                      const std::vector<char> &b,
@@ -62,10 +70,18 @@ class DeltaTests : public CPPUNIT_NS::TestFixture
 std::vector<char> DeltaTests::applyDelta(
     const std::vector<char> &pixmap,
     png_uint_32 width, png_uint_32 height,
-    const std::vector<char> &delta)
+    const std::vector<char> &compressed)
 {
-    LOK_ASSERT(delta.size() >= 4);
-    LOK_ASSERT(delta[0] == 'D');
+    LOK_ASSERT(compressed.size() >= 4);
+    LOK_ASSERT(compressed[0] == 'D');
+
+    // The operations are deflated, never to more than a few bytes a pixel.
+    std::vector<char> delta(width * height * 8);
+    uLongf deltaSize = delta.size();
+    LOK_ASSERT_EQUAL(Z_OK, uncompress(reinterpret_cast<Bytef*>(delta.data()), &deltaSize,
+                                      reinterpret_cast<const Bytef*>(&compressed[1]),
+                                      compressed.size() - 1));
+    delta.resize(deltaSize);
 
     // start with the same state.
     std::vector<char> output = pixmap;
@@ -73,7 +89,7 @@ std::vector<char> DeltaTests::applyDelta(
     LOK_ASSERT_EQUAL(output.size(), size_t(width * height * 4));
 
     size_t offset = 0, i;
-    for (i = 1; i < delta.size() && offset < output.size();)
+    for (i = 0; i < delta.size() && offset < output.size();)
     {
         switch (delta[i])
         {
@@ -168,26 +184,36 @@ void DeltaTests::testDeltaSequence()
     LOK_ASSERT(gen.createDelta(
                        reinterpret_cast<unsigned char *>(&text[0]),
                        0, 0, width, height, width, height,
-                       delta, textWid, 0) == false);
+                       delta, textWid, 0, LOK_TILEMODE_RGBA) == false);
     LOK_ASSERT(delta.size() == 0);
 
     // Build a delta between text2 & textWid
     LOK_ASSERT(gen.createDelta(
                        reinterpret_cast<unsigned char *>(&text2[0]),
                        0, 0, width, height, width, height,
-                       delta, text2Wid, textWid) == true);
+                       delta, text2Wid, textWid, LOK_TILEMODE_RGBA) == true);
     LOK_ASSERT(delta.size() > 0);
+    LOK_ASSERT(delta.size() <= DeltaGenerator::MaxDeltaSize);
 
     // Apply it to move to the second frame
     std::vector<char> reText2 = applyDelta(text, width, height, delta);
     assertEqual(reText2, text2, width, height);
 
+    // Not when the PNG would be smaller.
+    std::vector<char> tooLarge;
+    LOK_ASSERT(gen.createDelta(
+                       reinterpret_cast<unsigned char *>(&text2[0]),
+                       0, 0, width, height, width, height,
+                       tooLarge, text2Wid, textWid, LOK_TILEMODE_RGBA,
+                       nullptr, delta.size() - 1) == false);
+    LOK_ASSERT(tooLarge.empty());
+
     // Build a delta between text & text2Wid
     std::vector<char> two2one;
     LOK_ASSERT(gen.createDelta(
                        reinterpret_cast<unsigned char *>(&text[0]),
                        0, 0, width, height, width, height,
-                       two2one, textWid, text2Wid) == true);
+                       two2one, textWid, text2Wid, LOK_TILEMODE_RGBA) == true);
     LOK_ASSERT(two2one.size() > 0);
 
     // Apply it to get back to where we started
@@ -199,6 +225,167 @@ void DeltaTests::testRandomDeltas()
 {
 }
 
+namespace
+{
+/// The plain per-pixel division, as a reference for Png::unpremultiplyPixels.
+void unpremultiplyReference(unsigned char* data, size_t bytes)
+{
+    for (size_t i = 0; i < bytes; i += 4)
+    {
+        uint32_t pixel;
+        std::memcpy(&pixel, &data[i], sizeof(uint32_t));
+        const uint8_t alpha = pixel >> 24;
+        if (alpha == 0)
+        {
+            data[i] = data[i + 1] = data[i + 2] = data[i + 3] = 0;
+            continue;
+        }
+
+        data[i] = (((pixel & 0xff0000) >> 16) * 255 + alpha / 2) / alpha;
+        data[i + 1] = (((pixel & 0x00ff00) >> 8) * 255 + alpha / 2) / alpha;
+        data[i + 2] = ((pixel & 0x0000ff) * 255 + alpha / 2) / alpha;
+        data[i + 3] = alpha;
+    }
+}
+}
+
+void DeltaTests::testUnpremultiply()
+{
+    // Every channel value against every alpha.
+    std::vector<unsigned char> pixels;
+    for (uint32_t alpha = 0; alpha < 256; ++alpha)
+    {
+        for (uint32_t value = 0; value < 256; ++value)
+        {
+            const uint32_t pixel = (alpha << 24) | (value << 16) | ((255 - value) << 8) | (value / 2);
+            const size_t pos = pixels.size();
+            pixels.resize(pos + sizeof(uint32_t));
+            std::memcpy(&pixels[pos], &pixel, sizeof(uint32_t));
+        }
+    }
+
+    std::vector<unsigned char> expected = pixels;
+    unpremultiplyReference(expected.data(), expected.size());
+    Png::unpremultiplyPixels(pixels.data(), pixels.size());
+    LOK_ASSERT(expected == pixels);
+}
+
+void DeltaTests::testPngEncoders()
+{
+    const char* corpus[] = { TDOC "/delta-text.png", TDOC "/delta-text2.png",
+                             TDOC "/calc_render_0_512x512.3840,0.7680x7680.png" };
+    const Png::Encoder encoders[] = { Png::Encoder::LibPng, Png::Encoder::Fast };
+
+    // Each encoder, at the default level, round-trips the corpus losslessly.
+    for (const Png::Encoder encoder : encoders)
+    {
+        for (const char* path : corpus)
+        {
+            png_uint_32 height, width, rowBytes;
+            std::vector<char> image = loadPng(path, height, width, rowBytes);
+
+            // Encode as 256x256 tiles, as the kit does.
+            for (png_uint_32 y = 0; y < height; y += 256)
+            {
+                for (png_uint_32 x = 0; x < width; x += 256)
+                {
+                    const int tileWidth = std::min<int>(256, width - x);
+                    const int tileHeight = std::min<int>(256, height - y);
+                    std::vector<char> output;
+                    LOK_ASSERT(Png::encodeSubBufferToPNG(
+                                   reinterpret_cast<unsigned char*>(image.data()), x, y,
+                                   tileWidth, tileHeight, width, height, output,
+                                   LOK_TILEMODE_RGBA, encoder, 4));
+
+                    // Must decode to the very same pixels.
+                    std::stringstream stream;
+                    stream.write(output.data(), output.size());
+                    png_uint_32 decodedHeight, decodedWidth, decodedRowBytes;
+                    std::vector<png_bytep> rows =
+                        Png::decodePNG(stream, decodedHeight, decodedWidth, decodedRowBytes);
+                    LOK_ASSERT_EQUAL(static_cast<png_uint_32>(tileWidth), decodedWidth);
+                    LOK_ASSERT_EQUAL(static_cast<png_uint_32>(tileHeight), decodedHeight);
+                    for (int row = 0; row < tileHeight; ++row)
+                    {
+                        LOK_ASSERT(std::memcmp(rows[row],
+                                               &image[((y + row) * width + x) * 4],
+                                               tileWidth * 4) == 0);
+                    }
+                }
+            }
+        }
+    }
+}
+
+void DeltaTests::testSolidColourPng()
+{
+    png_uint_32 height, width, rowBytes;
+    std::vector<char> text = loadPng(TDOC "/delta-text.png", height, width, rowBytes);
+    uint32_t colour = 0;
+    LOK_ASSERT(!Png::isSolidColour(reinterpret_cast<unsigned char*>(text.data()), 0, 0,
+                                   width, height, width, colour));
+
+    // Opaque, translucent and transparent.
+    const uint32_t pixels[] = { 0xffe0d0c0, 0x80402010, 0x00000000 };
+    for (const uint32_t pixel : pixels)
+    {
+        std::vector<unsigned char> tile(256 * 256 * 4);
+        for (size_t i = 0; i < tile.size(); i += 4)
+            std::memcpy(&tile[i], &pixel, sizeof(uint32_t));
+
+        LOK_ASSERT(Png::isSolidColour(tile.data(), 0, 0, 256, 256, 256, colour));
+        LOK_ASSERT_EQUAL(pixel, colour);
+
+        std::vector<char> solid;
+        LOK_ASSERT(Png::encodeSolidColourToPNG(colour, 256, 256, solid, LOK_TILEMODE_BGRA));
+        LOK_ASSERT(solid.size() < 128);
+
+        std::vector<char> full;
+        LOK_ASSERT(Png::encodeBufferToPNG(tile.data(), 256, 256, full, LOK_TILEMODE_BGRA));
+
+        // Both must decode to the same pixels.
+        std::stringstream solidStream;
+        solidStream.write(solid.data(), solid.size());
+        std::vector<png_bytep> solidRows = Png::decodePNG(solidStream, height, width, rowBytes);
+        LOK_ASSERT_EQUAL(static_cast<png_uint_32>(256 * 4), rowBytes);
+
+        std::stringstream fullStream;
+        fullStream.write(full.data(), full.size());
+        std::vector<png_bytep> fullRows = Png::decodePNG(fullStream, height, width, rowBytes);
+
+        for (int y = 0; y < 256; ++y)
+            LOK_ASSERT(std::memcmp(solidRows[y], fullRows[y], rowBytes) == 0);
+    }
+}
+
+void DeltaTests::testTileHashing()
+{
+    png_uint_32 height, width, rowBytes;
+    std::vector<char> image = loadPng(TDOC "/calc_render_0_512x512.3840,0.7680x7680.png",
+                                      height, width, rowBytes);
+    unsigned char* pixmap = reinterpret_cast<unsigned char*>(image.data());
+
+    // Row hashes agree with hashing the row alone, wherever it is.
+    std::vector<uint64_t> rowHashes(256);
+    const uint64_t hash = Png::hashSubBufferRows(pixmap, 256, 0, 256, 256, width, height,
+                                                 rowHashes.data());
+    LOK_ASSERT(hash != 0);
+    for (int y = 0; y < 256; ++y)
+    {
+        uint64_t rowHash = 0;
+        Png::hashSubBufferRows(pixmap, 256, y, 256, 1, width, height, &rowHash);
+        LOK_ASSERT_EQUAL(rowHashes[y], rowHash);
+    }
+
+    // Any change of a pixel changes its row's hash and the tile's.
+    image[((100 * width) + 256 + 17) * 4 + 1] ^= 1;
+    std::vector<uint64_t> changed(256);
+    LOK_ASSERT(Png::hashSubBufferRows(pixmap, 256, 0, 256, 256, width, height,
+                                      changed.data()) != hash);
+    for (int y = 0; y < 256; ++y)
+        LOK_ASSERT_EQUAL(y == 100, rowHashes[y] != changed[y]);
+}
+
 CPPUNIT_TEST_SUITE_REGISTRATION(DeltaTests);
 
 /* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -16,6 +16,7 @@
 #include <Common.hpp>
 #include <Protocol.hpp>
 #include <LOOLWebSocket.hpp>
+#include <FileUtil.hpp>
 #include <MessageQueue.hpp>
 #include <Png.hpp>
 #include <TileCache.hpp>
@@ -25,6 +26,7 @@
 #include <countloolkits.hpp>
 #include <helpers.hpp>
 #include <test.hpp>
+#include <iostream>
 #include <sstream>
 
 using namespace helpers;
@@ -59,6 +61,11 @@ class TileCacheTests : public CPPUNIT_NS::TestFixture
     CPPUNIT_TEST(testSimple);
     CPPUNIT_TEST(testSimpleCombine);
     CPPUNIT_TEST(testSize);
+    CPPUNIT_TEST(testInvalidateIndex);
+    CPPUNIT_TEST(testTileMap);
+    CPPUNIT_TEST(testTileStore);
+    CPPUNIT_TEST(testTileCacheBudget);
+    CPPUNIT_TEST(testTilePrefetch);
     CPPUNIT_TEST(testCancelTiles);
     // unstable
     // CPPUNIT_TEST(testCancelTilesMultiView);
@@ -95,6 +102,11 @@ class TileCacheTests : public CPPUNIT_NS::TestFixture
     void testSimple();
     void testSimpleCombine();
     void testSize();
+    void testInvalidateIndex();
+    void testTileMap();
+    void testTileStore();
+    void testTileCacheBudget();
+    void testTilePrefetch();
     void testCancelTiles();
     void testCancelTilesMultiView();
     void testDisconnectMultiView();
@@ -293,6 +305,383 @@ void TileCacheTests::testSize()
     LOK_ASSERT_MESSAGE("tile cache too big", tc.getMemorySize() < maxSize);
 }
 
+void TileCacheTests::testInvalidateIndex()
+{
+    TileCache tc("doc.ods", std::chrono::system_clock::time_point());
+    tc.setMaxCacheSize(1024 * 1024 * 1024);
+
+    // A large spreadsheet: a few sheets, cached at two zooms.
+    const int nviewid = 0;
+    const int parts = 3;
+    const int rows = 200;
+    const int columns = 40;
+    const int tileSizes[] = { 3840, 1920 };
+    std::vector<char> data = genRandomData(512);
+    data[0] = 'P'; // Not a delta.
+    TileWireId id = 0;
+    for (int part = 0; part < parts; ++part)
+    {
+        for (const int tileSize : tileSizes)
+        {
+            for (int y = 0; y < rows; ++y)
+            {
+                for (int x = 0; x < columns; ++x)
+                {
+                    TileDesc tile(nviewid, part, 256, 256, x * tileSize, y * tileSize,
+                                  tileSize, tileSize, -1, 0, -1, false);
+                    tile.setWireId(++id);
+                    tc.saveTileAndNotify(tile, data.data(), data.size());
+                }
+            }
+        }
+    }
+
+    const std::size_t itemSize = data.size() + sizeof(TileDesc);
+    const std::size_t total = tc.getMemorySize();
+    LOK_ASSERT_EQUAL(static_cast<std::size_t>(parts * 2 * rows * columns) * itemSize, total);
+
+    // Inside one tile of each zoom, of the given part only.
+    tc.invalidateTiles("invalidatetiles: part=1 x=3841 y=3841 width=10 height=10", nviewid);
+    LOK_ASSERT_EQUAL(total - 2 * itemSize, tc.getMemorySize());
+    LOK_ASSERT(!tc.lookupTile(TileDesc(nviewid, 1, 256, 256, 3840, 3840, 3840, 3840, -1, 0, -1, false)));
+    LOK_ASSERT(!tc.lookupTile(TileDesc(nviewid, 1, 256, 256, 3840, 3840, 1920, 1920, -1, 0, -1, false)));
+    LOK_ASSERT(tc.lookupTile(TileDesc(nviewid, 0, 256, 256, 3840, 3840, 3840, 3840, -1, 0, -1, false)));
+    LOK_ASSERT(tc.lookupTile(TileDesc(nviewid, 1, 256, 256, 0, 3840, 3840, 3840, -1, 0, -1, false)));
+
+    // Another view has none of them.
+    tc.invalidateTiles("invalidatetiles: EMPTY", nviewid + 1);
+    LOK_ASSERT_EQUAL(total - 2 * itemSize, tc.getMemorySize());
+
+    // Per-keystroke invalidations of a cell, all over the sheets, drop only
+    // the tiles under it.
+    const int rounds = 2000;
+    for (int i = 0; i < rounds; ++i)
+    {
+        const int part = i % parts;
+        const int x = (i * 7919) % (columns * 3840);
+        const int y = (i * 104729) % (rows * 3840);
+        tc.invalidateTiles("invalidatetiles: part=" + std::to_string(part) + " x=" + std::to_string(x) +
+                           " y=" + std::to_string(y) + " width=1000 height=250", nviewid);
+        LOK_ASSERT(!tc.lookupTile(TileDesc(nviewid, part, 256, 256, x / 3840 * 3840, y / 3840 * 3840,
+                                           3840, 3840, -1, 0, -1, false)));
+    }
+    LOK_ASSERT(tc.getMemorySize() > 0);
+
+    // The whole view.
+    tc.invalidateTiles("invalidatetiles: EMPTY", nviewid);
+    LOK_ASSERT_EQUAL(static_cast<std::size_t>(0), tc.getMemorySize());
+}
+
+void TileCacheTests::testTileMap()
+{
+    // Against a std::map, with tiles that differ in any one field.
+    using Fields = std::tuple<int, int, int, int, int, int, int, int>;
+    const auto fields = [](const TileDesc& tile)
+    {
+        return Fields(tile.getNormalizedViewId(), tile.getPart(), tile.getWidth(), tile.getHeight(),
+                      tile.getTilePosX(), tile.getTilePosY(), tile.getTileWidth(), tile.getTileHeight());
+    };
+
+    TileMap<int> map;
+    std::map<Fields, int> expected;
+    LOK_ASSERT(map.empty());
+    LOK_ASSERT(map.find(TileDesc(0, 0, 256, 256, 0, 0, 3840, 3840, -1, 0, -1, false)) == map.end());
+
+    std::srand(42);
+    for (int i = 0; i < 20000; ++i)
+    {
+        // Also beyond the 16 bits kept exactly in the key.
+        const int part = std::rand() % 3 + (i % 5 == 0 ? 65536 : 0);
+        const int size = (std::rand() % 2 + 1) * 256;
+        const TileDesc tile(std::rand() % 2, part, size, size, std::rand() % 40 * 3840,
+                            std::rand() % 200 * 3840, 3840, 3840, -1, 0, -1, false);
+        const bool inserted = map.emplace(tile, i).second;
+        LOK_ASSERT_EQUAL(expected.emplace(fields(tile), i).second, inserted);
+
+        if (i % 3 == 0)
+        {
+            const TileDesc other(tile.getNormalizedViewId(), tile.getPart(), size, size,
+                                 tile.getTilePosX(), std::rand() % 200 * 3840, 3840, 3840, -1, 0, -1, false);
+            LOK_ASSERT_EQUAL(expected.erase(fields(other)), map.erase(other));
+        }
+    }
+    LOK_ASSERT_EQUAL(expected.size(), map.size());
+
+    // Erasing while iterating visits each entry once.
+    std::size_t visited = 0;
+    for (auto it = map.begin(); it != map.end();)
+    {
+        const auto found = expected.find(fields(it->first));
+        LOK_ASSERT(found != expected.end());
+        LOK_ASSERT_EQUAL(found->second, it->second);
+        ++visited;
+        if (it->second % 2)
+        {
+            expected.erase(found);
+            it = map.erase(it);
+        }
+        else
+            ++it;
+    }
+    LOK_ASSERT_EQUAL(expected.size(), map.size());
+    LOK_ASSERT(visited > map.size());
+
+    for (const auto& it : expected)
+    {
+        const TileDesc tile(std::get<0>(it.first), std::get<1>(it.first), std::get<2>(it.first),
+                            std::get<3>(it.first), std::get<4>(it.first), std::get<5>(it.first),
+                            std::get<6>(it.first), std::get<7>(it.first), -1, 0, -1, false);
+        const auto found = map.find(tile);
+        LOK_ASSERT(found != map.end());
+        LOK_ASSERT_EQUAL(it.second, found->second);
+    }
+
+    // Clients name tiles regardless of their size in pixels.
+    TileMap<TileWireId, TileIdKeyTraits> wireIds;
+    LOK_ASSERT(wireIds.emplace(TileDesc(0, 0, 256, 256, 3840, 0, 3840, 3840, -1, 0, -1, false), 1).second);
+    LOK_ASSERT(!wireIds.emplace(TileDesc(0, 0, 512, 512, 3840, 0, 3840, 3840, -1, 0, -1, false), 2).second);
+    LOK_ASSERT_EQUAL(static_cast<TileWireId>(1),
+                     wireIds.find(TileDesc(0, 0, 512, 512, 3840, 0, 3840, 3840, -1, 0, -1, false))->second);
+
+    TileKey key;
+    LOK_ASSERT(TileKey::parseId(TileDesc(0, 2, 256, 256, 3840, 7680, 3840, 3840, -1, 0, -1, false).generateID(), key));
+    LOK_ASSERT(key == TileKey::forId(TileDesc(0, 2, 512, 512, 3840, 7680, 3840, 3840, -1, 0, -1, false)));
+    LOK_ASSERT(!TileKey::parseId("2:3840:7680:3840:3840", key));
+    LOK_ASSERT(!TileKey::parseId("2:3840:7680:3840:3840:0x", key));
+
+    // Looking up the wire ids of a visible area, as done for each tile sent
+    // and invalidated, agrees with the map of tile IDs it replaces.
+    std::map<std::string, TileWireId> oldWireIds;
+    wireIds.clear();
+    for (int y = 0; y < 20; ++y)
+    {
+        for (int x = 0; x < 10; ++x)
+        {
+            const TileDesc tile(0, 0, 256, 256, x * 3840, y * 3840, 3840, 3840, -1, 0, -1, false);
+            wireIds.emplace(tile, x + y);
+            oldWireIds.emplace(tile.generateID(), x + y);
+        }
+    }
+    LOK_ASSERT_EQUAL(oldWireIds.size(), wireIds.size());
+
+    for (int y = 0; y < 20; ++y)
+    {
+        for (int x = 0; x < 10; ++x)
+        {
+            const TileDesc tile(0, 0, 512, 512, x * 3840, y * 3840, 3840, 3840, -1, 0, -1, false);
+            LOK_ASSERT_EQUAL(oldWireIds.find(tile.generateID())->second, wireIds.find(tile)->second);
+        }
+    }
+}
+
+void TileCacheTests::testTileStore()
+{
+    const std::string dir = FileUtil::createRandomTmpDir();
+    const std::size_t maxSize = 64 * 1024 * 1024;
+    std::vector<char> data = genRandomData(4096);
+    data[0] = 'P'; // Not a delta.
+    const auto tileAt = [](int x, int y, int nviewid = 0)
+    {
+        return TileDesc(nviewid, 0, 256, 256, x * 3840, y * 3840, 3840, 3840, -1, 0, -1, false);
+    };
+
+    // The first session renders the document.
+    {
+        TileCache tc("doc.odt", std::chrono::system_clock::time_point());
+        tc.setMaxCacheSize(maxSize);
+        tc.setStore(TileStore::open(dir, "doc.odt", "1", maxSize));
+        for (int y = 0; y < 100; ++y)
+        {
+            for (int x = 0; x < 4; ++x)
+                tc.saveTileAndNotify(tileAt(x, y), data.data(), data.size());
+        }
+
+        // Only the default view is kept, and what is invalidated goes.
+        tc.saveTileAndNotify(tileAt(0, 0, 1), data.data(), data.size());
+        tc.invalidateTiles("invalidatetiles: part=0 x=3841 y=3841 width=10 height=10", 0);
+    }
+
+    // The next one only loads it.
+    {
+        std::unique_ptr<TileStore> store = TileStore::open(dir, "doc.odt", "1", maxSize);
+        LOK_ASSERT(store);
+        LOK_ASSERT_EQUAL(static_cast<std::size_t>(399), store->size());
+        LOK_ASSERT(!store->find(tileAt(1, 1)));
+        LOK_ASSERT(!store->find(tileAt(0, 0, 1)));
+
+        // Another server has it open.
+        LOK_ASSERT(!TileStore::open(dir, "doc.odt", "1", maxSize));
+
+        const std::size_t itemSize = data.size() + sizeof(TileDesc);
+        TileCache tc("doc.odt", std::chrono::system_clock::time_point());
+        tc.setMaxCacheSize(3 * itemSize);
+        tc.setStore(std::move(store));
+        tc.saveTileAndNotify(tileAt(0, 0, 1), data.data(), data.size());
+        tc.saveTileAndNotify(tileAt(1, 0, 1), data.data(), data.size());
+        TileCache::Tile tile = tc.lookupTile(tileAt(3, 99));
+        LOK_ASSERT(tile);
+        LOK_ASSERT_EQUAL(data.size(), tile->size());
+        LOK_ASSERT(std::equal(data.begin(), data.end(), tile->begin()));
+        LOK_ASSERT_EQUAL(3 * itemSize, tc.getMemorySize());
+
+        // The restored tile goes first, though looked up after those rendered.
+        tc.saveTileAndNotify(tileAt(2, 0, 1), data.data(), data.size());
+        LOK_ASSERT_EQUAL(3 * itemSize, tc.getMemorySize());
+        LOK_ASSERT(tc.lookupTile(tileAt(0, 0, 1)));
+        LOK_ASSERT(tc.lookupTile(tileAt(1, 0, 1)));
+    }
+
+    // Another version of the document starts over, and drops the old one.
+    {
+        std::unique_ptr<TileStore> store = TileStore::open(dir, "doc.odt", "2", maxSize);
+        LOK_ASSERT(store);
+        LOK_ASSERT_EQUAL(static_cast<std::size_t>(0), store->size());
+        store->save(tileAt(0, 0), data.data(), data.size());
+    }
+
+    // The least recently used documents go beyond the budget.
+    for (int doc = 0; doc < 4; ++doc)
+    {
+        const std::string docKey = "doc" + std::to_string(doc) + ".odt";
+        std::unique_ptr<TileStore> store = TileStore::open(dir, docKey, "1", 256 * 1024);
+        LOK_ASSERT(store);
+        for (int y = 0; y < 20; ++y)
+            store->save(tileAt(0, y), data.data(), data.size());
+    }
+
+    LOK_ASSERT_EQUAL(static_cast<std::size_t>(0), TileStore::open(dir, "doc0.odt", "1", 256 * 1024)->size());
+    LOK_ASSERT_EQUAL(static_cast<std::size_t>(20), TileStore::open(dir, "doc3.odt", "1", 256 * 1024)->size());
+
+    // The stores open share half of the budget, and are not removed to make room.
+    {
+        std::unique_ptr<TileStore> first = TileStore::open(dir, "first.odt", "1", 256 * 1024);
+        std::unique_ptr<TileStore> second = TileStore::open(dir, "second.odt", "1", 256 * 1024);
+        LOK_ASSERT(first && second);
+        for (int y = 0; y < 20; ++y)
+        {
+            first->save(tileAt(0, y), data.data(), data.size());
+            second->save(tileAt(0, y), data.data(), data.size());
+        }
+        LOK_ASSERT(first->size() < 20);
+        LOK_ASSERT(first->size() + second->size() < 32);
+        LOK_ASSERT(!first->save(tileAt(1, 0), data.data(), data.size()));
+
+        LOK_ASSERT(TileStore::open(dir, "third.odt", "1", 16 * 1024));
+        LOK_ASSERT(!TileStore::open(dir, "doc3.odt", "1", 256 * 1024)->size());
+        LOK_ASSERT(FileUtil::Stat(first->getPath()).exists());
+        LOK_ASSERT(FileUtil::Stat(second->getPath()).exists());
+    }
+    LOK_ASSERT(TileStore::open(dir, "first.odt", "1", 256 * 1024)->save(tileAt(1, 0), data.data(), data.size()));
+
+    FileUtil::removeFile(dir, true);
+}
+
+void TileCacheTests::testTileCacheBudget()
+{
+    std::vector<char> data = genRandomData(64 * 1024);
+    data[0] = 'P'; // Not a delta.
+    const std::size_t itemSize = data.size() + sizeof(TileDesc);
+    const auto tileAt = [](int y)
+    {
+        return TileDesc(0, 0, 256, 256, 0, y * 3840, 3840, 3840, -1, 0, -1, false);
+    };
+
+    TileCache busy("busy.odt", std::chrono::system_clock::time_point());
+    TileCache idle("idle.odt", std::chrono::system_clock::time_point());
+    for (TileCache* tc : { &busy, &idle })
+    {
+        tc->setMaxCacheSize(1024 * itemSize);
+        for (int y = 0; y < 100; ++y)
+            tc->saveTileAndNotify(tileAt(y), data.data(), data.size());
+    }
+
+    // Half of the tiles of one document are in use.
+    for (int i = 0; i < 20; ++i)
+    {
+        for (int y = 0; y < 100; y += 2)
+            LOK_ASSERT(busy.lookupTile(tileAt(y)));
+    }
+
+    // The budget is shared by activity, the least recently used going first.
+    TileCache::setTotalBudget(100 * itemSize);
+    const auto now = std::chrono::steady_clock::now();
+    busy.updateBudget(now + std::chrono::seconds(2));
+    idle.updateBudget(now + std::chrono::seconds(2));
+    busy.updateBudget(now + std::chrono::seconds(4));
+
+    LOK_ASSERT(idle.getMemorySize() <= 512 * 1024);
+    LOK_ASSERT(busy.getMemorySize() <= 100 * itemSize);
+    LOK_ASSERT(busy.getMemorySize() > 50 * itemSize);
+    for (int y = 0; y < 100; y += 2)
+        LOK_ASSERT(busy.lookupTile(tileAt(y)));
+    LOK_ASSERT(!busy.lookupTile(tileAt(1)));
+    LOK_ASSERT(TileCache::getTotalMemorySize() >= busy.getMemorySize() + idle.getMemorySize());
+
+    std::ostringstream metrics;
+    TileCache::getMetrics(metrics);
+    LOK_ASSERT(metrics.str().find("tile_cache_evicted_bytes ") != std::string::npos);
+
+    TileCache::setTotalBudget(256 * 1024 * 1024);
+}
+
+void TileCacheTests::testTilePrefetch()
+{
+    const auto getMetric = [](const std::string& name)
+    {
+        std::ostringstream oss;
+        TileCache::getMetrics(oss);
+        std::istringstream iss(oss.str());
+        std::string key;
+        uint64_t value;
+        while (iss >> key >> value)
+        {
+            if (key == name)
+                return value;
+        }
+
+        return static_cast<uint64_t>(-1);
+    };
+    const uint64_t prefetched = getMetric("tile_cache_prefetched_count");
+    const uint64_t hits = getMetric("tile_cache_prefetch_hit_count");
+    const uint64_t wasted = getMetric("tile_cache_prefetch_wasted_count");
+
+    const std::vector<char> data(256, 'P');
+    const auto tileAt = [](int x)
+    {
+        TileDesc tile(0, 0, 256, 256, x * 3840, 0, 3840, 3840, -1, 0, -1, false);
+        tile.setPrefetch(true);
+        return tile;
+    };
+
+    TileCache tc("doc.ods", std::chrono::system_clock::time_point());
+    const auto now = std::chrono::steady_clock::now();
+    tc.registerTileBeingRendered(tileAt(0));
+    tc.registerTileBeingRendered(tileAt(1));
+    LOK_ASSERT(tc.isTileBeingPrefetched(tileAt(0)));
+    LOK_ASSERT_EQUAL(static_cast<size_t>(2), tc.countTilesBeingPrefetched(now));
+    LOK_ASSERT(!tc.hasTile(tileAt(0)));
+
+    for (int x = 0; x < 3; ++x)
+        tc.saveTileAndNotify(tileAt(x), data.data(), data.size());
+    LOK_ASSERT_EQUAL(static_cast<size_t>(0), tc.countTilesBeingPrefetched(now));
+    LOK_ASSERT(tc.hasTile(tileAt(0)));
+    LOK_ASSERT_EQUAL(prefetched + 3, getMetric("tile_cache_prefetched_count"));
+
+    // Only the first lookup is a hit, checking doesn't count.
+    LOK_ASSERT(tc.lookupTile(tileAt(0)));
+    LOK_ASSERT(tc.lookupTile(tileAt(0)));
+    LOK_ASSERT_EQUAL(hits + 1, getMetric("tile_cache_prefetch_hit_count"));
+    LOK_ASSERT_EQUAL(wasted, getMetric("tile_cache_prefetch_wasted_count"));
+
+    // Invalidated before any client got it, and cleared.
+    tc.invalidateTiles("invalidatetiles: part=0 x=4000 y=0 width=100 height=100", 0);
+    LOK_ASSERT(!tc.hasTile(tileAt(1)));
+    LOK_ASSERT_EQUAL(wasted + 1, getMetric("tile_cache_prefetch_wasted_count"));
+    tc.clear();
+    LOK_ASSERT_EQUAL(wasted + 2, getMetric("tile_cache_prefetch_wasted_count"));
+    LOK_ASSERT_EQUAL(hits + 1, getMetric("tile_cache_prefetch_hit_count"));
+}
+
 void TileCacheTests::testCancelTiles()
 {
     const char* testname = "cancelTiles ";
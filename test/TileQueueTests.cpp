@@ -7,6 +7,8 @@
 
 #include <config.h>
 
+#include <chrono>
+
 #include <test/lokassert.hpp>
 
 #include <Common.hpp>
@@ -42,30 +44,42 @@ class TileQueueTests : public CPPUNIT_NS::TestFixture
     CPPUNIT_TEST(testTileQueuePriority);
     CPPUNIT_TEST(testTileCombinedRendering);
     CPPUNIT_TEST(testTileRecombining);
+    CPPUNIT_TEST(testTileDeduplication);
+    CPPUNIT_TEST(testCancelTiles);
+    CPPUNIT_TEST(testDrainTiles);
     CPPUNIT_TEST(testViewOrder);
     CPPUNIT_TEST(testPreviewsDeprioritization);
+    CPPUNIT_TEST(testWorkClasses);
     CPPUNIT_TEST(testSenderQueue);
     CPPUNIT_TEST(testSenderQueueTileDeduplication);
     CPPUNIT_TEST(testInvalidateViewCursorDeduplication);
     CPPUNIT_TEST(testCallbackModifiedStatusIsSkipped);
     CPPUNIT_TEST(testCallbackInvalidation);
+    CPPUNIT_TEST(testCallbackInvalidationRegion);
     CPPUNIT_TEST(testCallbackIndicatorValue);
     CPPUNIT_TEST(testCallbackPageSize);
+    CPPUNIT_TEST(testCallbackViewCursor);
 
     CPPUNIT_TEST_SUITE_END();
 
     void testTileQueuePriority();
     void testTileCombinedRendering();
     void testTileRecombining();
+    void testTileDeduplication();
+    void testCancelTiles();
+    void testDrainTiles();
     void testViewOrder();
     void testPreviewsDeprioritization();
+    void testWorkClasses();
     void testSenderQueue();
     void testSenderQueueTileDeduplication();
     void testInvalidateViewCursorDeduplication();
     void testCallbackModifiedStatusIsSkipped();
     void testCallbackInvalidation();
+    void testCallbackInvalidationRegion();
     void testCallbackIndicatorValue();
     void testCallbackPageSize();
+    void testCallbackViewCursor();
 };
 
 void TileQueueTests::testTileQueuePriority()
@@ -163,7 +177,7 @@ void TileQueueTests::testTileRecombining()
     queue.put("tilecombine nviewid=0 part=0 width=256 height=256 tileposx=0,3840 tileposy=0,0 tilewidth=3840 tileheight=3840");
 
     // the tilecombine's get merged, resulting in 3 "tile" messages
-    LOK_ASSERT_EQUAL(3, static_cast<int>(queue.getQueue().size()));
+    LOK_ASSERT_EQUAL(3, static_cast<int>(queue.size()));
 
     // but when we later extract that, it is just one "tilecombine" message
     std::string message(payloadAsString(queue.get()));
@@ -171,7 +185,129 @@ void TileQueueTests::testTileRecombining()
     LOK_ASSERT_EQUAL(std::string("tilecombine nviewid=0 part=0 width=256 height=256 tileposx=7680,0,3840 tileposy=0,0,0 imgsize=0,0,0 tilewidth=3840 tileheight=3840 ver=-1,-1,-1 oldwid=0,0,0 wid=0,0,0"), message);
 
     // and nothing remains in the queue
-    LOK_ASSERT_EQUAL(0, static_cast<int>(queue.getQueue().size()));
+    LOK_ASSERT_EQUAL(0, static_cast<int>(queue.size()));
+}
+
+void TileQueueTests::testTileDeduplication()
+{
+    TileQueue queue;
+
+    // Flood the queue with requests for the same row of 10 tiles, with the
+    // odd callback in between.
+    for (int i = 0; i < 1000; ++i)
+    {
+        queue.put("tile nviewid=0 part=0 width=256 height=256 tileposx=" + std::to_string((i % 10) * 3840)
+                  + " tileposy=0 tilewidth=3840 tileheight=3840 oldwid=0 wid=0 ver=" + std::to_string(i));
+        if (i % 100 == 0)
+            queue.put("callback all 10 " + std::to_string(i));
+    }
+
+    // Only the latest request of each tile is left, as is the latest callback.
+    LOK_ASSERT_EQUAL(static_cast<size_t>(11), queue.size());
+    LOK_ASSERT_EQUAL(std::string("callback all 10 900"), payloadAsString(queue.get()));
+
+    LOK_ASSERT_EQUAL(std::string("tilecombine nviewid=0 part=0 width=256 height=256 tileposx=0,3840,7680,11520,15360,19200,23040,26880,30720,34560 tileposy=0,0,0,0,0,0,0,0,0,0 imgsize=0,0,0,0,0,0,0,0,0,0 tilewidth=3840 tileheight=3840 ver=990,991,992,993,994,995,996,997,998,999 oldwid=0,0,0,0,0,0,0,0,0,0 wid=0,0,0,0,0,0,0,0,0,0"),
+                     payloadAsString(queue.get()));
+    LOK_ASSERT_EQUAL(static_cast<size_t>(0), queue.size());
+    LOK_ASSERT(queue.isEmpty());
+}
+
+void TileQueueTests::testCancelTiles()
+{
+    TileQueue queue;
+
+    // A deep queue, as when scrolling through a big spreadsheet: 100 rows of
+    // 100 tiles, each with its own version.
+    const int rows = 100;
+    const int columns = 100;
+    for (int y = 0; y < rows; ++y)
+    {
+        std::string tilePosX;
+        std::string tilePosY;
+        std::string vers;
+        for (int x = 0; x < columns; ++x)
+        {
+            const char* comma = (x ? "," : "");
+            tilePosX += comma + std::to_string(x * 3840);
+            tilePosY += comma + std::to_string(y * 3840);
+            vers += comma + std::to_string(y * columns + x + 1);
+        }
+
+        queue.put("tilecombine nviewid=0 part=0 width=256 height=256 tileposx=" + tilePosX
+                  + " tileposy=" + tilePosY + " tilewidth=3840 tileheight=3840 ver=" + vers);
+    }
+
+    // Previews are never cancelled, whatever their version.
+    const std::string preview = "tile nviewid=0 part=1 width=180 height=135 tileposx=0 tileposy=0 tilewidth=15875 tileheight=11906 ver=5 id=1";
+    queue.put(preview);
+    LOK_ASSERT_EQUAL(static_cast<size_t>(rows * columns + 1), queue.size());
+
+    // Versions that aren't queued are ignored.
+    queue.put("canceltiles 0,10,100001");
+    LOK_ASSERT_EQUAL(static_cast<size_t>(rows * columns), queue.size());
+
+    // Cancel the rest, ten at a time, newest first.
+    for (int ver = rows * columns; ver > 0; ver -= 10)
+    {
+        std::string canceltiles = "canceltiles ";
+        for (int i = 0; i < 10; ++i)
+            canceltiles += std::to_string(ver - i) + ',';
+
+        queue.put(canceltiles);
+    }
+
+    LOK_ASSERT_EQUAL(static_cast<size_t>(1), queue.size());
+    LOK_ASSERT_EQUAL(preview, payloadAsString(queue.get()));
+    LOK_ASSERT(queue.isEmpty());
+}
+
+void TileQueueTests::testDrainTiles()
+{
+    TileQueue queue;
+
+    // 50 rows of 16 tiles, with a gap between the rows so none are combined.
+    const int rows = 50;
+    const int columns = 16;
+    for (int y = 0; y < rows; ++y)
+    {
+        std::string tilePosX;
+        std::string tilePosY;
+        for (int x = 0; x < columns; ++x)
+        {
+            const char* comma = (x ? "," : "");
+            tilePosX += comma + std::to_string(x * 3840);
+            tilePosY += comma + std::to_string(y * 2 * 3840);
+        }
+
+        queue.put("tilecombine nviewid=0 part=0 width=256 height=256 tileposx=" + tilePosX
+                  + " tileposy=" + tilePosY + " tilewidth=3840 tileheight=3840");
+    }
+
+    LOK_ASSERT_EQUAL(static_cast<size_t>(rows * columns), queue.size());
+
+    // The cursor moves to row 30 once its tiles are queued: that row goes first,
+    // then the others in the order they were queued, each in one piece.
+    queue.updateCursorPosition(0, 0, 0, 30 * 2 * 3840, 10, 100);
+    std::vector<int> order(1, 30);
+    for (int y = 0; y < rows; ++y)
+    {
+        if (y != 30)
+            order.push_back(y);
+    }
+
+    for (const int y : order)
+    {
+        const TileCombined combined = TileCombined::parse(payloadAsString(queue.get()));
+        const std::vector<TileDesc>& tiles = combined.getTiles();
+        LOK_ASSERT_EQUAL(static_cast<size_t>(columns), tiles.size());
+        for (int x = 0; x < columns; ++x)
+        {
+            LOK_ASSERT_EQUAL(x * 3840, tiles[x].getTilePosX());
+            LOK_ASSERT_EQUAL(y * 2 * 3840, tiles[x].getTilePosY());
+        }
+    }
+
+    LOK_ASSERT(queue.isEmpty());
 }
 
 void TileQueueTests::testViewOrder()
@@ -197,7 +333,7 @@ void TileQueueTests::testViewOrder()
     for (auto &tile : tiles)
         queue.put(tile);
 
-    LOK_ASSERT_EQUAL(4, static_cast<int>(queue.getQueue().size()));
+    LOK_ASSERT_EQUAL(4, static_cast<int>(queue.size()));
 
     // should result in the 3, 2, 1, 0 order of the tiles thanks to the cursor
     // positions
@@ -229,11 +365,11 @@ void TileQueueTests::testPreviewsDeprioritization()
     }
 
     // stays empty after all is done
-    LOK_ASSERT_EQUAL(0, static_cast<int>(queue.getQueue().size()));
+    LOK_ASSERT_EQUAL(0, static_cast<int>(queue.size()));
 
     // re-ordering case - put previews and normal tiles to the queue and get
-    // everything back again but this time the tiles have to interleave with
-    // the previews
+    // everything back again but this time the tiles have to go before the
+    // previews queued earlier, as long as those are not overdue
     const std::vector<std::string> tiles =
     {
         "tile nviewid=0 part=0 width=256 height=256 tileposx=0 tileposy=0 tilewidth=3840 tileheight=3840 oldwid=0 wid=0 ver=-1",
@@ -245,18 +381,33 @@ void TileQueueTests::testPreviewsDeprioritization()
 
     queue.put(tiles[0]);
 
-    LOK_ASSERT_EQUAL(previews[0], payloadAsString(queue.get()));
     LOK_ASSERT_EQUAL(tiles[0], payloadAsString(queue.get()));
-    LOK_ASSERT_EQUAL(previews[1], payloadAsString(queue.get()));
+    LOK_ASSERT_EQUAL(previews[0], payloadAsString(queue.get()));
 
     queue.put(tiles[1]);
 
-    LOK_ASSERT_EQUAL(previews[2], payloadAsString(queue.get()));
     LOK_ASSERT_EQUAL(tiles[1], payloadAsString(queue.get()));
+    LOK_ASSERT_EQUAL(previews[1], payloadAsString(queue.get()));
+    LOK_ASSERT_EQUAL(previews[2], payloadAsString(queue.get()));
     LOK_ASSERT_EQUAL(previews[3], payloadAsString(queue.get()));
 
     // stays empty after all is done
-    LOK_ASSERT_EQUAL(0, static_cast<int>(queue.getQueue().size()));
+    LOK_ASSERT_EQUAL(0, static_cast<int>(queue.size()));
+
+    // starvation case - overdue previews go before the tiles queued later
+    queue.setLatencyTarget(TileQueue::WorkClass::Previews, std::chrono::milliseconds(0));
+    queue.setLatencyTarget(TileQueue::WorkClass::VisibleTiles, std::chrono::milliseconds(0));
+
+    queue.put(previews[0]);
+    queue.put(previews[1]);
+    queue.put(tiles[0]);
+
+    LOK_ASSERT_EQUAL(previews[0], payloadAsString(queue.get()));
+    LOK_ASSERT_EQUAL(previews[1], payloadAsString(queue.get()));
+    LOK_ASSERT_EQUAL(tiles[0], payloadAsString(queue.get()));
+
+    queue.setLatencyTarget(TileQueue::WorkClass::Previews, std::chrono::milliseconds(500));
+    queue.setLatencyTarget(TileQueue::WorkClass::VisibleTiles, std::chrono::milliseconds(50));
 
     // cursor positioning case - the cursor position should not prioritize the
     // previews
@@ -269,7 +420,50 @@ void TileQueueTests::testPreviewsDeprioritization()
     LOK_ASSERT_EQUAL(previews[0], payloadAsString(queue.get()));
 
     // stays empty after all is done
-    LOK_ASSERT_EQUAL(0, static_cast<int>(queue.getQueue().size()));
+    LOK_ASSERT_EQUAL(0, static_cast<int>(queue.size()));
+}
+
+void TileQueueTests::testWorkClasses()
+{
+    TileQueue queue;
+
+    const std::string prefetch = "tile nviewid=0 part=0 width=256 height=256 tileposx=0 tileposy=0 tilewidth=3840 tileheight=3840 oldwid=0 wid=0 ver=1 prefetch=1";
+    const std::string visible = "tile nviewid=0 part=0 width=256 height=256 tileposx=3840 tileposy=0 tilewidth=3840 tileheight=3840 oldwid=0 wid=0 ver=2";
+    const std::string callback = "callback all " + std::to_string(LOK_CALLBACK_STATE_CHANGED) + " .uno:Bold=true";
+
+    // Callbacks go before the tiles, the tiles before those rendered ahead,
+    // which are not combined with the visible ones.
+    queue.put(prefetch);
+    queue.put(visible);
+    queue.put(callback);
+
+    LOK_ASSERT_EQUAL(callback, payloadAsString(queue.get()));
+    LOK_ASSERT_EQUAL(visible, payloadAsString(queue.get()));
+    LOK_ASSERT_EQUAL(prefetch, payloadAsString(queue.get()));
+    LOK_ASSERT(queue.isEmpty());
+
+    // Tiles at the cursor go before the callbacks.
+    queue.put(callback);
+    queue.put(visible);
+    queue.updateCursorPosition(0, 0, 3840, 0, 10, 100);
+
+    LOK_ASSERT_EQUAL(visible, payloadAsString(queue.get()));
+    LOK_ASSERT_EQUAL(callback, payloadAsString(queue.get()));
+
+    // The stats of each class.
+    queue.put(prefetch);
+
+    std::ostringstream oss;
+    queue.dumpState(oss);
+    const std::string state = oss.str();
+    LOK_ASSERT(state.find("inputTiles:\n\t\t\tdepth: 0\n\t\t\ttarget: 10 ms\n\t\t\tserved: 1\n")
+               != std::string::npos);
+    LOK_ASSERT(state.find("visibleTiles:\n\t\t\tdepth: 0\n\t\t\ttarget: 50 ms\n\t\t\tserved: 1\n")
+               != std::string::npos);
+    LOK_ASSERT(state.find("callbacks:\n\t\t\tdepth: 0\n\t\t\ttarget: 20 ms\n\t\t\tserved: 2\n")
+               != std::string::npos);
+    LOK_ASSERT(state.find("background:\n\t\t\tdepth: 1\n\t\t\ttarget: 2000 ms\n\t\t\tserved: 1\n")
+               != std::string::npos);
 }
 
 void TileQueueTests::testSenderQueue()
@@ -359,6 +553,19 @@ void TileQueueTests::testSenderQueueTileDeduplication()
     LOK_ASSERT_EQUAL(dup_messages[2], std::string(item->data().data(), item->data().size()));
 
     LOK_ASSERT_EQUAL(static_cast<size_t>(0), queue.size());
+
+    // Deltas depend on the tile queued before them.
+    const std::string tile = "tile: nviewid=0 part=0 width=180 height=135 tileposx=0 tileposy=0 tilewidth=15875 tileheight=11906";
+    queue.enqueue(std::make_shared<Message>(tile + " oldwid=0 wid=1 ver=1\n\x89PNG", Message::Dir::Out));
+    queue.enqueue(std::make_shared<Message>(tile + " oldwid=1 wid=2 ver=2\nDd", Message::Dir::Out));
+    queue.enqueue(std::make_shared<Message>(tile + " oldwid=2 wid=3 ver=3\nDd", Message::Dir::Out));
+    LOK_ASSERT_EQUAL(static_cast<size_t>(3), queue.size());
+
+    // A new full tile replaces them all.
+    queue.enqueue(std::make_shared<Message>(tile + " oldwid=0 wid=4 ver=4\n\x89PNG", Message::Dir::Out));
+    LOK_ASSERT_EQUAL(static_cast<size_t>(1), queue.size());
+    LOK_ASSERT_EQUAL(true, queue.dequeue(item));
+    LOK_ASSERT_EQUAL(static_cast<size_t>(0), queue.size());
 }
 
 void TileQueueTests::testInvalidateViewCursorDeduplication()
@@ -428,7 +635,7 @@ void TileQueueTests::testCallbackInvalidation()
     queue.put("callback all 0 284, 1418, 11105, 275, 0");
     queue.put("callback all 0 4299, 1418, 7090, 275, 0");
 
-    LOK_ASSERT_EQUAL(1, static_cast<int>(queue.getQueue().size()));
+    LOK_ASSERT_EQUAL(1, static_cast<int>(queue.size()));
 
     LOK_ASSERT_EQUAL(std::string("callback all 0 284, 1418, 11105, 275, 0"), payloadAsString(queue.get()));
 
@@ -438,15 +645,58 @@ void TileQueueTests::testCallbackInvalidation()
     queue.put("callback all 0 4299, 10418, 7090, 275, 0");
     queue.put("callback all 0 4299, 20418, 7090, 275, 0");
 
-    LOK_ASSERT_EQUAL(4, static_cast<int>(queue.getQueue().size()));
+    LOK_ASSERT_EQUAL(4, static_cast<int>(queue.size()));
 
     queue.put("callback all 0 EMPTY, 0");
 
-    LOK_ASSERT_EQUAL(2, static_cast<int>(queue.getQueue().size()));
+    LOK_ASSERT_EQUAL(2, static_cast<int>(queue.size()));
     LOK_ASSERT_EQUAL(std::string("callback all 0 4299, 1418, 7090, 275, 1"), payloadAsString(queue.get()));
     LOK_ASSERT_EQUAL(std::string("callback all 0 EMPTY, 0"), payloadAsString(queue.get()));
 }
 
+void TileQueueTests::testCallbackInvalidationRegion()
+{
+    TileQueue queue;
+
+    // Typing: each character invalidates a small rectangle next to the last.
+    for (int i = 0; i < 20; ++i)
+        queue.putCallback(-1, LOK_CALLBACK_INVALIDATE_TILES, std::to_string(1000 + i * 100) + ", 1418, 100, 275, 0");
+
+    LOK_ASSERT_EQUAL(static_cast<size_t>(1), queue.size());
+    LOK_ASSERT_EQUAL(std::string("callback all 0 1000, 1418, 2000, 275, 0"), payloadAsString(queue.get()));
+
+    // Disjoint rectangles are kept apart, up to a point.
+    for (int i = 0; i < 8; ++i)
+        queue.putCallback(-1, LOK_CALLBACK_INVALIDATE_TILES, "0, " + std::to_string(i * 100000) + ", 100, 100, 0");
+
+    LOK_ASSERT_EQUAL(static_cast<size_t>(8), queue.size());
+    LOK_ASSERT_EQUAL(std::string("callback all 0 0, 0, 100, 100, 0"), payloadAsString(queue.get()));
+    LOK_ASSERT_EQUAL(static_cast<size_t>(7), queue.size());
+
+    // Beyond which the region is collapsed to its bounding box.
+    queue.putCallback(-1, LOK_CALLBACK_INVALIDATE_TILES, "0, 900000, 100, 100, 0");
+    queue.putCallback(-1, LOK_CALLBACK_INVALIDATE_TILES, "0, 1000000, 100, 100, 0");
+    LOK_ASSERT_EQUAL(static_cast<size_t>(1), queue.size());
+    LOK_ASSERT_EQUAL(std::string("callback all 0 0, 100000, 100, 900100, 0"), payloadAsString(queue.get()));
+
+    // Invalidations are not moved past other callbacks.
+    queue.putCallback(-1, LOK_CALLBACK_INVALIDATE_TILES, "0, 0, 100, 100, 0");
+    queue.putCallback(-1, LOK_CALLBACK_STATE_CHANGED, ".uno:Bold=true");
+    queue.putCallback(-1, LOK_CALLBACK_INVALIDATE_TILES, "100, 0, 100, 100, 0");
+    queue.putCallback(-1, LOK_CALLBACK_INVALIDATE_TILES, "EMPTY, 1");
+    LOK_ASSERT_EQUAL(static_cast<size_t>(4), queue.size());
+
+    std::unique_ptr<TileQueue::Callback> callback = queue.popCallback();
+    LOK_ASSERT_EQUAL(std::string("0, 0, 100, 100, 0"), callback->getPayload());
+    callback = queue.popCallback();
+    LOK_ASSERT_EQUAL(std::string(".uno:Bold=true"), callback->getPayload());
+    callback = queue.popCallback();
+    LOK_ASSERT_EQUAL(std::string("100, 0, 100, 100, 0"), callback->getPayload());
+    callback = queue.popCallback();
+    LOK_ASSERT_EQUAL(std::string("EMPTY, 1"), callback->getPayload());
+    LOK_ASSERT(queue.isEmpty());
+}
+
 void TileQueueTests::testCallbackIndicatorValue()
 {
     TileQueue queue;
@@ -455,7 +705,7 @@ void TileQueueTests::testCallbackIndicatorValue()
     queue.put("callback all 10 25");
     queue.put("callback all 10 50");
 
-    LOK_ASSERT_EQUAL(1, static_cast<int>(queue.getQueue().size()));
+    LOK_ASSERT_EQUAL(1, static_cast<int>(queue.size()));
     LOK_ASSERT_EQUAL(std::string("callback all 10 50"), payloadAsString(queue.get()));
 }
 
@@ -467,10 +717,56 @@ void TileQueueTests::testCallbackPageSize()
     queue.put("callback all 13 12474, 188626");
     queue.put("callback all 13 12474, 205748");
 
-    LOK_ASSERT_EQUAL(1, static_cast<int>(queue.getQueue().size()));
+    LOK_ASSERT_EQUAL(1, static_cast<int>(queue.size()));
     LOK_ASSERT_EQUAL(std::string("callback all 13 12474, 205748"), payloadAsString(queue.get()));
 }
 
+void TileQueueTests::testCallbackViewCursor()
+{
+    TileQueue queue;
+
+    const std::string view1 = "{ \"viewId\": \"1\", \"rectangle\": \"3999, 1418, 0, 298\", \"part\": \"0\" }";
+    const std::string view2 = "{ \"viewId\": \"2\", \"rectangle\": \"3999, 1418, 0, 298\", \"part\": \"0\" }";
+    const std::string view1Moved = "{ \"viewId\": \"1\", \"rectangle\": \"1000, 1418, 0, 298\", \"part\": \"0\" }";
+
+    // The cursors of different views are kept apart, whether the viewId is
+    // given or read from the payload.
+    queue.putCallback(0, LOK_CALLBACK_INVALIDATE_VIEW_CURSOR, view1, "1");
+    queue.putCallback(0, LOK_CALLBACK_INVALIDATE_VIEW_CURSOR, view2);
+    queue.put("tile nviewid=0 part=0 width=256 height=256 tileposx=0 tileposy=0 tilewidth=3840 tileheight=3840 oldwid=0 wid=0 ver=1");
+    queue.putCallback(0, LOK_CALLBACK_INVALIDATE_VIEW_CURSOR, view1Moved);
+    LOK_ASSERT_EQUAL(static_cast<size_t>(3), queue.size());
+
+    std::unique_ptr<TileQueue::Callback> callback = queue.popCallback();
+    LOK_ASSERT(callback != nullptr);
+    LOK_ASSERT_EQUAL(0, callback->getView());
+    LOK_ASSERT_EQUAL(static_cast<int>(LOK_CALLBACK_INVALIDATE_VIEW_CURSOR), callback->getType());
+    LOK_ASSERT_EQUAL(view2, callback->getPayload());
+
+    // Not a callback next: the tile at the cursor is more urgent.
+    queue.updateCursorPosition(0, 0, 0, 0, 10, 100);
+    LOK_ASSERT(queue.popCallback() == nullptr);
+    LOK_ASSERT_EQUAL(static_cast<size_t>(2), queue.size());
+    queue.get();
+
+    callback = queue.popCallback();
+    LOK_ASSERT(callback != nullptr);
+    LOK_ASSERT_EQUAL(view1Moved, callback->getPayload());
+    LOK_ASSERT(callback->isFor(0));
+    LOK_ASSERT(!callback->isFor(1));
+    LOK_ASSERT(queue.isEmpty());
+
+    // Broadcasts, possibly to all but one view.
+    queue.put("callback except-1 " + std::to_string(LOK_CALLBACK_STATE_CHANGED) + " .uno:Bold=true");
+    callback = queue.popCallback();
+    LOK_ASSERT(callback != nullptr);
+    LOK_ASSERT(callback->isFor(0));
+    LOK_ASSERT(!callback->isFor(1));
+    LOK_ASSERT_EQUAL(std::string(".uno:Bold=true"), callback->getPayload());
+    LOK_ASSERT_EQUAL("callback except-1 " + std::to_string(LOK_CALLBACK_STATE_CHANGED) + " .uno:Bold=true",
+                     callback->serialize());
+}
+
 void TileQueueTests::testCallbackModifiedStatusIsSkipped()
 {
     TileQueue queue;
@@ -490,7 +786,7 @@ void TileQueueTests::testCallbackModifiedStatusIsSkipped()
         queue.put(msg);
     }
 
-    LOK_ASSERT_EQUAL(static_cast<size_t>(4), queue.getQueue().size());
+    LOK_ASSERT_EQUAL(static_cast<size_t>(4), queue.size());
 
     LOK_ASSERT_EQUAL(messages[0], payloadAsString(queue.get()));
     LOK_ASSERT_EQUAL(messages[1], payloadAsString(queue.get()));
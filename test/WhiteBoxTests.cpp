@@ -9,6 +9,7 @@
 
 #include <chrono>
 #include <fstream>
+#include <unistd.h>
 #include <test/lokassert.hpp>
 
 #include <Auth.hpp>
@@ -19,6 +20,7 @@
 #include <MessageQueue.hpp>
 #include <Protocol.hpp>
 #include <TileDesc.hpp>
+#include <TileShm.hpp>
 #include <Util.hpp>
 #include <JsonUtil.hpp>
 #include <RequestDetails.hpp>
@@ -35,6 +37,7 @@ class WhiteBoxTests : public CPPUNIT_NS::TestFixture
     CPPUNIT_TEST(testLOOLProtocolFunctions);
     CPPUNIT_TEST(testSplitting);
     CPPUNIT_TEST(testMessageAbbreviation);
+    CPPUNIT_TEST(testBatch);
     CPPUNIT_TEST(testTokenizer);
     CPPUNIT_TEST(testTokenizerTokenizeAnyOf);
     CPPUNIT_TEST(testReplace);
@@ -47,6 +50,8 @@ class WhiteBoxTests : public CPPUNIT_NS::TestFixture
     CPPUNIT_TEST(testAnonymization);
     CPPUNIT_TEST(testTime);
     CPPUNIT_TEST(testBufferClass);
+    CPPUNIT_TEST(testTileShm);
+    CPPUNIT_TEST(testTileBinaryHeader);
     CPPUNIT_TEST(testStringVector);
     CPPUNIT_TEST(testRequestDetails_DownloadURI);
     CPPUNIT_TEST(testRequestDetails_loleafletURI);
@@ -61,6 +66,7 @@ class WhiteBoxTests : public CPPUNIT_NS::TestFixture
     void testLOOLProtocolFunctions();
     void testSplitting();
     void testMessageAbbreviation();
+    void testBatch();
     void testTokenizer();
     void testTokenizerTokenizeAnyOf();
     void testReplace();
@@ -73,6 +79,8 @@ class WhiteBoxTests : public CPPUNIT_NS::TestFixture
     void testAnonymization();
     void testTime();
     void testBufferClass();
+    void testTileShm();
+    void testTileBinaryHeader();
     void testStringVector();
     void testRequestDetails_DownloadURI();
     void testRequestDetails_loleafletURI();
@@ -331,6 +339,35 @@ void WhiteBoxTests::testMessageAbbreviation()
     LOK_ASSERT_EQUAL(abbr, LOOLProtocol::getAbbreviatedMessage(s));
 }
 
+void WhiteBoxTests::testBatch()
+{
+    const std::vector<std::string> messages =
+    {
+        "client-0001 invalidatetiles: part=0 x=0 y=0 width=100 height=100",
+        "",
+        "client-0002 statechanged: { \"commandName\": \".uno:Bold\",\n \"state\": \"true\" }"
+    };
+
+    std::vector<char> batch;
+    for (const std::string& message : messages)
+        LOOLProtocol::appendToBatch(batch, message.data(), message.size());
+
+    LOK_ASSERT_EQUAL(std::string("batch:"), LOOLProtocol::getFirstLine(batch));
+
+    std::vector<std::vector<char>> split;
+    LOK_ASSERT(LOOLProtocol::splitBatch(batch.data(), batch.size(), split));
+    LOK_ASSERT_EQUAL(messages.size(), split.size());
+    for (std::size_t i = 0; i < messages.size(); ++i)
+        LOK_ASSERT_EQUAL(messages[i], std::string(split[i].data(), split[i].size()));
+
+    // Not a batch.
+    split.clear();
+    LOK_ASSERT(!LOOLProtocol::splitBatch(messages[0].data(), messages[0].size(), split));
+
+    // Truncated.
+    LOK_ASSERT(!LOOLProtocol::splitBatch(batch.data(), batch.size() - 1, split));
+}
+
 void WhiteBoxTests::testTokenizer()
 {
     StringVector tokens;
@@ -1057,6 +1094,112 @@ void WhiteBoxTests::testBufferClass()
     CPPUNIT_ASSERT_EQUAL(true, buf.empty());
 }
 
+void WhiteBoxTests::testTileShm()
+{
+#ifdef __linux__
+    const std::shared_ptr<TileShm> kit = TileShm::create(4096);
+    LOK_ASSERT(kit);
+
+    // WSD gets its own fd of the same memfd.
+    const std::shared_ptr<TileShm> wsd = TileShm::attach(dup(kit->getFD()));
+    LOK_ASSERT(wsd);
+    LOK_ASSERT_EQUAL(kit->getCapacity(), wsd->getCapacity());
+
+    const std::size_t size = kit->getCapacity() * 2 / 5;
+    const std::vector<char> a(size, 'a');
+    const std::vector<char> b(size, 'b');
+    const std::vector<char> c(size, 'c');
+
+    uint64_t posA = 0;
+    uint64_t posB = 0;
+    uint64_t posC = 0;
+    LOK_ASSERT(kit->write(a.data(), size, posA));
+    LOK_ASSERT(kit->write(b.data(), size, posB));
+    LOK_ASSERT_EQUAL(static_cast<uint64_t>(size), posB);
+
+    // c doesn't fit before the end, and would wrap over a.
+    LOK_ASSERT(!kit->write(c.data(), size, posC));
+
+    std::shared_ptr<TileShm::Block> blockA = wsd->receive(posA, size);
+    std::shared_ptr<TileShm::Block> blockB = wsd->receive(posB, size);
+    LOK_ASSERT(blockA && blockB);
+    LOK_ASSERT_EQUAL(0, memcmp(blockB->data(), b.data(), size));
+
+    // Only in the order written.
+    LOK_ASSERT(!wsd->receive(posA, size));
+
+    // a still pins the ring.
+    blockB.reset();
+    LOK_ASSERT(!kit->write(c.data(), size, posC));
+
+    blockA.reset();
+    LOK_ASSERT(kit->write(c.data(), size, posC));
+    LOK_ASSERT_EQUAL(static_cast<uint64_t>(kit->getCapacity()), posC);
+
+    const std::shared_ptr<TileShm::Block> blockC = wsd->receive(posC, size);
+    LOK_ASSERT(blockC);
+    LOK_ASSERT_EQUAL(0, memcmp(blockC->data(), c.data(), size));
+
+    // Across the end.
+    LOK_ASSERT(!wsd->receive(posC + 2 * size, size));
+#endif
+}
+
+void WhiteBoxTests::testTileBinaryHeader()
+{
+    // A tilecombine of a full HD view.
+    std::vector<TileDesc> tiles;
+    for (int y = 0; y < 6; ++y)
+    {
+        for (int x = 0; x < 10; ++x)
+        {
+            tiles.emplace_back(3, 1, 256, 256, x * 3840, y * 3840, 3840, 3840, 100 + x, 1000 + y * 10 + x, -1, false);
+            tiles.back().setOldWireId(x * y);
+            tiles.back().setWireId(100000 + x + y);
+            tiles.back().setAllowDelta(true);
+        }
+    }
+
+    const TileCombined tileCombined = TileCombined::create(tiles);
+    std::string header = tileCombined.serializeBinary(tiles, true, 1234567890123ULL);
+    header += "images";
+
+    std::size_t offset = 0;
+    bool inShm = false;
+    uint64_t shmPos = 0;
+    const TileCombined parsed = TileCombined::parseBinary(header.data(), header.size(), offset, inShm, shmPos);
+    LOK_ASSERT_EQUAL(std::string("images"), header.substr(offset));
+    LOK_ASSERT(inShm);
+    LOK_ASSERT_EQUAL(static_cast<uint64_t>(1234567890123ULL), shmPos);
+
+    // The same as the text form.
+    LOK_ASSERT_EQUAL(tileCombined.serialize("tilecombine:", "", tiles), parsed.serialize("tilecombine:"));
+
+    // Not the version we know.
+    header[TileCombined::BinaryPrefixSize] = 1;
+    CPPUNIT_ASSERT_THROW(TileCombined::parseBinary(header.data(), header.size(), offset, inShm, shmPos),
+                         BadArgumentException);
+
+    // Truncated.
+    header[TileCombined::BinaryPrefixSize] = 2;
+    CPPUNIT_ASSERT_THROW(TileCombined::parseBinary(header.data(), offset - 1, offset, inShm, shmPos),
+                         BadArgumentException);
+
+    // A preview, which goes to the client that asked for it by its id, or to all.
+    std::vector<TileDesc> preview;
+    preview.emplace_back(0, 2, 180, 135, 0, 0, 15875, 11906, 7, 4321, 42, true);
+    preview.back().setWireId(12);
+    const std::string previewHeader = TileCombined::create(preview).serializeBinary(preview);
+    const TileCombined parsedPreview =
+        TileCombined::parseBinary(previewHeader.data(), previewHeader.size(), offset, inShm, shmPos);
+    LOK_ASSERT(!inShm);
+    LOK_ASSERT_EQUAL(static_cast<std::size_t>(1), parsedPreview.getTiles().size());
+    LOK_ASSERT(preview[0] == parsedPreview.getTiles()[0]);
+    LOK_ASSERT_EQUAL(42, parsedPreview.getTiles()[0].getId());
+    LOK_ASSERT(parsedPreview.getTiles()[0].getBroadcast());
+    LOK_ASSERT_EQUAL(preview[0].serialize("tile:"), parsedPreview.getTiles()[0].serialize("tile:"));
+}
+
 void WhiteBoxTests::testStringVector()
 {
     // Test push_back() and getParam().
@@ -404,6 +404,7 @@ Admin::Admin() :
     const size_t totalMem = getTotalMemoryUsage();
     LOG_TRC("Total memory used: " << totalMem << " KB.");
     _model.addMemStats(totalMem);
+    updateTileCacheBudget(totalMem);
 }
 
 Admin::~Admin()
@@ -449,6 +450,7 @@ void Admin::pollingThread()
             {
                 // If our total memory consumption is above limit, cleanup
                 triggerMemoryCleanup(totalMem);
+                updateTileCacheBudget(totalMem);
 
                 _lastTotalMemory = totalMem;
             }
@@ -770,6 +772,20 @@ void Admin::triggerMemoryCleanup(const size_t totalMem)
     }
 }
 
+void Admin::updateTileCacheBudget(const size_t totalMem)
+{
+    // The tiles can take a quarter of what the rest leaves of the available
+    // memory, as limited by memproportion, so that they shrink first under
+    // memory pressure.
+    const size_t tileCacheKb = TileCache::getTotalMemorySize() / 1024;
+    const size_t otherKb = totalMem > tileCacheKb ? totalMem - tileCacheKb : 0;
+    const size_t freeKb = _totalAvailMemKb > otherKb ? _totalAvailMemKb - otherKb : 0;
+    const size_t budget = freeKb / 4 * 1024;
+
+    LOG_TRC("Tile cache budget: " << budget << " bytes, of which " << tileCacheKb << " KB used.");
+    TileCache::setTotalBudget(budget);
+}
+
 void Admin::notifyDocsMemDirtyChanged()
 {
     _model.notifyDocsMemDirtyChanged();
@@ -853,6 +869,9 @@ void Admin::getMetrics(std::ostringstream &metrics)
     metrics << "global_memory_free_bytes " << (memAvail - memUsed) * 1024 << std::endl;
     metrics << std::endl;
 
+    TileCache::getMetrics(metrics);
+    metrics << std::endl;
+
     _model.getMetrics(metrics);
 }
 
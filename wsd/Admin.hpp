@@ -149,6 +149,9 @@ private:
     /// Memory consumption has increased, start killing kits etc. till memory consumption gets back
     /// under @hardModeLimit
     void triggerMemoryCleanup(size_t hardModeLimit);
+
+    /// Share a part of the memory not used otherwise out to the tile caches.
+    void updateTileCacheBudget(size_t totalMem);
     void notifyDocsMemDirtyChanged();
     void cleanupResourceConsumingDocs();
 
@@ -9,6 +9,8 @@
 
 #include "ClientSession.hpp"
 
+#include <climits>
+#include <cstdlib>
 #include <fstream>
 #include <sstream>
 #include <memory>
@@ -342,6 +344,12 @@ bool ClientSession::_handleInput(const char *buffer, int length)
         updateLastActivityTime();
         docBroker->updateLastActivityTime();
     }
+
+    // Before the kit renders the edit, rather than once the document
+    // reports that it is modified.
+    if ((!isReadOnly() || isAllowChangeComments()) && LOOLProtocol::tokenIndicatesEditing(tokens[0]))
+        docBroker->closeTileStore();
+
     if (tokens.equals(0, "loolclient"))
     {
         if (tokens.size() < 2)
@@ -553,7 +561,23 @@ bool ClientSession::_handleInput(const char *buffer, int length)
 
             _clientVisibleArea = Util::Rectangle(x, y, width, height);
             resetWireIdMap();
-            return forwardToChild(std::string(buffer, length), docBroker);
+
+            const auto now = std::chrono::steady_clock::now();
+            while (!_visibleAreaHistory.empty()
+                   && (now - _visibleAreaHistory.front().first > std::chrono::seconds(1)
+                       || _visibleAreaHistory.front().second.getWidth() != width
+                       || _visibleAreaHistory.front().second.getHeight() != height))
+            {
+                _visibleAreaHistory.pop_front();
+            }
+            _visibleAreaHistory.emplace_back(now, _clientVisibleArea);
+
+            const bool result = forwardToChild(std::string(buffer, length), docBroker);
+#if !MOBILEAPP
+            // The mobile apps don't cache tiles.
+            docBroker->prefetchTiles(client_from_this());
+#endif
+            return result;
         }
     }
     else if (tokens.equals(0, "setclientpart"))
@@ -571,6 +595,7 @@ bool ClientSession::_handleInput(const char *buffer, int length)
             {
                 _clientSelectedPart = temp;
                 resetWireIdMap();
+                _visibleAreaHistory.clear();
                 return forwardToChild(std::string(buffer, length), docBroker);
             }
         }
@@ -632,6 +657,7 @@ bool ClientSession::_handleInput(const char *buffer, int length)
             _tileWidthTwips = tileTwipWidth;
             _tileHeightTwips = tileTwipHeight;
             resetWireIdMap();
+            _visibleAreaHistory.clear();
             return forwardToChild(std::string(buffer, length), docBroker);
         }
     }
@@ -647,11 +673,16 @@ bool ClientSession::_handleInput(const char *buffer, int length)
             return true;
         }
 
-        auto iter = std::find_if(_tilesOnFly.begin(), _tilesOnFly.end(),
-        [&tileID](const std::pair<std::string, std::chrono::steady_clock::time_point>& curTile)
+        TileKey tileKey;
+        auto iter = _tilesOnFly.end();
+        if (TileKey::parseId(tileID, tileKey))
         {
-            return curTile.first == tileID;
-        });
+            iter = std::find_if(_tilesOnFly.begin(), _tilesOnFly.end(),
+            [&tileKey](const std::pair<TileKey, std::chrono::steady_clock::time_point>& curTile)
+            {
+                return curTile.first == tileKey;
+            });
+        }
 
         if(iter != _tilesOnFly.end())
             _tilesOnFly.erase(iter);
@@ -917,6 +948,7 @@ bool ClientSession::sendCombinedTiles(const char* /*buffer*/, int /*length*/, co
     {
         TileCombined tileCombined = TileCombined::parse(tokens);
         tileCombined.setNormalizedViewId(getCanonicalViewId());
+        tileCombined.setAllowDelta(getTileDeltas());
         docBroker->handleTileCombinedRequest(tileCombined, client_from_this());
     }
     catch (const std::exception& exc)
@@ -1602,8 +1634,7 @@ void ClientSession::enqueueSendMessage(const std::shared_ptr<Message>& data)
     {
         // Avoid sending tile if it has the same wireID as the previously sent tile
         tile = Util::make_unique<TileDesc>(TileDesc::parse(data->firstLine()));
-        auto iter = _oldWireIds.find(tile->generateID());
-        if(iter != _oldWireIds.end() && tile->getWireId() != 0 && tile->getWireId() == iter->second)
+        if (hasSentTile(*tile))
         {
             LOG_INF("WSD filters out a tile with the same wireID: " <<  tile->serialize("tile:"));
             return;
@@ -1621,9 +1652,84 @@ void ClientSession::enqueueSendMessage(const std::shared_ptr<Message>& data)
     }
 }
 
+void ClientSession::sendTiles(const std::vector<TileDesc>& tiles,
+                              const std::vector<TileCache::Tile>& images,
+                              const std::string& suffix)
+{
+    assert(tiles.size() == images.size());
+
+    const std::shared_ptr<DocumentBroker> docBroker = _docBroker.lock();
+    LOG_CHECK_RET(docBroker && "Null DocumentBroker instance", );
+    docBroker->assertCorrectThread();
+
+    // The combined header has the fields of the first tile for all.
+    const auto shareHeader = [](const TileDesc& first, const TileDesc& tile)
+    {
+        return first.getId() < 0 && tile.getId() < 0
+               && tile.getNormalizedViewId() == first.getNormalizedViewId()
+               && tile.getPart() == first.getPart() && tile.getWidth() == first.getWidth()
+               && tile.getHeight() == first.getHeight()
+               && tile.getTileWidth() == first.getTileWidth()
+               && tile.getTileHeight() == first.getTileHeight()
+               && tile.getAllowDelta() == first.getAllowDelta()
+               && tile.getPrefetch() == first.getPrefetch();
+    };
+
+    std::vector<TileDesc> run;
+    std::vector<const TileCache::Tile*> runImages;
+    std::size_t runSize = 0;
+    const auto flush = [&]()
+    {
+        if (run.size() == 1)
+        {
+            sendTile(run[0].serialize("tile:", suffix), *runImages[0]);
+        }
+        else if (!run.empty())
+        {
+            TileCombined combined = TileCombined::create(run);
+            for (std::size_t i = 0; i < run.size(); ++i)
+                combined.getTiles()[i].setImgSize((*runImages[i])->size());
+
+            // Reserved at once, each image is copied only into the frame.
+            const std::string header = combined.serialize("tilecombine:", suffix);
+            auto payload = std::make_shared<Message>(header, Message::Dir::Out, header.size() + runSize);
+            for (const TileCache::Tile* image : runImages)
+                payload->append((*image)->data(), (*image)->size());
+
+            LOG_TRC(getName() << " enqueueing " << run.size() << " tiles in client message "
+                              << payload->id());
+            _senderQueue.enqueue(payload);
+            for (const TileDesc& tile : run)
+                traceTileBySend(tile);
+        }
+
+        run.clear();
+        runImages.clear();
+        runSize = 0;
+    };
+
+    for (std::size_t i = 0; i < tiles.size(); ++i)
+    {
+        if (hasSentTile(tiles[i]))
+        {
+            LOG_INF("WSD filters out a tile with the same wireID: " << tiles[i].serialize("tile:"));
+            continue;
+        }
+
+        if (!run.empty() && (!getTileCombine() || !shareHeader(run[0], tiles[i])))
+            flush();
+
+        run.push_back(tiles[i]);
+        runImages.push_back(&images[i]);
+        runSize += images[i]->size();
+    }
+
+    flush();
+}
+
 void ClientSession::addTileOnFly(const TileDesc& tile)
 {
-    _tilesOnFly.emplace_back(tile.generateID(), std::chrono::steady_clock::now());
+    _tilesOnFly.emplace_back(TileKey::forId(tile), std::chrono::steady_clock::now());
 }
 
 void ClientSession::clearTilesOnFly()
@@ -1642,9 +1748,10 @@ void ClientSession::removeOutdatedTilesOnFly()
             std::chrono::steady_clock::now() - tileIter->second);
         if (elapsedTimeMs > std::chrono::milliseconds(TILE_ROUNDTRIP_TIMEOUT_MS))
         {
-            LOG_WRN("Tracker tileID " << tileIter->first << " was dropped because of time out ("
-                                      << elapsedTimeMs
-                                      << "). Tileprocessed message did not arrive in time.");
+            LOG_WRN("Tracked tile at " << tileIter->first.getTilePosX() << ','
+                                        << tileIter->first.getTilePosY()
+                                        << " was dropped because of time out (" << elapsedTimeMs
+                                        << "). Tileprocessed message did not arrive in time.");
             _tilesOnFly.erase(tileIter);
         }
         else
@@ -1655,10 +1762,10 @@ void ClientSession::removeOutdatedTilesOnFly()
 std::size_t ClientSession::countIdenticalTilesOnFly(const TileDesc& tile) const
 {
     std::size_t count = 0;
-    const std::string tileID = tile.generateID();
+    const TileKey tileKey = TileKey::forId(tile);
     for (const auto& tileItem : _tilesOnFly)
     {
-        if (tileItem.first == tileID)
+        if (tileItem.first == tileKey)
             ++count;
     }
     return count;
@@ -1674,6 +1781,74 @@ Util::Rectangle ClientSession::getNormalizedVisibleArea() const
     return normalizedVisArea;
 }
 
+std::vector<TileDesc> ClientSession::getPrefetchTiles(const std::chrono::steady_clock::time_point& now) const
+{
+    // How far ahead to look when scrolling faster than a screenful in that time.
+    constexpr int LookaheadMs = 500;
+
+    std::vector<TileDesc> tiles;
+    if (_visibleAreaHistory.size() < 2 || !_clientVisibleArea.hasSurface() ||
+        _tileWidthPixel == 0 || _tileHeightPixel == 0 ||
+        _tileWidthTwips == 0 || _tileHeightTwips == 0 ||
+        (_clientSelectedPart == -1 && !_isTextDocument))
+    {
+        return tiles;
+    }
+
+    const auto& first = _visibleAreaHistory.front();
+    const auto& last = _visibleAreaHistory.back();
+    const long elapsedMs = std::chrono::duration_cast<std::chrono::milliseconds>(last.first - first.first).count();
+    if (elapsedMs <= 0 || now - last.first > std::chrono::seconds(1))
+        return tiles;
+
+    // Ignore the drift across the main direction.
+    const long dx = static_cast<long>(last.second.getLeft()) - first.second.getLeft();
+    const long dy = static_cast<long>(last.second.getTop()) - first.second.getTop();
+    const long moved = std::max(std::abs(dx), std::abs(dy));
+    const auto shift = [&](long delta, long extent) -> long
+    {
+        if (delta == 0 || std::abs(delta) * 4 < moved)
+            return 0;
+
+        const long ahead = std::max(extent, std::abs(delta) * LookaheadMs / elapsedMs);
+        return delta > 0 ? ahead : -ahead;
+    };
+    const long shiftX = shift(dx, _clientVisibleArea.getWidth());
+    const long shiftY = shift(dy, _clientVisibleArea.getHeight());
+    if (shiftX == 0 && shiftY == 0)
+        return tiles;
+
+    const long left = std::max(0L, _clientVisibleArea.getLeft() + shiftX);
+    const long top = std::max(0L, _clientVisibleArea.getTop() + shiftY);
+    const long right = _clientVisibleArea.getRight() + shiftX;
+    const long bottom = _clientVisibleArea.getBottom() + shiftY;
+    if (right <= left || bottom <= top || right > INT_MAX || bottom > INT_MAX)
+        return tiles;
+
+    const int part = _isTextDocument ? 0 : _clientSelectedPart;
+    const int normalizedViewId = getCanonicalViewId();
+
+    // Nearest to the visible area first, as there may be budget for only some.
+    const int firstRow = top / _tileHeightTwips;
+    const int lastRow = bottom / _tileHeightTwips;
+    const int firstColumn = left / _tileWidthTwips;
+    const int lastColumn = right / _tileWidthTwips;
+    for (int i = 0; i <= lastRow - firstRow; ++i)
+    {
+        const int row = shiftY < 0 ? lastRow - i : firstRow + i;
+        for (int j = 0; j <= lastColumn - firstColumn; ++j)
+        {
+            const int column = shiftX < 0 ? lastColumn - j : firstColumn + j;
+            tiles.emplace_back(normalizedViewId, part, _tileWidthPixel, _tileHeightPixel,
+                               column * _tileWidthTwips, row * _tileHeightTwips,
+                               _tileWidthTwips, _tileHeightTwips, -1, 0, -1, false);
+            tiles.back().setPrefetch(true);
+        }
+    }
+
+    return tiles;
+}
+
 void ClientSession::onDisconnect()
 {
     LOG_INF(getName() << " Disconnected, current number of connections: " << LOOLWSD::NumConnections);
@@ -1840,7 +2015,7 @@ void ClientSession::handleTileInvalidation(const std::string& message,
                         invalidTiles.emplace_back(normalizedViewId, part, _tileWidthPixel, _tileHeightPixel, j * _tileWidthTwips, i * _tileHeightTwips, _tileWidthTwips, _tileHeightTwips, -1, 0, -1, false);
 
                         TileWireId oldWireId = 0;
-                        auto iter = _oldWireIds.find(invalidTiles.back().generateID());
+                        auto iter = _oldWireIds.find(invalidTiles.back());
                         if(iter != _oldWireIds.end())
                             oldWireId = iter->second;
 
@@ -1856,6 +2031,7 @@ void ClientSession::handleTileInvalidation(const std::string& message,
     {
         TileCombined tileCombined = TileCombined::create(invalidTiles);
         tileCombined.setNormalizedViewId(normalizedViewId);
+        tileCombined.setAllowDelta(getTileDeltas());
         docBroker->handleTileCombinedRequest(tileCombined, client_from_this());
     }
 }
@@ -1939,12 +2115,28 @@ void ClientSession::resetWireIdMap()
     _oldWireIds.clear();
 }
 
-void ClientSession::traceTileBySend(const TileDesc& tile, bool deduplicated)
+bool ClientSession::canApplyDelta(const TileDesc& tile) const
 {
-    const std::string tileID = tile.generateID();
+    if (!getTileDeltas() || tile.getOldWireId() == 0)
+        return false;
 
+    const auto iter = _oldWireIds.find(tile);
+    return iter != _oldWireIds.end() && iter->second == tile.getOldWireId();
+}
+
+bool ClientSession::hasSentTile(const TileDesc& tile) const
+{
+    if (tile.getWireId() == 0)
+        return false;
+
+    const auto iter = _oldWireIds.find(tile);
+    return iter != _oldWireIds.end() && iter->second == tile.getWireId();
+}
+
+void ClientSession::traceTileBySend(const TileDesc& tile, bool deduplicated)
+{
     // Store wireId first
-    auto iter = _oldWireIds.find(tileID);
+    auto iter = _oldWireIds.find(tile);
     if(iter != _oldWireIds.end())
     {
         iter->second = tile.getWireId();
@@ -1954,7 +2146,7 @@ void ClientSession::traceTileBySend(const TileDesc& tile, bool deduplicated)
         // Track only tile inside the visible area
         if(_clientVisibleArea.hasSurface() && isTileInsideVisibleArea(tile))
         {
-            _oldWireIds.insert(std::pair<std::string, TileWireId>(tileID, tile.getWireId()));
+            _oldWireIds.emplace(tile, tile.getWireId());
         }
     }
 
@@ -13,6 +13,7 @@
 #include "SenderQueue.hpp"
 #include "ServerURL.hpp"
 #include "DocumentBroker.hpp"
+#include "TileMap.hpp"
 #include <Poco/URI.h>
 #include <Rectangle.hpp>
 #include <deque>
@@ -80,16 +81,20 @@ public:
 
     bool sendTile(const std::string &header, const TileCache::Tile &tile)
     {
-        // FIXME: performance - optimize away this copy ...
-        std::vector<char> output;
-
-        output.resize(header.size() + tile->size());
-        std::memcpy(output.data(), header.data(), header.size());
-        std::memcpy(output.data() + header.size(), tile->data(), tile->size());
-
-        return sendBinaryFrame(output.data(), output.size());
+        auto payload = std::make_shared<Message>(header, Message::Dir::Out,
+                                                 header.size() + tile->size());
+        payload->append(tile->data(), tile->size());
+        enqueueSendMessage(payload);
+        return true;
     }
 
+    /// Send the cached tiles, images[i] being that of tiles[i], as one
+    /// 'tilecombine:' frame per run of tiles sharing a header when the
+    /// client can split them, else as a 'tile:' each. The header ends with
+    /// the suffix. Tiles the client has already are skipped.
+    void sendTiles(const std::vector<TileDesc>& tiles, const std::vector<TileCache::Tile>& images,
+                   const std::string& suffix);
+
     bool sendTextFrame(const char* buffer, const int length) override
     {
         auto payload = std::make_shared<Message>(buffer, length, Message::Dir::Out);
@@ -138,6 +143,11 @@ public:
     /// Visible area can have negative value as position, but we have tiles only in the positive range
     Util::Rectangle getNormalizedVisibleArea() const;
 
+    /// The tiles of the screenful the client will likely show next, ahead
+    /// of the visible area in the direction and at the speed it has been
+    /// scrolling of late, nearest first. Empty if it hasn't been scrolling.
+    std::vector<TileDesc> getPrefetchTiles(const std::chrono::steady_clock::time_point& now) const;
+
     /// The client's visible area can be divided into a maximum of 4 panes.
     enum SplitPaneName {
         TOPLEFT_PANE,
@@ -162,6 +172,12 @@ public:
     /// Clear wireId map anytime when client visible area changes (visible area, zoom, part number)
     void resetWireIdMap();
 
+    /// True if the client has the base tile of this delta.
+    bool canApplyDelta(const TileDesc& tile) const;
+
+    /// True if we sent the client this tile with the same wireId last.
+    bool hasSentTile(const TileDesc& tile) const;
+
     bool isTextDocument() const { return _isTextDocument; }
 
     /// Do we recognize this clipboard ?
@@ -278,6 +294,10 @@ private:
     /// Visible area of the client
     Util::Rectangle _clientVisibleArea;
 
+    /// The visible areas of the last second, and when they were set, for as
+    /// long as the size stays the same, to tell where the client scrolls.
+    std::deque<std::pair<std::chrono::steady_clock::time_point, Util::Rectangle>> _visibleAreaHistory;
+
     /// Split position that defines the current split panes
     int _splitX;
     int _splitY;
@@ -304,13 +324,13 @@ private:
     std::string _clipboardKeys[2];
 
     /// TileID's of the sent tiles. Push by sending and pop by tileprocessed message from the client.
-    std::vector<std::pair<std::string, std::chrono::steady_clock::time_point>> _tilesOnFly;
+    std::vector<std::pair<TileKey, std::chrono::steady_clock::time_point>> _tilesOnFly;
 
     /// Requested tiles are stored in this list, before we can send them to the client
     std::deque<TileDesc> _requestedTiles;
 
     /// Store wireID's of the sent tiles inside the actual visible area
-    std::map<std::string, TileWireId> _oldWireIds;
+    TileMap<TileWireId, TileIdKeyTraits> _oldWireIds;
 
     /// Sockets to send binary selection content to
     std::vector<std::weak_ptr<StreamSocket>> _clipSockets;
@@ -316,9 +316,9 @@ void DocumentBroker::pollThread()
         const auto now = std::chrono::steady_clock::now();
 
 #if !MOBILEAPP
-        // a tile's data is ~8k, a 4k screen is ~128 256x256 tiles
+        // Our share of the memory for tiles, by how much ours are in demand.
         if (_tileCache)
-            _tileCache->setMaxCacheSize(8 * 1024 * 128 * _sessions.size());
+            _tileCache->updateBudget(now);
 
         if (!_isLoaded && (limit_load_secs > 0) && (now > loadDeadline))
         {
@@ -505,7 +505,10 @@ void DocumentBroker::pollThread()
 #endif
 
     if (_tileCache)
+    {
+        _tileCache->closeStore();
         _tileCache->clear();
+    }
 
     LOG_INF("Finished docBroker polling thread for docKey [" << _docKey << "].");
 }
@@ -908,6 +911,23 @@ bool DocumentBroker::load(const std::shared_ptr<ClientSession>& session, const s
 
         _tileCache = Util::make_unique<TileCache>(_storage->getUriString(), _lastFileModifiedTime, dontUseCache);
         _tileCache->setThreadOwner(std::this_thread::get_id());
+
+#if !MOBILEAPP
+        // Keep the tiles of this version of the document for the next time it is opened.
+        static const std::chrono::system_clock::time_point Zero;
+        static const bool tileCachePersistent = LOOLWSD::getConfigValue<bool>("tile_cache_persistent", true);
+        static const std::string tileCachePath = LOOLWSD::getConfigValue<std::string>("tile_cache_path", "");
+        if (tileCachePersistent && !tileCachePath.empty() && !dontUseCache && templateSource.empty() &&
+            fileInfo.getModifiedTime() != Zero)
+        {
+            const std::size_t tileCacheSize
+                = LOOLWSD::getConfigValue<uint64_t>("tile_cache_size_mb", 1024) * 1024 * 1024;
+            const std::string version = std::to_string(std::chrono::duration_cast<std::chrono::microseconds>(
+                                            fileInfo.getModifiedTime().time_since_epoch()).count()) +
+                                        ' ' + LOOLWSD_VERSION_HASH + ' ' + LOOLWSD::LOKitVersion;
+            _tileCache->setStore(TileStore::open(tileCachePath, _docKey, version, tileCacheSize));
+        }
+#endif
     }
 
 #if !MOBILEAPP
@@ -1781,6 +1801,10 @@ bool DocumentBroker::handleInput(const std::vector<char>& payload)
         {
             handleTileCombinedResponse(payload);
         }
+        else if (command == "tilebin:")
+        {
+            handleTileBinaryResponse(payload);
+        }
         else if (command == "errortoall:")
         {
             LOG_CHECK_RET(message->tokens().size() == 3, false);
@@ -1828,6 +1852,7 @@ void DocumentBroker::handleTileRequest(const StringVector &tokens,
 
     TileDesc tile = TileDesc::parse(tokens);
     tile.setNormalizedViewId(session->getCanonicalViewId());
+    tile.setAllowDelta(session->getTileDeltas());
 
     tile.setVersion(++_tileVersion);
     const std::string tileMsg = tile.serialize();
@@ -1886,6 +1911,7 @@ void DocumentBroker::handleTileCombinedRequest(TileCombined& tileCombined,
 
     // Check which newly requested tiles need rendering.
     std::vector<TileDesc> tilesNeedsRendering;
+    std::vector<TileDesc> deltasNeedsRendering;
     for (auto& tile : tileCombined.getTiles())
     {
         tile.setVersion(++_tileVersion);
@@ -1893,17 +1919,30 @@ void DocumentBroker::handleTileCombinedRequest(TileCombined& tileCombined,
         TileCache::Tile cachedTile = _tileCache->lookupTile(tile);
         if(!cachedTile)
         {
-            // Not cached, needs rendering.
-            tilesNeedsRendering.push_back(tile);
+            // Not cached, needs rendering. A delta is of use only to those
+            // waiting for the tile already: the others subscribe once the
+            // tiles on fly allow, if at all, and would need the full tile.
+            if (tile.getAllowDelta() && tileCache().hasSubscribers(tile))
+            {
+                deltasNeedsRendering.push_back(tile);
+            }
+            else
+            {
+                tilesNeedsRendering.push_back(tile);
+                tilesNeedsRendering.back().setAllowDelta(false);
+            }
             _debugRenderedTileCount++;
             tileCache().registerTileBeingRendered(tile);
         }
     }
 
     // Send rendering request, prerender before we actually send the tiles
-    if (!tilesNeedsRendering.empty())
+    for (const std::vector<TileDesc>* tiles : { &deltasNeedsRendering, &tilesNeedsRendering })
     {
-        TileCombined newTileCombined = TileCombined::create(tilesNeedsRendering);
+        if (tiles->empty())
+            continue;
+
+        TileCombined newTileCombined = TileCombined::create(*tiles);
 
         // Forward to child to render.
         const std::string req = newTileCombined.serialize("tilecombine");
@@ -2048,8 +2087,10 @@ void DocumentBroker::sendRequestedTiles(const std::shared_ptr<ClientSession>& se
     {
         std::size_t delayedTiles = 0;
         std::vector<TileDesc> tilesNeedsRendering;
+        std::vector<TileDesc> cachedTiles;
+        std::vector<TileCache::Tile> cachedImages;
         std::size_t beingRendered = _tileCache->countTilesBeingRenderedForSession(session, now);
-        while (session->getTilesOnFlyCount() + beingRendered < tilesOnFlyUpperLimit &&
+        while (session->getTilesOnFlyCount() + beingRendered + cachedTiles.size() < tilesOnFlyUpperLimit &&
               !requestedTiles.empty() &&
               // If we delayed all tiles we don't send any tile (we will when next tileprocessed message arrives)
               delayedTiles < requestedTiles.size())
@@ -2071,15 +2112,16 @@ void DocumentBroker::sendRequestedTiles(const std::shared_ptr<ClientSession>& se
             TileCache::Tile cachedTile = _tileCache->lookupTile(tile);
             if (cachedTile)
             {
-                //TODO: Combine the response to reduce latency.
-                const std::string response = tile.serialize("tile:", ADD_DEBUG_RENDERID);
-                session->sendTile(response, cachedTile);
+                // Sent together below, so that a screenful is one message.
+                cachedTiles.push_back(tile);
+                cachedImages.push_back(std::move(cachedTile));
             }
             else
             {
                 // Not cached, needs rendering.
                 if (!tileCache().hasTileBeingRendered(tile, &now) || // There is no in progress rendering of the given tile
-                    tileCache().getTileBeingRenderedVersion(tile) < tile.getVersion()) // We need a newer version
+                    tileCache().getTileBeingRenderedVersion(tile) < tile.getVersion() || // We need a newer version
+                    tileCache().isTileBeingPrefetched(tile)) // Not to wait behind everything else
                 {
                     tile.setVersion(++_tileVersion);
                     tilesNeedsRendering.push_back(tile);
@@ -2091,6 +2133,9 @@ void DocumentBroker::sendRequestedTiles(const std::shared_ptr<ClientSession>& se
             requestedTiles.pop_front();
         }
 
+        if (!cachedTiles.empty())
+            session->sendTiles(cachedTiles, cachedImages, ADD_DEBUG_RENDERID);
+
         // Send rendering request for those tiles which were not prerendered
         if (!tilesNeedsRendering.empty())
         {
@@ -2104,6 +2149,42 @@ void DocumentBroker::sendRequestedTiles(const std::shared_ptr<ClientSession>& se
     }
 }
 
+void DocumentBroker::prefetchTiles(const std::shared_ptr<ClientSession>& session)
+{
+    // The most tiles of the document rendered ahead that no client waits for yet.
+    static const std::size_t PrefetchBudget
+        = std::max(0, LOOLWSD::getConfigValue<int>("per_document.prefetch_tiles", 60));
+
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    if (PrefetchBudget == 0 || !hasTileCache())
+        return;
+
+    const auto now = std::chrono::steady_clock::now();
+    std::size_t prefetching = _tileCache->countTilesBeingPrefetched(now);
+    std::vector<TileDesc> tilesNeedsRendering;
+    for (TileDesc& tile : session->getPrefetchTiles(now))
+    {
+        if (prefetching >= PrefetchBudget)
+            break;
+
+        if (_tileCache->hasTile(tile) || _tileCache->hasTileBeingRendered(tile, &now))
+            continue;
+
+        tile.setVersion(++_tileVersion);
+        _tileCache->registerTileBeingRendered(tile);
+        tilesNeedsRendering.push_back(tile);
+        ++prefetching;
+    }
+
+    if (!tilesNeedsRendering.empty())
+    {
+        const std::string req = TileCombined::create(tilesNeedsRendering).serialize("tilecombine");
+        LOG_TRC("Prefetching tiles ahead of " << session->getName() << ": " << req);
+        _childProcess->sendTextFrame(req);
+    }
+}
+
 void DocumentBroker::cancelTileRequests(const std::shared_ptr<ClientSession>& session)
 {
     std::unique_lock<std::mutex> lock(_mutex);
@@ -2126,6 +2207,23 @@ void DocumentBroker::cancelTileRequests(const std::shared_ptr<ClientSession>& se
     }
 }
 
+/// Finds the position of the tiles in the shared memory, if the text
+/// header of a tile response has them there.
+static bool getTileShmPos(const std::string& firstLine, uint64_t& pos)
+{
+    if (firstLine.find(" shm=") == std::string::npos)
+        return false;
+
+    const StringVector tokens = LOOLProtocol::tokenize(firstLine);
+    for (std::size_t i = 0; i < tokens.size(); ++i)
+    {
+        if (LOOLProtocol::getTokenUInt64(tokens[i], "shm", pos))
+            return true;
+    }
+
+    return false;
+}
+
 void DocumentBroker::handleTileResponse(const std::vector<char>& payload)
 {
     const std::string firstLine = getFirstLine(payload);
@@ -2134,6 +2232,7 @@ void DocumentBroker::handleTileResponse(const std::vector<char>& payload)
     try
     {
         const std::size_t length = payload.size();
+        uint64_t shmPos = 0;
         if (firstLine.size() < static_cast<std::string::size_type>(length) - 1)
         {
             const TileDesc tile = TileDesc::parse(firstLine);
@@ -2142,7 +2241,13 @@ void DocumentBroker::handleTileResponse(const std::vector<char>& payload)
 
             std::unique_lock<std::mutex> lock(_mutex);
 
-            tileCache().saveTileAndNotify(tile, buffer + offset, length - offset);
+            if (!tileCache().saveTileAndNotify(tile, buffer + offset, length - offset))
+                requestFullTiles(std::vector<TileDesc>(1, tile),
+                                 "Delta not applicable for all subscribers");
+        }
+        else if (getTileShmPos(firstLine, shmPos))
+        {
+            saveTiles(std::vector<TileDesc>(1, TileDesc::parse(firstLine)), nullptr, 0, true, shmPos);
         }
         else
         {
@@ -2167,16 +2272,12 @@ void DocumentBroker::handleTileCombinedResponse(const std::vector<char>& payload
         if (firstLine.size() <= static_cast<std::string::size_type>(length) - 1)
         {
             const TileCombined tileCombined = TileCombined::parse(firstLine);
-            const char* buffer = payload.data();
-            std::size_t offset = firstLine.size() + 1;
-
-            std::unique_lock<std::mutex> lock(_mutex);
+            const std::size_t offset = firstLine.size() + 1;
 
-            for (const auto& tile : tileCombined.getTiles())
-            {
-                tileCache().saveTileAndNotify(tile, buffer + offset, tile.getImgSize());
-                offset += tile.getImgSize();
-            }
+            // The tiles are either inline, or in the shared memory.
+            uint64_t shmPos = 0;
+            const bool inShm = (offset == length && getTileShmPos(firstLine, shmPos));
+            saveTiles(tileCombined.getTiles(), payload.data() + offset, length - offset, inShm, shmPos);
         }
         else
         {
@@ -2190,6 +2291,106 @@ void DocumentBroker::handleTileCombinedResponse(const std::vector<char>& payload
     }
 }
 
+void DocumentBroker::handleTileBinaryResponse(const std::vector<char>& payload)
+{
+    try
+    {
+        std::size_t offset = 0;
+        bool inShm = false;
+        uint64_t shmPos = 0;
+        const TileCombined tileCombined = TileCombined::parseBinary(payload.data(), payload.size(),
+                                                                    offset, inShm, shmPos);
+        LOG_DBG("Handling tile binary: " << tileCombined.serialize("tilecombine:"));
+
+        saveTiles(tileCombined.getTiles(), payload.data() + offset, payload.size() - offset, inShm, shmPos);
+    }
+    catch (const std::exception& exc)
+    {
+        LOG_ERR("Failed to process binary tile response of " << payload.size() << " bytes: " << exc.what() << '.');
+    }
+}
+
+void DocumentBroker::saveTiles(const std::vector<TileDesc>& tiles, const char* data, std::size_t size,
+                               bool inShm, uint64_t shmPos)
+{
+    std::shared_ptr<TileShm::Block> block;
+    if (inShm)
+    {
+        std::size_t total = 0;
+        for (const auto& tile : tiles)
+            total += tile.getImgSize();
+
+        block = receiveTileShm(shmPos, total);
+        if (!block)
+        {
+            // Rendering them again would only fail the same way.
+            // They will get re-issued if we don't forget them.
+            LOG_ERR("Dropping " << tiles.size() << " tiles not received through shared memory.");
+            return;
+        }
+
+        data = block->data();
+        size = block->size();
+    }
+
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    std::vector<TileDesc> tilesNeedsRendering;
+    std::size_t offset = 0;
+    for (const auto& tile : tiles)
+    {
+        const std::size_t imgSize = tile.getImgSize();
+        if (offset + imgSize > size)
+        {
+            // Not a tile to render again, but a broken response.
+            LOG_ERR("Dropping tile " << tile.debugName() << " of " << imgSize
+                                     << " bytes, past the " << size << " bytes of the response.");
+            continue;
+        }
+
+        if (!tileCache().saveTileAndNotify(tile, data + offset, imgSize))
+            tilesNeedsRendering.push_back(tile);
+        offset += imgSize;
+    }
+
+    if (!tilesNeedsRendering.empty())
+        requestFullTiles(tilesNeedsRendering, "Delta not applicable for all subscribers");
+}
+
+std::shared_ptr<TileShm::Block> DocumentBroker::receiveTileShm(uint64_t pos, std::size_t size)
+{
+    const std::shared_ptr<TileShm> tileShm = _childProcess ? _childProcess->getTileShm() : nullptr;
+    if (!tileShm)
+    {
+        LOG_ERR("Tiles sent through shared memory without any, at " << pos << '.');
+        return nullptr;
+    }
+
+    std::shared_ptr<TileShm::Block> block = tileShm->receive(pos, size);
+    if (!block)
+        LOG_ERR("Invalid shared memory range of " << size << " bytes at " << pos << '.');
+    return block;
+}
+
+void DocumentBroker::requestFullTiles(const std::vector<TileDesc>& tiles, const char* reason)
+{
+    std::vector<TileDesc> fullTiles;
+    for (TileDesc tile : tiles)
+    {
+        // Not against any base, so we get a PNG that everyone can use.
+        tile.setOldWireId(0);
+        tile.setWireId(0);
+        tile.setImgSize(0);
+        tile.setVersion(++_tileVersion);
+        fullTiles.push_back(tile);
+    }
+
+    const std::string req = TileCombined::create(fullTiles).serialize("tilecombine");
+    LOG_TRC(reason << ", sending full tilecombine request: " << req);
+    _childProcess->sendTextFrame(req);
+    _debugRenderedTileCount += fullTiles.size();
+}
+
 bool DocumentBroker::haveAnotherEditableSession(const std::string& id) const
 {
     assertCorrectThread();
@@ -2210,8 +2411,18 @@ bool DocumentBroker::haveAnotherEditableSession(const std::string& id) const
     return false;
 }
 
+void DocumentBroker::closeTileStore()
+{
+    if (_tileCache)
+        _tileCache->closeStore();
+}
+
 void DocumentBroker::setModified(const bool value)
 {
+    // The stored tiles are of the document as loaded.
+    if (value)
+        closeTileStore();
+
     if (_isModified != value)
     {
         _isModified = value;
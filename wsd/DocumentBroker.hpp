@@ -23,6 +23,7 @@
 
 #include "Log.hpp"
 #include "TileDesc.hpp"
+#include "TileShm.hpp"
 #include "Util.hpp"
 #include "net/Socket.hpp"
 #include "net/WebSocketHandler.hpp"
@@ -86,11 +87,15 @@ public:
     const std::string& getJailId() const { return _jailId; }
     void setSMapsFD(int smapsFD) { _smapsFD = smapsFD;}
     int getSMapsFD(){ return _smapsFD; }
+    void setTileShm(const std::shared_ptr<TileShm>& tileShm) { _tileShm = tileShm; }
+    const std::shared_ptr<TileShm>& getTileShm() const { return _tileShm; }
 
 private:
     const std::string _jailId;
     std::weak_ptr<DocumentBroker> _docBroker;
     int _smapsFD;
+    /// The segment the kit sends its tiles through, if any.
+    std::shared_ptr<TileShm> _tileShm;
 };
 
 class RequestDetails;
@@ -187,6 +192,10 @@ public:
     bool isModified() const { return _isModified; }
     void setModified(const bool value);
 
+    /// Stop keeping the tiles rendered for the next sessions, as from the
+    /// first editing input they may no longer be of the document as loaded.
+    void closeTileStore();
+
     /// Save the document if the document is modified.
     /// @param force when true, will force saving if there
     /// has been any recent activity after the last save.
@@ -254,6 +263,9 @@ public:
     void handleTileCombinedRequest(TileCombined& tileCombined,
                                    const std::shared_ptr<ClientSession>& session);
     void sendRequestedTiles(const std::shared_ptr<ClientSession>& session);
+    /// Render the tiles the session will likely show next, at the lowest
+    /// priority, within the budget of the document.
+    void prefetchTiles(const std::shared_ptr<ClientSession>& session);
     void cancelTileRequests(const std::shared_ptr<ClientSession>& session);
 
     enum ClipboardRequest {
@@ -338,6 +350,15 @@ private:
     void handleTileResponse(const std::vector<char>& payload);
     void handleDialogPaintResponse(const std::vector<char>& payload, bool child);
     void handleTileCombinedResponse(const std::vector<char>& payload);
+    void handleTileBinaryResponse(const std::vector<char>& payload);
+    /// Cache and send the tiles of a response, whose images are either
+    /// in data or, with inShm, at shmPos of the shared memory of the kit.
+    void saveTiles(const std::vector<TileDesc>& tiles, const char* data, std::size_t size,
+                   bool inShm, uint64_t shmPos);
+    /// Take the size bytes of tiles the kit sent through shared memory at pos.
+    std::shared_ptr<TileShm::Block> receiveTileShm(uint64_t pos, std::size_t size);
+    /// Request the given tiles as full images, logging why.
+    void requestFullTiles(const std::vector<TileDesc>& tiles, const char* reason);
     void handleDialogRequest(const std::string& dialogCmd);
 
     /// Shutdown all client connections with the given reason.
@@ -952,6 +952,17 @@ void LOOLWSD::initialize(Application& self)
             { "per_document.limit_stack_mem_kb", "8000" },
             { "per_document.limit_virt_mem_mb", "0" },
             { "per_document.max_concurrency", "4" },
+            { "per_document.png_compression_level", "4" },
+            { "per_document.png_encoder", "libpng" },
+            { "per_document.png_cache_size_kb", "4096" },
+            { "per_document.invalidation_max_rects", "8" },
+            { "per_document.prefetch_tiles", "60" },
+            { "per_document.tile_shm_size_kb", "16384" },
+            { "per_document.latency_ms.input_tiles", "10" },
+            { "per_document.latency_ms.visible_tiles", "50" },
+            { "per_document.latency_ms.callbacks", "20" },
+            { "per_document.latency_ms.previews", "500" },
+            { "per_document.latency_ms.background", "2000" },
             { "per_document.batch_priority", "5" },
             { "per_document.redlining_as_comments", "false" },
             { "per_view.idle_timeout_secs", "900" },
@@ -976,6 +987,9 @@ void LOOLWSD::initialize(Application& self)
             { "storage.wopi[@allow]", "true" },
             { "storage.wopi.locking.refresh", "900" },
             { "sys_template_path", "systemplate" },
+            { "tile_cache_path", "" },
+            { "tile_cache_persistent", "true" },
+            { "tile_cache_size_mb", "1024" },
             { "trace.path[@compress]", "true" },
             { "trace.path[@snapshot]", "false" },
             { "trace[@enable]", "false" },
@@ -1252,12 +1266,42 @@ void LOOLWSD::initialize(Application& self)
 
     FileUtil::registerFileSystemForDiskSpaceChecks(ChildRoot);
 
+    // 0 lets the kits use all the CPUs available to them.
     const auto maxConcurrency = getConfigValue<int>(conf, "per_document.max_concurrency", 4);
-    if (maxConcurrency > 0)
+    if (maxConcurrency >= 0)
     {
         setenv("MAX_CONCURRENCY", std::to_string(maxConcurrency).c_str(), 1);
     }
     LOG_INF("MAX_CONCURRENCY set to " << maxConcurrency << '.');
+
+    // Tile encoding, read by the kits.
+    const auto pngEncoder = getConfigValue<std::string>(conf, "per_document.png_encoder", "libpng");
+    const auto pngCompressionLevel = getConfigValue<int>(conf, "per_document.png_compression_level", 4);
+    setenv("LOOL_PNG_ENCODER", pngEncoder.c_str(), 1);
+    setenv("LOOL_PNG_COMPRESSION_LEVEL", std::to_string(pngCompressionLevel).c_str(), 1);
+    LOG_INF("PNG encoder set to " << pngEncoder << " at compression level " << pngCompressionLevel << '.');
+    const auto pngCacheSizeKb = getConfigValue<int>(conf, "per_document.png_cache_size_kb", 4096);
+    setenv("LOOL_PNG_CACHE_SIZE_KB", std::to_string(pngCacheSizeKb).c_str(), 1);
+
+    // Invalidations queued in the kits, read by the TileQueue.
+    const auto invalidationMaxRects = getConfigValue<int>(conf, "per_document.invalidation_max_rects", 8);
+    setenv("LOOL_INVALIDATION_MAX_RECTS", std::to_string(invalidationMaxRects).c_str(), 1);
+
+    // The tiles are handed over from the kits through shared memory.
+    const auto tileShmSizeKb = getConfigValue<int>(conf, "per_document.tile_shm_size_kb", 16384);
+    setenv("LOOL_TILE_SHM_SIZE_KB", std::to_string(tileShmSizeKb).c_str(), 1);
+
+    // The latency targets of the classes of work of the TileQueue, in its order.
+    std::string latencyTargets;
+    for (const auto& workClass : { std::make_pair("input_tiles", 10), std::make_pair("visible_tiles", 50),
+                                   std::make_pair("callbacks", 20), std::make_pair("previews", 500),
+                                   std::make_pair("background", 2000) })
+    {
+        const std::string key = std::string("per_document.latency_ms.") + workClass.first;
+        latencyTargets += std::to_string(getConfigValue<int>(conf, key, workClass.second)) + ',';
+    }
+    latencyTargets.pop_back();
+    setenv("LOOL_QUEUE_LATENCY_MS", latencyTargets.c_str(), 1);
 #endif
 
     const auto redlining = getConfigValue<bool>(conf, "per_document.redlining_as_comments", false);
@@ -2125,6 +2169,7 @@ private:
 
         try
         {
+            bool hasTileShm = false;
 #if !MOBILEAPP
             if (!socket->parseHeader("Prisoner", message, request))
                 return;
@@ -2162,6 +2207,9 @@ private:
 
                 else if (param.first == "version")
                     LOOLWSD::LOKitVersion = param.second;
+
+                else if (param.first == "tileshm")
+                    hasTileShm = (param.second == "1");
             }
 
             if (pid <= 0)
@@ -2190,7 +2238,26 @@ private:
 
             auto child = std::make_shared<ChildProcess>(pid, jailId, socket, request);
 
-            child->setSMapsFD(socket->getIncomingFD());
+            // The segment for the tiles, if any, comes after the smaps file.
+            std::vector<int> fds = socket->getIncomingFDs();
+            if (hasTileShm)
+            {
+                if (!fds.empty())
+                {
+                    child->setTileShm(TileShm::attach(fds.back()));
+                    fds.pop_back();
+                }
+
+                if (!child->getTileShm())
+                {
+                    // Otherwise it fills the segment with tiles we never take.
+                    LOG_WRN("Failed to map the shared memory for tiles of child ["
+                            << pid << "]. Telling it to send them inline.");
+                    child->sendTextFrame("tileshm off");
+                }
+            }
+            if (!fds.empty())
+                child->setSMapsFD(fds.front());
             _childProcess = child; // weak
 
             // Remove from prisoner poll since there is no activity
@@ -2216,6 +2283,16 @@ private:
     /// Prisoner websocket fun ... (for now)
     virtual void handleMessage(const std::vector<char> &data) override
     {
+        // The kit sends the messages of consecutive callbacks in one frame.
+        std::vector<std::vector<char>> messages;
+        if (LOOLProtocol::splitBatch(data.data(), data.size(), messages))
+        {
+            for (const std::vector<char>& message : messages)
+                handleMessage(message);
+
+            return;
+        }
+
         if (UnitWSD::get().filterChildMessage(data))
             return;
 
@@ -7,6 +7,7 @@
 
 #pragma once
 
+#include <algorithm>
 #include <condition_variable>
 #include <deque>
 #include <memory>
@@ -80,6 +81,14 @@ public:
     }
 
 private:
+    /// True if the payload of this tile message is a delta rather than a PNG.
+    static bool isDeltaTile(const Item& item)
+    {
+        const std::vector<char>& data = item->data();
+        const auto pos = std::find(data.begin(), data.end(), '\n');
+        return pos != data.end() && pos + 1 != data.end() && *(pos + 1) == 'D';
+    }
+
     /// Deduplicate messages based on the new one.
     /// Returns true if the new message should be
     /// enqueued, otherwise false.
@@ -89,17 +98,19 @@ private:
         const std::string command = item->firstToken();
         if (command == "tile:")
         {
-            // Remove previous identical tile, if any, and use most recent (incoming).
+            // A delta must be applied on top of the queued tiles it follows.
+            if (isDeltaTile(item))
+                return true;
+
+            // Remove previous identical tiles (and their deltas), if any,
+            // and use most recent (incoming).
             const TileDesc newTile = TileDesc::parse(item->firstLine());
-            const auto& pos = std::find_if(_queue.begin(), _queue.end(),
+            _queue.erase(std::remove_if(_queue.begin(), _queue.end(),
                 [&newTile](const queue_item_t& cur)
                 {
                     return cur->firstToken() == "tile:" &&
                            newTile == TileDesc::parse(cur->firstLine());
-                });
-
-            if (pos != _queue.end())
-                _queue.erase(pos);
+                }), _queue.end());
         }
         else if (command == "statusindicatorsetvalue:" ||
                  command == "invalidatecursor:" ||
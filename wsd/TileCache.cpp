@@ -9,13 +9,17 @@
 
 #include "TileCache.hpp"
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <climits>
+#include <cmath>
 #include <cstddef>
 #include <cstdio>
 #include <fstream>
 #include <iostream>
 #include <memory>
+#include <mutex>
 #include <sstream>
 #include <string>
 #include <utility>
@@ -30,13 +34,60 @@
 
 using namespace LOOLProtocol;
 
+namespace
+{
+/// The memory budget shared by the tile caches of all the documents.
+struct TileCacheBudget
+{
+    std::mutex _mutex;
+    size_t _total = 256 * 1024 * 1024; //< Until the memory use is known.
+    double _weights = 0;
+    size_t _used = 0;
+    size_t _caches = 0;
+
+    std::atomic<uint64_t> _hits{ 0 };
+    std::atomic<uint64_t> _misses{ 0 };
+    std::atomic<uint64_t> _evicted{ 0 };
+
+    /// The tiles rendered ahead of being requested, those a client got,
+    /// and those dropped before any did.
+    std::atomic<uint64_t> _prefetched{ 0 };
+    std::atomic<uint64_t> _prefetchHits{ 0 };
+    std::atomic<uint64_t> _prefetchWasted{ 0 };
+};
+
+/// Never destroyed, as the caches may outlive static destruction.
+TileCacheBudget& getBudget()
+{
+    static TileCacheBudget* budget = new TileCacheBudget();
+    return *budget;
+}
+
+/// The least memory of a cache, enough for a screen or two.
+constexpr size_t MinCacheSize = 512 * 1024;
+
+/// How soon the tiles requested weigh half as much in the shares.
+constexpr double ActivityHalfLifeSecs = 30;
+}
+
 TileCache::TileCache(std::string docURL, const std::chrono::system_clock::time_point& modifiedTime,
                      bool dontCache)
     : _docURL(std::move(docURL))
     , _dontCache(dontCache)
     , _cacheSize(0)
-    , _maxCacheSize(512 * 1024)
+    , _maxCacheSize(MinCacheSize)
+    , _requests(0)
+    , _activity(0)
+    , _lastBudgetUpdate(std::chrono::steady_clock::now())
+    , _budgetWeight(0)
+    , _budgetSize(0)
 {
+    {
+        TileCacheBudget& budget = getBudget();
+        std::lock_guard<std::mutex> lock(budget._mutex);
+        ++budget._caches;
+    }
+
 #ifndef BUILDING_TESTS
     LOG_INF("TileCache ctor for uri [" << LOOLWSD::anonymizeUrl(_docURL) <<
             "], modifiedTime=" << std::chrono::duration_cast<std::chrono::seconds>
@@ -48,6 +99,14 @@ TileCache::TileCache(std::string docURL, const std::chrono::system_clock::time_p
 TileCache::~TileCache()
 {
     _owner = std::thread::id();
+
+    {
+        TileCacheBudget& budget = getBudget();
+        std::lock_guard<std::mutex> lock(budget._mutex);
+        --budget._caches;
+        budget._weights -= _budgetWeight;
+        budget._used -= _budgetSize;
+    }
 #ifndef BUILDING_TESTS
     LOG_INF("~TileCache dtor for uri [" << LOOLWSD::anonymizeUrl(_docURL) << "].");
 #endif
@@ -55,7 +114,16 @@ TileCache::~TileCache()
 
 void TileCache::clear()
 {
+    for (const auto& it : _cache)
+    {
+        if (it.second._prefetched)
+            ++getBudget()._prefetchWasted;
+    }
+
     _cache.clear();
+    _cacheIndex.clear();
+    _recency.clear();
+    _sharedTiles.clear();
     _cacheSize = 0;
     for (auto i : _streamCache)
         i.clear();
@@ -151,12 +219,58 @@ int TileCache::getTileBeingRenderedVersion(const TileDesc& tile)
     return tileBeingRendered ? tileBeingRendered->getVersion() : 0;
 }
 
+size_t TileCache::countTilesBeingPrefetched(const std::chrono::steady_clock::time_point& now) const
+{
+    size_t count = 0;
+    for (const auto& it : _tilesBeingRendered)
+    {
+        if (it.second->getTile().getPrefetch() && it.second->getSubscribers().empty()
+            && !it.second->isStale(&now))
+            ++count;
+    }
+
+    return count;
+}
+
+bool TileCache::isTileBeingPrefetched(const TileDesc& tileDesc) const
+{
+    const auto it = _tilesBeingRendered.find(tileDesc);
+    return it != _tilesBeingRendered.end() && it->second->getTile().getPrefetch()
+           && it->second->getSubscribers().empty();
+}
+
+bool TileCache::hasSubscribers(const TileDesc& tileDesc) const
+{
+    const auto it = _tilesBeingRendered.find(tileDesc);
+    return it != _tilesBeingRendered.end() && !it->second->getSubscribers().empty();
+}
+
 TileCache::Tile TileCache::lookupTile(const TileDesc& tile)
 {
     if (_dontCache)
         return TileCache::Tile();
 
+    ++_requests;
     TileCache::Tile ret = findTile(tile);
+    if (!ret && _store)
+    {
+        ret = _store->find(tile);
+        if (ret)
+        {
+            LOG_TRC("Found stored tile: " << tile.serialize() << " of size " << ret->size() << " bytes");
+
+            // Cheap to read again while the store is open, so the first to go
+            // unless it is looked up again.
+            TileDesc stored(tile);
+            stored.setWireId(0);
+            saveDataToCache(stored, ret->data(), ret->size());
+            const auto it = _cache.find(stored);
+            if (it != _cache.end())
+                _recency.splice(_recency.end(), _recency, it->second._position);
+        }
+    }
+
+    ++(ret ? getBudget()._hits : getBudget()._misses);
 
     UnitWSD::get().lookupTile(tile.getPart(), tile.getWidth(), tile.getHeight(),
                               tile.getTilePosX(), tile.getTilePosY(),
@@ -165,24 +279,62 @@ TileCache::Tile TileCache::lookupTile(const TileDesc& tile)
     return ret;
 }
 
-void TileCache::saveTileAndNotify(const TileDesc& tile, const char *data, const size_t size)
+bool TileCache::hasTile(const TileDesc& tile) const
+{
+    const auto it = _cache.find(tile);
+    if (it != _cache.end() && it->first.getNormalizedViewId() == tile.getNormalizedViewId())
+        return true;
+
+    return _store && _store->contains(tile);
+}
+
+bool TileCache::saveTileAndNotify(const TileDesc& tile, const char *data, const size_t size)
 {
     assertCorrectThread();
 
+    if (size > 0 && data[0] == 'D')
+    {
+        // A delta is of no use without its base, so don't cache it,
+        // but drop what we have as that is outdated now.
+        auto it = _cache.find(tile);
+        if (it != _cache.end())
+            eraseTile(it);
+
+        if (_store)
+            _store->erase(tile);
+
+        return notifyDelta(tile, data, size);
+    }
+
+    std::shared_ptr<TileBeingRendered> tileBeingRendered = findTileBeingRendered(tile);
     if (size > 0)
     {
+        // A prefetched tile is of use once a client gets it, which those
+        // that asked while it was rendered do right away.
+        bool prefetched = false;
+        if (tile.getPrefetch())
+        {
+            ++getBudget()._prefetched;
+            if (tileBeingRendered && !tileBeingRendered->getSubscribers().empty())
+                ++getBudget()._prefetchHits;
+            else
+                prefetched = true;
+        }
+
         // Save to in-memory cache.
 
         // Ignore if we can't save the tile, things will work anyway, but slower.
         // An error indication is supposed to be sent to all users in that case.
-        saveDataToCache(tile, data, size);
+        saveDataToCache(tile, data, size, prefetched);
         LOG_TRC("Saved cache tile: " << cacheFileName(tile) << " of size " << size << " bytes");
+
+        if (_store)
+            _store->save(tile, data, size);
     }
     else
         LOG_TRC("Zero sized cache tile: " << cacheFileName(tile));
 
     // Notify subscribers, if any.
-    std::shared_ptr<TileBeingRendered> tileBeingRendered = findTileBeingRendered(tile);
     if (tileBeingRendered)
     {
         const size_t subscriberCount = tileBeingRendered->getSubscribers().size();
@@ -242,6 +394,59 @@ void TileCache::saveTileAndNotify(const TileDesc& tile, const char *data, const
     }
     else
         LOG_DBG("No subscribers for: " << cacheFileName(tile));
+
+    return true;
+}
+
+bool TileCache::notifyDelta(const TileDesc& tile, const char *data, const size_t size)
+{
+    std::shared_ptr<TileBeingRendered> tileBeingRendered = findTileBeingRendered(tile);
+    if (!tileBeingRendered)
+    {
+        LOG_DBG("No subscribers for delta: " << cacheFileName(tile));
+        return true;
+    }
+
+    const std::string response = tile.serialize("tile:");
+    auto payload = std::make_shared<Message>(response,
+                                             Message::Dir::Out,
+                                             response.size() + 1 + size);
+    payload->append("\n", 1);
+    payload->append(data, size);
+
+    // Serve those who have the base of this delta, the rest need the full tile.
+    std::vector<std::weak_ptr<ClientSession>>& subscribers = tileBeingRendered->getSubscribers();
+    const bool hadSubscribers = !subscribers.empty();
+    for (auto it = subscribers.begin(); it != subscribers.end();)
+    {
+        std::shared_ptr<ClientSession> session = it->lock();
+        if (!session)
+        {
+            it = subscribers.erase(it);
+        }
+        else if (session->canApplyDelta(tile))
+        {
+            session->enqueueSendMessage(payload);
+            it = subscribers.erase(it);
+        }
+        else
+        {
+            ++it;
+        }
+    }
+
+    if (hadSubscribers && subscribers.empty())
+    {
+        LOG_DBG("Sent delta tile message: " << response);
+        if (tileBeingRendered->getVersion() <= tile.getVersion())
+            forgetTileBeingRendered(tileBeingRendered);
+
+        return true;
+    }
+
+    LOG_DBG("Delta tile cannot be used by " << subscribers.size() <<
+            " subscribers, full tile needed: " << response);
+    return false;
 }
 
 bool TileCache::getTextStream(StreamType type, const std::string& fileName, std::string& content)
@@ -300,19 +505,61 @@ void TileCache::invalidateTiles(int part, int x, int y, int width, int height, i
 
     assertCorrectThread();
 
-    for (auto it = _cache.begin(); it != _cache.end();)
+    // All the parts of the view, or the one given.
+    const auto first = _cacheIndex.lower_bound(
+        ZoomKey(normalizedViewId, part == -1 ? INT_MIN : part, INT_MIN, INT_MIN, INT_MIN, INT_MIN));
+    const auto last = _cacheIndex.upper_bound(
+        ZoomKey(normalizedViewId, part == -1 ? INT_MAX : part, INT_MAX, INT_MAX, INT_MAX, INT_MAX));
+
+    const long long right = static_cast<long long>(x) + width;
+    const long long bottom = static_cast<long long>(y) + height;
+
+    std::vector<TileDesc> invalidated;
+    for (auto zoom = first; zoom != last; ++zoom)
     {
-        if (intersectsTile(it->first, part, x, y, width, height, normalizedViewId))
+        int zoomPart, zoomWidth, zoomHeight, tileWidth, tileHeight;
+        std::tie(std::ignore, zoomPart, zoomWidth, zoomHeight, tileWidth, tileHeight) = zoom->first;
+
+        // As intersectsTile, a tile touching the area is invalidated too.
+        const std::set<std::pair<int, int>>& positions = zoom->second;
+        const int minX = static_cast<int>(std::max<long long>(INT_MIN, static_cast<long long>(x) - tileWidth));
+        const int minY = static_cast<int>(std::max<long long>(INT_MIN, static_cast<long long>(y) - tileHeight));
+        auto it = positions.lower_bound(std::make_pair(minY, minX));
+        while (it != positions.end() && it->first <= bottom)
         {
-            LOG_TRC("Removing tile: " << it->first.serialize());
-            _cacheSize -= itemCacheSize(it->second);
-            it = _cache.erase(it);
-        }
-        else
-        {
-            ++it;
+            const int row = it->first;
+            if (it->second < minX)
+                it = positions.lower_bound(std::make_pair(row, minX));
+
+            for (; it != positions.end() && it->first == row && it->second <= right; ++it)
+            {
+                invalidated.emplace_back(normalizedViewId, zoomPart, zoomWidth, zoomHeight, it->second, row,
+                                         tileWidth, tileHeight, -1, 0, -1, false);
+            }
+
+            // Skip the columns of the row past the area.
+            if (it != positions.end() && it->first == row)
+            {
+                if (row == INT_MAX)
+                    break;
+                it = positions.lower_bound(std::make_pair(row + 1, minX));
+            }
         }
     }
+
+    for (const TileDesc& tile : invalidated)
+    {
+        const auto it = _cache.find(tile);
+        assert(it != _cache.end() && intersectsTile(it->first, part, x, y, width, height, normalizedViewId));
+        LOG_TRC("Removing tile: " << it->first.serialize());
+        eraseTile(it);
+    }
+
+    if (_store && normalizedViewId == 0)
+    {
+        _store->eraseIf([&](const TileDesc& tile)
+                        { return intersectsTile(tile, part, x, y, width, height, normalizedViewId); });
+    }
 }
 
 void TileCache::invalidateTiles(const std::string& tiles, int normalizedViewId)
@@ -530,31 +777,90 @@ TileCache::Tile TileCache::findTile(const TileDesc &desc)
     const auto it = _cache.find(desc);
     if (it != _cache.end() && it->first.getNormalizedViewId() == desc.getNormalizedViewId())
     {
-        LOG_TRC("Found cache tile: " << desc.serialize() << " of size " << it->second->size() << " bytes");
-        return it->second;
+        LOG_TRC("Found cache tile: " << desc.serialize() << " of size " << it->second._tile->size() << " bytes");
+        _recency.splice(_recency.begin(), _recency, it->second._position);
+        if (it->second._prefetched)
+        {
+            it->second._prefetched = false;
+            ++getBudget()._prefetchHits;
+        }
+        return it->second._tile;
     }
 
     return TileCache::Tile();
 }
 
-void TileCache::saveDataToCache(const TileDesc &desc, const char *data, const size_t size)
+void TileCache::saveDataToCache(const TileDesc &desc, const char *data, const size_t size,
+                                bool prefetched)
 {
     if (_dontCache)
         return;
 
     ensureCacheSize();
 
-    TileCache::Tile tile = std::make_shared<std::vector<char>>(size);
-    std::memcpy(tile->data(), data, size);
-    auto res = _cache.emplace(desc, tile);
+    TileCache::Tile tile;
+    if (size <= MaxSharedTileSize)
+    {
+        const std::string key(data, size);
+        const auto it = _sharedTiles.find(key);
+        if (it != _sharedTiles.end())
+        {
+            tile = it->second;
+        }
+        else if (_sharedTiles.size() < MaxSharedTiles)
+        {
+            tile = std::make_shared<std::vector<char>>(data, data + size);
+            _sharedTiles.emplace(key, tile);
+        }
+    }
+
+    if (!tile)
+    {
+        tile = std::make_shared<std::vector<char>>(size);
+        std::memcpy(tile->data(), data, size);
+    }
+
+    auto res = _cache.emplace(desc, CachedTile(tile, _recency.end(), prefetched));
     if (!res.second)
     {
-        _cacheSize -= itemCacheSize(res.first->second);
-        _cache[desc] = tile;
+        CachedTile& cached = res.first->second;
+        if (cached._prefetched)
+            ++getBudget()._prefetchWasted;
+
+        _cacheSize -= itemCacheSize(cached._tile);
+        cached._tile = tile;
+        cached._prefetched = prefetched;
+        _recency.splice(_recency.begin(), _recency, cached._position);
+    }
+    else
+    {
+        _recency.push_front(desc);
+        res.first->second._position = _recency.begin();
+        _cacheIndex[ZoomKey(desc.getNormalizedViewId(), desc.getPart(), desc.getWidth(), desc.getHeight(),
+                            desc.getTileWidth(), desc.getTileHeight())]
+            .emplace(desc.getTilePosY(), desc.getTilePosX());
     }
     _cacheSize += itemCacheSize(tile);
 }
 
+TileCache::CacheMap::iterator TileCache::eraseTile(CacheMap::iterator it)
+{
+    const TileDesc& desc = it->first;
+    const auto zoom = _cacheIndex.find(ZoomKey(desc.getNormalizedViewId(), desc.getPart(), desc.getWidth(),
+                                               desc.getHeight(), desc.getTileWidth(), desc.getTileHeight()));
+    assert(zoom != _cacheIndex.end());
+    zoom->second.erase(std::make_pair(desc.getTilePosY(), desc.getTilePosX()));
+    if (zoom->second.empty())
+        _cacheIndex.erase(zoom);
+
+    if (it->second._prefetched)
+        ++getBudget()._prefetchWasted;
+
+    _recency.erase(it->second._position);
+    _cacheSize -= itemCacheSize(it->second._tile);
+    return _cache.erase(it);
+}
+
 size_t TileCache::itemCacheSize(const Tile &tile)
 {
     return tile->size() + sizeof(TileDesc);
@@ -566,9 +872,15 @@ void TileCache::assertCacheSize()
     size_t recalcSize = 0;
     for (const auto& it : _cache)
     {
-        recalcSize += itemCacheSize(it.second);
+        recalcSize += itemCacheSize(it.second._tile);
     }
     assert(recalcSize == _cacheSize);
+
+    size_t indexed = 0;
+    for (const auto& it : _cacheIndex)
+        indexed += it.second.size();
+    assert(indexed == _cache.size());
+    assert(_recency.size() == _cache.size());
 #endif
 }
 
@@ -582,54 +894,18 @@ void TileCache::ensureCacheSize()
     LOG_TRC("Cleaning tile cache of size " << _cacheSize << " vs. " << _maxCacheSize <<
             " with " << _cache.size() << " entries");
 
-    struct WidSize {
-        TileWireId _wid;
-        size_t     _size;
-        WidSize(TileWireId w, size_t s) : _wid(w), _size(s) {}
-    };
-    std::vector<WidSize> wids;
-    for (const auto& it : _cache)
-        wids.emplace_back(it.first.getWireId(), itemCacheSize(it.second));
-
-    std::sort(wids.begin(), wids.end(),
-              [](const WidSize &a, const WidSize &b) { return a._wid < b._wid; });
-
-    // FIXME: should we just take a wid 25% into the list ?
-    TileWireId maxToRemove = wids.front()._wid;
-
-    // do we have (the very rare) WID wrap-around
-    if (wids.back()._wid - wids.front()._wid > 256 * 256 * 256)
-    {
-        maxToRemove = wids.back()._wid;
-    }
-    else
-    {
-        // calculate which wid to start at.
-        size_t total = 0;
-        for (const auto &it : wids)
-        {
-            total += it._size;
-            maxToRemove = it._wid;
-            if (total > _maxCacheSize / 4)
-                break;
-        }
-    }
-    LOG_TRC("cleaning up to wid " << maxToRemove << " between " <<
-            wids.front()._wid << " and " << wids.back()._wid);
-
-    for (auto it = _cache.begin(); it != _cache.end();)
+    // Evict the least recently used down to 3/4 of the limit, which may
+    // have shrunk well below the size.
+    const size_t target = _maxCacheSize / 4 * 3;
+    const size_t before = _cacheSize;
+    while (_cacheSize > target && !_recency.empty())
     {
-        if (it->first.getWireId() <= maxToRemove)
-        {
-            LOG_TRC("cleaned out tile: " << it->first.serialize());
-            _cacheSize -= itemCacheSize(it->second);
-            it = _cache.erase(it);
-        }
-        else
-        {
-            ++it;
-        }
+        const auto it = _cache.find(_recency.back());
+        assert(it != _cache.end());
+        LOG_TRC("cleaned out tile: " << it->first.serialize());
+        eraseTile(it);
     }
+    getBudget()._evicted += before - _cacheSize;
 
     LOG_TRC("Cache is now of size " << _cacheSize << " and " <<
             _cache.size() << " entries after cleaning");
@@ -643,6 +919,70 @@ void TileCache::setMaxCacheSize(size_t cacheSize)
     ensureCacheSize();
 }
 
+void TileCache::updateBudget(const std::chrono::steady_clock::time_point& now)
+{
+    const std::chrono::duration<double> elapsed = now - _lastBudgetUpdate;
+    if (elapsed < std::chrono::seconds(1))
+        return;
+
+    _lastBudgetUpdate = now;
+    _activity = _activity * std::exp2(-elapsed.count() / ActivityHalfLifeSecs) + _requests;
+    _requests = 0;
+
+    // Even an idle document keeps some.
+    const double weight = 1 + _activity;
+    size_t total;
+    double weights;
+    TileCacheBudget& budget = getBudget();
+    {
+        std::lock_guard<std::mutex> lock(budget._mutex);
+        budget._weights += weight - _budgetWeight;
+        total = budget._total;
+        weights = budget._weights;
+    }
+    _budgetWeight = weight;
+
+    const size_t share = weights > 0 ? total * (weight / weights) : total;
+    LOG_TRC("Tile cache share of " << _docURL << " is " << share << " bytes of " << total
+                                   << " by activity " << weight << " of " << weights);
+    setMaxCacheSize(std::max(MinCacheSize, share));
+
+    std::lock_guard<std::mutex> lock(budget._mutex);
+    budget._used += _cacheSize - _budgetSize;
+    _budgetSize = _cacheSize;
+}
+
+void TileCache::setTotalBudget(size_t bytes)
+{
+    TileCacheBudget& budget = getBudget();
+    std::lock_guard<std::mutex> lock(budget._mutex);
+    budget._total = bytes;
+}
+
+size_t TileCache::getTotalMemorySize()
+{
+    TileCacheBudget& budget = getBudget();
+    std::lock_guard<std::mutex> lock(budget._mutex);
+    return budget._used;
+}
+
+void TileCache::getMetrics(std::ostream& os)
+{
+    TileCacheBudget& budget = getBudget();
+    {
+        std::lock_guard<std::mutex> lock(budget._mutex);
+        os << "tile_cache_count " << budget._caches << std::endl;
+        os << "tile_cache_budget_bytes " << budget._total << std::endl;
+        os << "tile_cache_used_bytes " << budget._used << std::endl;
+    }
+    os << "tile_cache_hit_count " << budget._hits << std::endl;
+    os << "tile_cache_miss_count " << budget._misses << std::endl;
+    os << "tile_cache_evicted_bytes " << budget._evicted << std::endl;
+    os << "tile_cache_prefetched_count " << budget._prefetched << std::endl;
+    os << "tile_cache_prefetch_hit_count " << budget._prefetchHits << std::endl;
+    os << "tile_cache_prefetch_wasted_count " << budget._prefetchWasted << std::endl;
+}
+
 void TileCache::saveDataToStreamCache(StreamType type, const std::string &fileName, const char *data, const size_t size)
 {
     if (_dontCache)
@@ -674,7 +1014,7 @@ void TileCache::dumpState(std::ostream& os)
     for (const auto& it : _cache)
     {
         os << "    " << std::setw(4) << it.first.getWireId()
-           << '\t' << std::setw(6) << it.second->size() << " bytes"
+           << '\t' << std::setw(6) << it.second._tile->size() << " bytes"
            << "\t'" << it.first.serialize() << "'\n" ;
     }
 
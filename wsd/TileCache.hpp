@@ -7,53 +7,25 @@
 
 #pragma once
 
+#include <chrono>
 #include <iosfwd>
+#include <list>
+#include <map>
 #include <memory>
+#include <set>
 #include <string>
 #include <thread>
+#include <tuple>
 #include <unordered_map>
 
 #include <Rectangle.hpp>
 
 #include "TileDesc.hpp"
+#include "TileMap.hpp"
+#include "TileStore.hpp"
 
 class ClientSession;
 
-// The cache cares about only some properties.
-struct TileDescCacheCompareEq final
-{
-    inline bool operator()(const TileDesc& l, const TileDesc& r) const
-    {
-        return l.getPart() == r.getPart() &&
-               l.getWidth() == r.getWidth() &&
-               l.getHeight() == r.getHeight() &&
-               l.getTilePosX() == r.getTilePosX() &&
-               l.getTilePosY() == r.getTilePosY() &&
-               l.getTileWidth() == r.getTileWidth() &&
-               l.getTileHeight() == r.getTileHeight() &&
-               l.getNormalizedViewId() == r.getNormalizedViewId();
-    }
-};
-
-// The cache cares about only some properties.
-struct TileDescCacheHasher final
-{
-    inline size_t operator()(const TileDesc& t) const
-    {
-        size_t hash = t.getPart();
-
-        hash = (hash << 5) + hash + t.getWidth();
-        hash = (hash << 5) + hash + t.getHeight();
-        hash = (hash << 5) + hash + t.getTilePosX();
-        hash = (hash << 5) + hash + t.getTilePosY();
-        hash = (hash << 5) + hash + t.getTileWidth();
-        hash = (hash << 5) + hash + t.getTileHeight();
-        hash = (hash << 5) + hash + t.getNormalizedViewId();
-
-        return hash;
-    }
-};
-
 /// Handles the caching of tiles of one document.
 class TileCache
 {
@@ -93,7 +65,14 @@ public:
     /// Find the tile with this description
     Tile lookupTile(const TileDesc& tile);
 
-    void saveTileAndNotify(const TileDesc& tile, const char* data, size_t size);
+    /// True if the tile is cached, in memory or in the store, without
+    /// counting that as a use of it.
+    bool hasTile(const TileDesc& tile) const;
+
+    /// Saves the rendered tile and sends it to the subscribers.
+    /// Returns false if the tile is a delta that some subscribers can't apply,
+    /// in which case the full tile must be rendered for them.
+    bool saveTileAndNotify(const TileDesc& tile, const char* data, size_t size);
 
     enum StreamType {
         Font,
@@ -130,12 +109,45 @@ public:
 
     int getTileBeingRenderedVersion(const TileDesc& tileDesc);
 
+    /// The tiles being rendered ahead of being requested, that no client
+    /// waits for yet.
+    size_t countTilesBeingPrefetched(const std::chrono::steady_clock::time_point& now) const;
+
+    /// True if the tile is being rendered ahead of being requested, at the
+    /// lowest priority of the kit, and no client waits for it yet.
+    bool isTileBeingPrefetched(const TileDesc& tileDesc) const;
+
+    /// True if the tile is being rendered and some client waits for it.
+    bool hasSubscribers(const TileDesc& tileDesc) const;
+
+    /// Keep the tiles of the default view in the given store too, and look
+    /// up those missing from memory in it.
+    void setStore(std::unique_ptr<TileStore> store) { _store = std::move(store); }
+
+    /// Stop using the store, once the document is no longer the version
+    /// it keeps the tiles of.
+    void closeStore() { _store.reset(); }
+
     /// Set the high watermark for tilecache size
     void setMaxCacheSize(size_t cacheSize);
 
+    /// Take the share of the memory budget of all the tile caches due to
+    /// this one, by how actively its tiles were requested of late compared
+    /// to the others. Called periodically by the owner.
+    void updateBudget(const std::chrono::steady_clock::time_point& now);
+
     /// Get the current memory use.
     size_t getMemorySize() const { return _cacheSize; }
 
+    /// Set the memory budget shared by all the tile caches of the process.
+    static void setTotalBudget(size_t bytes);
+
+    /// The memory used by all the tile caches, as last updated.
+    static size_t getTotalMemorySize();
+
+    /// Write the metrics of all the tile caches.
+    static void getMetrics(std::ostream& os);
+
     // Debugging bits ...
     void dumpState(std::ostream& os);
     void setThreadOwner(const std::thread::id &id) { _owner = id; }
@@ -151,6 +163,27 @@ private:
     /// Lookup tile in our cache.
     TileCache::Tile findTile(const TileDesc &desc);
 
+    /// A cached tile, and its place in the recency order of this cache.
+    struct CachedTile
+    {
+        CachedTile(Tile tile, std::list<TileDesc>::iterator position, bool prefetched = false)
+            : _tile(std::move(tile))
+            , _position(position)
+            , _prefetched(prefetched)
+        {
+        }
+
+        Tile _tile;
+        std::list<TileDesc>::iterator _position;
+        /// Rendered ahead of being requested, and not looked up since.
+        bool _prefetched;
+    };
+
+    using CacheMap = TileMap<CachedTile>;
+
+    /// Removes the tile from the cache and its index, returns the next one.
+    CacheMap::iterator eraseTile(CacheMap::iterator it);
+
     /// Lookup tile in our stream cache.
     TileCache::Tile findStreamTile(StreamType type, const std::string &fileName);
 
@@ -163,7 +196,11 @@ private:
     /// Extract location from fileName, and check if it intersects with [x, y, width, height].
     static bool intersectsTile(const TileDesc &tileDesc, int part, int x, int y, int width, int height, int normalizedViewId);
 
-    void saveDataToCache(const TileDesc& desc, const char* data, size_t size);
+    void saveDataToCache(const TileDesc& desc, const char* data, size_t size,
+                         bool prefetched = false);
+
+    /// Sends a delta tile to the subscribers that can apply it.
+    bool notifyDelta(const TileDesc& tile, const char* data, size_t size);
     void saveDataToStreamCache(StreamType type, const std::string& fileName, const char* data,
                                size_t size);
 
@@ -179,17 +216,42 @@ private:
     /// Maximum (high watermark) size of the tilecache in bytes
     size_t _maxCacheSize;
 
+    /// The cached tiles, most recently used first, to evict from the back.
+    std::list<TileDesc> _recency;
+
+    /// The tiles requested since the last budget update, and the decaying
+    /// count of those before.
+    size_t _requests;
+    double _activity;
+    std::chrono::steady_clock::time_point _lastBudgetUpdate;
+
+    /// What this cache last accounted for in the shared budget.
+    double _budgetWeight;
+    size_t _budgetSize;
+
     // FIXME: should we have a tile-desc to WID map instead and a simpler lookup ?
-    std::unordered_map<TileDesc, Tile,
-                       TileDescCacheHasher,
-                       TileDescCacheCompareEq> _cache;
+    CacheMap _cache;
+
+    /// The view, part, width, height, tile width and tile height of tiles.
+    using ZoomKey = std::tuple<int, int, int, int, int, int>;
+
+    /// The positions of the tiles of _cache, as (y, x), per view, part and
+    /// zoom, for invalidations to visit only the rows and columns they hit.
+    std::map<ZoomKey, std::set<std::pair<int, int>>> _cacheIndex;
     // FIXME: TileBeingRendered contains TileDesc too ...
-    std::unordered_map<TileDesc, std::shared_ptr<TileBeingRendered>,
-                       TileDescCacheHasher,
-                       TileDescCacheCompareEq> _tilesBeingRendered;
+    TileMap<std::shared_ptr<TileBeingRendered>> _tilesBeingRendered;
+
+    /// The tiles of this version of the document kept on disk, if any.
+    std::unique_ptr<TileStore> _store;
 
     // old-style file-name to data grab-bag.
     std::map<std::string, Tile> _streamCache[static_cast<int>(StreamType::Last)];
+
+    /// Tiny tiles, in practice the solid colour ones, shared between all cache
+    /// entries with the same data instead of each having its own copy.
+    std::unordered_map<std::string, Tile> _sharedTiles;
+    static constexpr size_t MaxSharedTileSize = 128;
+    static constexpr size_t MaxSharedTiles = 256;
 };
 
 /* vim:set shiftwidth=4 softtabstop=4 expandtab: */
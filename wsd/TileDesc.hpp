@@ -8,9 +8,12 @@
 #pragma once
 
 #include <cassert>
+#include <cstdint>
+#include <cstring>
 #include <unordered_map>
 #include <sstream>
 #include <string>
+#include <vector>
 
 
 #include "Exceptions.hpp"
@@ -41,6 +44,8 @@ public:
         , _broadcast(broadcast)
         , _oldWireId(0)
         , _wireId(0)
+        , _allowDelta(false)
+        , _prefetch(false)
     {
         if (_normalizedViewId < 0 ||
             _part < 0 ||
@@ -75,6 +80,12 @@ public:
     TileWireId getOldWireId() const { return _oldWireId; }
     void setWireId(TileWireId id) { _wireId = id; }
     TileWireId getWireId() const { return _wireId; }
+    /// Whether the requester can apply a delta against oldWireId instead of a full image.
+    void setAllowDelta(bool allowDelta) { _allowDelta = allowDelta; }
+    bool getAllowDelta() const { return _allowDelta; }
+    /// Whether the tile is rendered ahead of being visible, at the lowest priority.
+    void setPrefetch(bool prefetch) { _prefetch = prefetch; }
+    bool getPrefetch() const { return _prefetch; }
 
     bool operator==(const TileDesc& other) const
     {
@@ -141,7 +152,8 @@ public:
 
     bool canCombine(const TileDesc& other) const
     {
-        if (!onSameRow(other))
+        if (!onSameRow(other) || other.getAllowDelta() != getAllowDelta()
+            || other.getPrefetch() != getPrefetch())
             return false;
 
         const int gridX = getTilePosX() / getTileWidth();
@@ -187,6 +199,16 @@ public:
             oss << " broadcast=yes";
         }
 
+        if (_allowDelta)
+        {
+            oss << " delta=1";
+        }
+
+        if (_prefetch)
+        {
+            oss << " prefetch=1";
+        }
+
         oss << suffix;
         return oss.str();
     }
@@ -210,6 +232,8 @@ public:
         pairs["ver"] = -1;
         pairs["imgsize"] = 0;
         pairs["id"] = -1;
+        pairs["delta"] = 0;
+        pairs["prefetch"] = 0;
 
         TileWireId oldWireId = 0;
         TileWireId wireId = 0;
@@ -241,6 +265,8 @@ public:
                         pairs["imgsize"], pairs["id"], broadcast);
         result.setOldWireId(oldWireId);
         result.setWireId(wireId);
+        result.setAllowDelta(pairs["delta"] != 0);
+        result.setPrefetch(pairs["prefetch"] != 0);
 
         return result;
     }
@@ -274,6 +300,8 @@ private:
     bool _broadcast;
     TileWireId _oldWireId;
     TileWireId _wireId;
+    bool _allowDelta; //< Requester can apply a delta against _oldWireId.
+    bool _prefetch; //< Not visible yet, rendered when there is nothing else to do.
 };
 
 /// One or more tile header.
@@ -367,7 +395,66 @@ private:
         }
     }
 
+    TileCombined(int normalizedViewId, int part, int width, int height, int tileWidth, int tileHeight) :
+        _normalizedViewId(normalizedViewId),
+        _part(part),
+        _width(width),
+        _height(height),
+        _tileWidth(tileWidth),
+        _tileHeight(tileHeight)
+    {
+        if (_part < 0 ||
+            _width <= 0 ||
+            _height <= 0 ||
+            _tileWidth <= 0 ||
+            _tileHeight <= 0)
+        {
+            throw BadArgumentException("Invalid tilecombine descriptor.");
+        }
+    }
+
+    /// The fixed layout of the binary header of tile responses, in the
+    /// native byte order, as the kit and WSD run on the same host.
+    struct BinaryHeader
+    {
+        uint8_t _version;
+        uint8_t _flags;
+        uint16_t _count; //< Of BinaryTile following.
+        int32_t _normalizedViewId;
+        int32_t _part;
+        int32_t _width;
+        int32_t _height;
+        int32_t _tileWidth;
+        int32_t _tileHeight;
+        uint32_t _reserved;
+        uint64_t _shmPos; //< Of the images, with BinaryInShm.
+    };
+
+    struct BinaryTile
+    {
+        int32_t _tilePosX;
+        int32_t _tilePosY;
+        int32_t _ver;
+        int32_t _imgSize;
+        TileWireId _oldWireId;
+        TileWireId _wireId;
+        int32_t _id; //< Of a preview, or -1.
+    };
+
+    static_assert(sizeof(BinaryHeader) == 40 && sizeof(BinaryTile) == 28,
+                  "The binary tile header is packed.");
+
+    static constexpr uint8_t BinaryVersion = 2;
+    static constexpr uint8_t BinaryAllowDelta = 1;
+    static constexpr uint8_t BinaryPrefetch = 2;
+    static constexpr uint8_t BinaryInShm = 4;
+    static constexpr uint8_t BinaryBroadcast = 8;
+
 public:
+    /// The first line of the binary form of tile responses.
+    static constexpr const char* BinaryPrefix = "tilebin:\n";
+    static constexpr std::size_t BinaryPrefixSize = 9;
+
     int getNormalizedViewId() const { return _normalizedViewId; }
     int getPart() const { return _part; }
     int getWidth() const { return _width; }
@@ -386,6 +473,18 @@ public:
         _normalizedViewId = nViewId;
     }
 
+    void setAllowDelta(bool allowDelta)
+    {
+        for (auto& tile : getTiles())
+            tile.setAllowDelta(allowDelta);
+    }
+
+    void setPrefetch(bool prefetch)
+    {
+        for (auto& tile : getTiles())
+            tile.setPrefetch(prefetch);
+    }
+
 
     /// Serialize this instance into a string.
     /// Optionally prepend a prefix.
@@ -454,10 +553,115 @@ public:
             comma = true;
         }
 
+        if (!tiles.empty() && tiles[0].getAllowDelta())
+            oss << " delta=1";
+
+        if (!tiles.empty() && tiles[0].getPrefetch())
+            oss << " prefetch=1";
+
         oss << suffix;
         return oss.str();
     }
 
+    /// Serialize the tiles into the binary form of the header of a tile
+    /// response from the kit: BinaryPrefix, a BinaryHeader and a BinaryTile
+    /// per tile, without any text to format and parse back. The images
+    /// follow, or with inShm are at shmPos of the tile shared memory.
+    std::string serializeBinary(const std::vector<TileDesc>& tiles,
+                                bool inShm = false, uint64_t shmPos = 0) const
+    {
+        assert(tiles.size() <= UINT16_MAX);
+
+        BinaryHeader header;
+        std::memset(&header, 0, sizeof(header));
+        header._version = BinaryVersion;
+        if (!tiles.empty() && tiles[0].getAllowDelta())
+            header._flags |= BinaryAllowDelta;
+        if (!tiles.empty() && tiles[0].getPrefetch())
+            header._flags |= BinaryPrefetch;
+        if (!tiles.empty() && tiles[0].getBroadcast())
+            header._flags |= BinaryBroadcast;
+        if (inShm)
+            header._flags |= BinaryInShm;
+        header._count = tiles.size();
+        header._normalizedViewId = _normalizedViewId;
+        header._part = _part;
+        header._width = _width;
+        header._height = _height;
+        header._tileWidth = _tileWidth;
+        header._tileHeight = _tileHeight;
+        header._shmPos = shmPos;
+
+        std::string result(BinaryPrefixSize + sizeof(BinaryHeader) + tiles.size() * sizeof(BinaryTile), '\0');
+        char* p = &result[0];
+        std::memcpy(p, BinaryPrefix, BinaryPrefixSize);
+        p += BinaryPrefixSize;
+        std::memcpy(p, &header, sizeof(header));
+        p += sizeof(header);
+
+        for (const auto& tile : tiles)
+        {
+            const BinaryTile binaryTile = { tile.getTilePosX(), tile.getTilePosY(),
+                                            tile.getVersion(), tile.getImgSize(),
+                                            tile.getOldWireId(), tile.getWireId(), tile.getId() };
+            std::memcpy(p, &binaryTile, sizeof(binaryTile));
+            p += sizeof(binaryTile);
+        }
+
+        return result;
+    }
+
+    /// Deserialize the binary form of the header of a tile response.
+    /// Sets offset to the size of the header, where the images start
+    /// unless inShm, when they are at shmPos of the tile shared memory.
+    static TileCombined parseBinary(const char* data, std::size_t size, std::size_t& offset,
+                                    bool& inShm, uint64_t& shmPos)
+    {
+        if (size < BinaryPrefixSize + sizeof(BinaryHeader) ||
+            std::memcmp(data, BinaryPrefix, BinaryPrefixSize) != 0)
+        {
+            throw BadArgumentException("Invalid binary tile header.");
+        }
+
+        BinaryHeader header;
+        std::memcpy(&header, data + BinaryPrefixSize, sizeof(header));
+        if (header._version != BinaryVersion)
+        {
+            throw BadArgumentException("Unsupported binary tile header version " +
+                                       std::to_string(header._version) + '.');
+        }
+
+        offset = BinaryPrefixSize + sizeof(BinaryHeader) + header._count * sizeof(BinaryTile);
+        if (size < offset)
+        {
+            throw BadArgumentException("Truncated binary tile header.");
+        }
+
+        TileCombined result(header._normalizedViewId, header._part, header._width, header._height,
+                            header._tileWidth, header._tileHeight);
+        result._tiles.reserve(header._count);
+
+        const char* p = data + BinaryPrefixSize + sizeof(BinaryHeader);
+        for (std::size_t i = 0; i < header._count; ++i, p += sizeof(BinaryTile))
+        {
+            BinaryTile binaryTile;
+            std::memcpy(&binaryTile, p, sizeof(binaryTile));
+            result._tiles.emplace_back(header._normalizedViewId, header._part, header._width, header._height,
+                                       binaryTile._tilePosX, binaryTile._tilePosY,
+                                       header._tileWidth, header._tileHeight,
+                                       binaryTile._ver, binaryTile._imgSize, binaryTile._id,
+                                       header._flags & BinaryBroadcast);
+            result._tiles.back().setOldWireId(binaryTile._oldWireId);
+            result._tiles.back().setWireId(binaryTile._wireId);
+        }
+
+        result.setAllowDelta(header._flags & BinaryAllowDelta);
+        result.setPrefetch(header._flags & BinaryPrefetch);
+        inShm = (header._flags & BinaryInShm);
+        shmPos = header._shmPos;
+        return result;
+    }
+
     /// Deserialize a TileDesc from a tokenized string.
     static TileCombined parse(const StringVector& tokens)
     {
@@ -513,10 +717,14 @@ public:
             }
         }
 
-        return TileCombined(pairs["nviewid"], pairs["part"], pairs["width"], pairs["height"],
+        TileCombined result(pairs["nviewid"], pairs["part"], pairs["width"], pairs["height"],
                             tilePositionsX, tilePositionsY,
                             pairs["tilewidth"], pairs["tileheight"],
                             versions, imgSizes, oldwireIds, wireIds);
+        result.setAllowDelta(pairs["delta"] != 0);
+        result.setPrefetch(pairs["prefetch"] != 0);
+
+        return result;
     }
 
     /// Deserialize a TileDesc from a string format.
@@ -545,9 +753,13 @@ public:
         }
 
         vers.seekp(-1, std::ios_base::cur); // Remove last comma.
-        return TileCombined(tiles[0].getNormalizedViewId(), tiles[0].getPart(), tiles[0].getWidth(), tiles[0].getHeight(),
+        TileCombined result(tiles[0].getNormalizedViewId(), tiles[0].getPart(), tiles[0].getWidth(), tiles[0].getHeight(),
                             xs.str(), ys.str(), tiles[0].getTileWidth(), tiles[0].getTileHeight(),
                             vers.str(), "", oldhs.str(), hs.str());
+        result.setAllowDelta(tiles[0].getAllowDelta());
+        result.setPrefetch(tiles[0].getPrefetch());
+
+        return result;
     }
 
     /// To support legacy / under-used renderTile
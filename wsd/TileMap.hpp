@@ -0,0 +1,366 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "TileDesc.hpp"
+
+/// The fields identifying a tile, packed in 128 bits: the part, the view
+/// and the size in twips of the tile, 16 bits each, and its position, 32
+/// bits each. Fields beyond 16 bits, and the size in pixels when it is part
+/// of the identity, are folded in, so equal keys are only very likely the
+/// same tile; TileMap compares the TileDesc too before it trusts them.
+struct TileKey final
+{
+    uint64_t _hi;
+    uint64_t _lo;
+
+    bool operator==(const TileKey& other) const { return _hi == other._hi && _lo == other._lo; }
+    bool operator!=(const TileKey& other) const { return !(*this == other); }
+
+    /// The tile as in TileDesc::generateID(), without its size in pixels.
+    static TileKey forId(const TileDesc& tile)
+    {
+        return pack(tile.getPart(), tile.getNormalizedViewId(), tile.getTileWidth(),
+                    tile.getTileHeight(), tile.getTilePosX(), tile.getTilePosY());
+    }
+
+    /// The tile as in TileDescCacheCompareEq, with its size in pixels.
+    static TileKey forCache(const TileDesc& tile)
+    {
+        TileKey key = forId(tile);
+        key._hi ^= mix((static_cast<uint64_t>(static_cast<uint32_t>(tile.getWidth())) << 32)
+                       | static_cast<uint32_t>(tile.getHeight()));
+        return key;
+    }
+
+    /// The tile with the given TileDesc::generateID(), as sent back by the
+    /// clients. Returns false if the ID is malformed.
+    static bool parseId(const std::string& tileID, TileKey& key)
+    {
+        int part, tilePosX, tilePosY, tileWidth, tileHeight, normalizedViewId, end = 0;
+        if (std::sscanf(tileID.c_str(), "%d:%d:%d:%d:%d:%d%n", &part, &tilePosX, &tilePosY,
+                        &tileWidth, &tileHeight, &normalizedViewId, &end) != 6
+            || static_cast<std::size_t>(end) != tileID.size())
+            return false;
+
+        key = pack(part, normalizedViewId, tileWidth, tileHeight, tilePosX, tilePosY);
+        return true;
+    }
+
+    int getTilePosX() const { return static_cast<int32_t>(_lo >> 32); }
+    int getTilePosY() const { return static_cast<int32_t>(_lo & 0xffffffff); }
+
+    static TileKey pack(int part, int normalizedViewId, int tileWidth, int tileHeight,
+                        int tilePosX, int tilePosY)
+    {
+        const auto field = [](int value) -> uint64_t
+        {
+            // Exact up to 16 bits, the rest is folded in.
+            const uint32_t v = static_cast<uint32_t>(value);
+            return (v ^ (v >> 16) * 0x9E37) & 0xffff;
+        };
+
+        TileKey key;
+        key._hi = (field(part) << 48) | (field(normalizedViewId) << 32)
+                  | (field(tileWidth) << 16) | field(tileHeight);
+        key._lo = (static_cast<uint64_t>(static_cast<uint32_t>(tilePosX)) << 32)
+                  | static_cast<uint32_t>(tilePosY);
+        return key;
+    }
+
+    /// A strong 64-bit mixer (the splitmix64 finalizer), so that tiles next
+    /// to each other spread over the whole table.
+    static uint64_t mix(uint64_t x)
+    {
+        x ^= x >> 30;
+        x *= 0xbf58476d1ce4e5b9ULL;
+        x ^= x >> 27;
+        x *= 0x94d049bb133111ebULL;
+        x ^= x >> 31;
+        return x;
+    }
+
+    uint64_t hash() const { return mix(_hi ^ mix(_lo)); }
+};
+
+// The cache cares about only some properties.
+struct TileDescCacheCompareEq final
+{
+    inline bool operator()(const TileDesc& l, const TileDesc& r) const
+    {
+        return l.getPart() == r.getPart() &&
+               l.getWidth() == r.getWidth() &&
+               l.getHeight() == r.getHeight() &&
+               l.getTilePosX() == r.getTilePosX() &&
+               l.getTilePosY() == r.getTilePosY() &&
+               l.getTileWidth() == r.getTileWidth() &&
+               l.getTileHeight() == r.getTileHeight() &&
+               l.getNormalizedViewId() == r.getNormalizedViewId();
+    }
+};
+
+/// Which fields of a TileDesc identify the tiles of a TileMap.
+struct TileCacheKeyTraits final
+{
+    static TileKey key(const TileDesc& tile) { return TileKey::forCache(tile); }
+    static bool equal(const TileDesc& l, const TileDesc& r) { return TileDescCacheCompareEq()(l, r); }
+};
+
+/// The tiles as the clients name them, regardless of their size in pixels.
+
+struct TileIdKeyTraits final
+{
+    static TileKey key(const TileDesc& tile) { return TileKey::forId(tile); }
+    static bool equal(const TileDesc& l, const TileDesc& r)
+    {
+        return l.getPart() == r.getPart() &&
+               l.getTilePosX() == r.getTilePosX() &&
+               l.getTilePosY() == r.getTilePosY() &&
+               l.getTileWidth() == r.getTileWidth() &&
+               l.getTileHeight() == r.getTileHeight() &&
+               l.getNormalizedViewId() == r.getNormalizedViewId();
+    }
+};
+
+/// A map from tiles to V, in a flat open-addressing table probed linearly
+/// by TileKey, so that lookups neither allocate nor chase pointers.
+/// The entries are pairs of the TileDesc first inserted and the value, as
+/// in std::unordered_map. Erasing leaves a tombstone, so it never moves
+/// the other entries and erasing while iterating visits each entry once.
+/// Inserting invalidates the iterators.
+template <typename V, typename Traits = TileCacheKeyTraits>
+class TileMap final
+{
+public:
+    using value_type = std::pair<const TileDesc, V>;
+
+private:
+    enum : uint8_t { Empty = 0, Erased = 1, Full = 2 };
+
+    using Storage = typename std::aligned_storage<sizeof(value_type), alignof(value_type)>::type;
+
+    template <bool Const> class Iterator
+    {
+        using Map = typename std::conditional<Const, const TileMap, TileMap>::type;
+        using Value = typename std::conditional<Const, const std::pair<const TileDesc, V>,
+                                                std::pair<const TileDesc, V>>::type;
+
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using difference_type = std::ptrdiff_t;
+        using value_type = Value;
+        using pointer = Value*;
+        using reference = Value&;
+
+        Iterator(Map* map, std::size_t index)
+            : _map(map)
+            , _index(index)
+        {
+        }
+
+        /// The const iterator from the other one.
+        template <bool C = Const, typename = typename std::enable_if<C>::type>
+        Iterator(const Iterator<false>& other)
+            : _map(other._map)
+            , _index(other._index)
+        {
+        }
+
+        reference operator*() const { return _map->entry(_index); }
+        pointer operator->() const { return &_map->entry(_index); }
+
+        Iterator& operator++()
+        {
+            _index = _map->nextFull(_index + 1);
+            return *this;
+        }
+
+        bool operator==(const Iterator& other) const { return _index == other._index; }
+        bool operator!=(const Iterator& other) const { return _index != other._index; }
+
+    private:
+        friend class TileMap;
+        template <bool> friend class Iterator;
+
+        Map* _map;
+        std::size_t _index;
+    };
+
+public:
+    using iterator = Iterator<false>;
+    using const_iterator = Iterator<true>;
+
+    TileMap()
+        : _size(0)
+        , _erased(0)
+    {
+    }
+
+    ~TileMap() { clear(); }
+
+    TileMap(const TileMap&) = delete;
+    TileMap& operator=(const TileMap&) = delete;
+
+    std::size_t size() const { return _size; }
+    bool empty() const { return _size == 0; }
+
+    iterator begin() { return iterator(this, nextFull(0)); }
+    iterator end() { return iterator(this, _states.size()); }
+    const_iterator begin() const { return const_iterator(this, nextFull(0)); }
+    const_iterator end() const { return const_iterator(this, _states.size()); }
+
+    iterator find(const TileDesc& tile) { return iterator(this, findIndex(tile)); }
+    const_iterator find(const TileDesc& tile) const { return const_iterator(this, findIndex(tile)); }
+
+    /// Inserts the value unless the tile is there already.
+    std::pair<iterator, bool> emplace(const TileDesc& tile, V value)
+    {
+        const std::size_t found = findIndex(tile);
+        if (found != _states.size())
+            return std::make_pair(iterator(this, found), false);
+
+        reserveOne();
+        const TileKey key = Traits::key(tile);
+        std::size_t index = key.hash() & (_states.size() - 1);
+        while (_states[index] == Full)
+            index = (index + 1) & (_states.size() - 1);
+
+        if (_states[index] == Erased)
+            --_erased;
+        _states[index] = Full;
+        _keys[index] = key;
+        new (&_entries[index]) value_type(tile, std::move(value));
+        ++_size;
+        return std::make_pair(iterator(this, index), true);
+    }
+
+    V& operator[](const TileDesc& tile) { return emplace(tile, V()).first->second; }
+
+    iterator erase(iterator it)
+    {
+        assert(it._index < _states.size() && _states[it._index] == Full);
+        entry(it._index).~value_type();
+        _states[it._index] = Erased;
+        --_size;
+        ++_erased;
+        return iterator(this, nextFull(it._index + 1));
+    }
+
+    std::size_t erase(const TileDesc& tile)
+    {
+        const iterator it = find(tile);
+        if (it == end())
+            return 0;
+
+        erase(it);
+        return 1;
+    }
+
+    void clear()
+    {
+        for (std::size_t i = 0; i < _states.size(); ++i)
+        {
+            if (_states[i] == Full)
+                entry(i).~value_type();
+        }
+
+        _states.clear();
+        _keys.clear();
+        _entries.reset();
+        _size = 0;
+        _erased = 0;
+    }
+
+private:
+    value_type& entry(std::size_t index) { return *reinterpret_cast<value_type*>(&_entries[index]); }
+    const value_type& entry(std::size_t index) const
+    {
+        return *reinterpret_cast<const value_type*>(&_entries[index]);
+    }
+
+    std::size_t nextFull(std::size_t index) const
+    {
+        while (index < _states.size() && _states[index] != Full)
+            ++index;
+        return index;
+    }
+
+    /// The index of the tile, or the capacity when it isn't there.
+    std::size_t findIndex(const TileDesc& tile) const
+    {
+        if (_size == 0)
+            return _states.size();
+
+        const TileKey key = Traits::key(tile);
+        const std::size_t mask = _states.size() - 1;
+        for (std::size_t index = key.hash() & mask; _states[index] != Empty; index = (index + 1) & mask)
+        {
+            if (_states[index] == Full && _keys[index] == key && Traits::equal(entry(index).first, tile))
+                return index;
+        }
+
+        return _states.size();
+    }
+
+    /// Makes room for one more entry: keeps at most half of the slots used,
+    /// and at most 7/8 of them used or erased, so that there are always
+    /// empty slots to end probing.
+    void reserveOne()
+    {
+        const std::size_t capacity = _states.size();
+        if ((_size + 1) * 2 <= capacity && (_size + _erased + 1) * 8 <= capacity * 7)
+            return;
+
+        std::size_t newCapacity = capacity ? capacity : 16;
+        while ((_size + 1) * 2 > newCapacity)
+            newCapacity *= 2;
+
+        std::vector<uint8_t> states(newCapacity, Empty);
+        std::vector<TileKey> keys(newCapacity);
+        std::unique_ptr<Storage[]> entries(new Storage[newCapacity]);
+        for (std::size_t i = 0; i < capacity; ++i)
+        {
+            if (_states[i] != Full)
+                continue;
+
+            std::size_t index = _keys[i].hash() & (newCapacity - 1);
+            while (states[index] == Full)
+                index = (index + 1) & (newCapacity - 1);
+
+            states[index] = Full;
+            keys[index] = _keys[i];
+            new (&entries[index]) value_type(std::move(entry(i)));
+            entry(i).~value_type();
+        }
+
+        _states.swap(states);
+        _keys.swap(keys);
+        _entries = std::move(entries);
+        _erased = 0;
+    }
+
+    std::vector<uint8_t> _states;
+    std::vector<TileKey> _keys;
+    std::unique_ptr<Storage[]> _entries;
+    std::size_t _size;
+    std::size_t _erased;
+};
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -0,0 +1,362 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#include <config.h>
+
+#include "TileStore.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <iomanip>
+#include <sstream>
+#include <tuple>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "Log.hpp"
+
+namespace
+{
+const char Magic[8] = { 'L', 'O', 'O', 'L', 'T', 'S', '0', '1' };
+const char Extension[] = ".tiles";
+
+/// The bytes written by the stores open in this process, of any document.
+std::atomic<std::size_t> LiveSize(0);
+
+std::size_t align(std::size_t size) { return (size + 7) & ~static_cast<std::size_t>(7); }
+
+/// FNV-1a, stable across builds, unlike std::hash.
+std::string hashToHex(const std::string& str)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (const char c : str)
+    {
+        hash ^= static_cast<unsigned char>(c);
+        hash *= 0x100000001b3ULL;
+    }
+
+    std::ostringstream oss;
+    oss << std::hex << std::setw(16) << std::setfill('0') << hash;
+    return oss.str();
+}
+
+/// True if a store has the file open, here or in another server, as it
+/// keeps it locked.
+bool isOpen(const std::string& path)
+{
+    const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+
+    const bool locked = flock(fd, LOCK_EX | LOCK_NB) != 0;
+    close(fd);
+    return locked;
+}
+
+/// Removes the file, unless a store has opened it since it was found closed.
+bool removeIfClosed(const std::string& path)
+{
+    const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+
+    const bool removed = flock(fd, LOCK_EX | LOCK_NB) == 0 && unlink(path.c_str()) == 0;
+    close(fd);
+    return removed;
+}
+}
+
+/// At the start of the file, followed by the document key and version.
+struct TileStore::Header
+{
+    char _magic[8];
+    /// Where the next record goes.
+    uint64_t _end;
+    uint32_t _identitySize;
+    uint32_t _reserved;
+};
+
+/// Before the data of each tile, at a multiple of 8 bytes.
+struct TileStore::Record
+{
+    int32_t _part;
+    int32_t _width;
+    int32_t _height;
+    int32_t _tilePosX;
+    int32_t _tilePosY;
+    int32_t _tileWidth;
+    int32_t _tileHeight;
+    uint32_t _size;
+    /// Cleared when the tile is erased. Its space is only reclaimed with the file.
+    uint32_t _live;
+    uint32_t _reserved;
+};
+
+std::unique_ptr<TileStore> TileStore::open(const std::string& dir, const std::string& docKey,
+                                           const std::string& version, std::size_t maxSize)
+{
+    // The stores open share half of the budget, those closed the rest.
+    const std::string identity = docKey + '\n' + version;
+    std::size_t capacity = maxSize / 2;
+    if (dir.empty() || capacity < align(sizeof(Header) + identity.size()) + sizeof(Record))
+        return nullptr;
+
+    if (mkdir(dir.c_str(), 0700) != 0 && errno != EEXIST)
+    {
+        LOG_SYS("Failed to create the tile store directory [" << dir << "].");
+        return nullptr;
+    }
+
+    const std::string path = dir + '/' + hashToHex(docKey) + '-' + hashToHex(identity) + Extension;
+    prune(dir, path, maxSize - capacity);
+
+    const int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0)
+    {
+        LOG_SYS("Failed to open the tile store [" << path << "].");
+        return nullptr;
+    }
+
+    struct stat st;
+    if (flock(fd, LOCK_EX | LOCK_NB) != 0 || fstat(fd, &st) != 0)
+    {
+        LOG_DBG("Tile store [" << path << "] is in use.");
+        close(fd);
+        return nullptr;
+    }
+
+    // Sparse, shrunk back to what is used when closed.
+    const std::size_t existing = st.st_size;
+    capacity = std::max(capacity, existing);
+    void* mapping = MAP_FAILED;
+    if (ftruncate(fd, capacity) == 0)
+        mapping = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    if (mapping == MAP_FAILED)
+    {
+        LOG_SYS("Failed to map the tile store [" << path << "].");
+        close(fd);
+        return nullptr;
+    }
+
+    std::unique_ptr<TileStore> store(new TileStore(path, fd, static_cast<char*>(mapping), capacity, maxSize / 2));
+    Header* header = store->_header;
+    char* stored = store->_mapping + sizeof(Header);
+    if (existing >= sizeof(Header) && std::memcmp(header->_magic, Magic, sizeof(Magic)) == 0
+        && header->_identitySize == identity.size() && existing >= sizeof(Header) + identity.size()
+        && identity.compare(0, identity.size(), stored, identity.size()) == 0 && store->load())
+    {
+        LOG_INF("Opened tile store [" << path << "] with " << store->size() << " tiles.");
+    }
+    else
+    {
+        std::memcpy(header->_magic, Magic, sizeof(Magic));
+        header->_identitySize = identity.size();
+        header->_reserved = 0;
+        std::memcpy(stored, identity.data(), identity.size());
+        header->_end = align(sizeof(Header) + identity.size());
+        LOG_INF("Started tile store [" << path << "].");
+    }
+
+    LiveSize += header->_end;
+    futimens(fd, nullptr);
+    return store;
+}
+
+TileStore::TileStore(std::string path, int fd, char* mapping, std::size_t capacity,
+                     std::size_t maxLiveSize)
+    : _path(std::move(path))
+    , _fd(fd)
+    , _mapping(mapping)
+    , _capacity(capacity)
+    , _maxLiveSize(maxLiveSize)
+    , _header(reinterpret_cast<Header*>(mapping))
+{
+}
+
+TileStore::~TileStore()
+{
+    const std::size_t end = _header->_end;
+    LiveSize -= end;
+    munmap(_mapping, _capacity);
+    if (ftruncate(_fd, end) != 0)
+        LOG_SYS("Failed to shrink the tile store [" << _path << "].");
+
+    // The last use orders the files to remove.
+    futimens(_fd, nullptr);
+    close(_fd);
+
+    LOG_INF("Closed tile store [" << _path << "] of " << end << " bytes.");
+}
+
+bool TileStore::load()
+{
+    const std::size_t start = align(sizeof(Header) + _header->_identitySize);
+    const std::size_t end = _header->_end;
+    if (end < start || end > _capacity)
+        return false;
+
+    std::size_t offset = start;
+    while (offset + sizeof(Record) <= end)
+    {
+        const Record* record = reinterpret_cast<const Record*>(_mapping + offset);
+        if (record->_size > end - offset - sizeof(Record))
+            break;
+
+        if (record->_live)
+        {
+            const TileDesc tile(0, record->_part, record->_width, record->_height,
+                                record->_tilePosX, record->_tilePosY, record->_tileWidth,
+                                record->_tileHeight, -1, 0, -1, false);
+            _tiles[tile] = offset;
+        }
+
+        offset = align(offset + sizeof(Record) + record->_size);
+    }
+
+    // Drop what was cut short.
+    _header->_end = std::min(offset, end);
+    return true;
+}
+
+TileStore::Tile TileStore::find(const TileDesc& tile) const
+{
+    if (tile.getNormalizedViewId() != 0)
+        return Tile();
+
+    const auto it = _tiles.find(tile);
+    if (it == _tiles.end())
+        return Tile();
+
+    const Record* record = reinterpret_cast<const Record*>(_mapping + it->second);
+    const char* data = reinterpret_cast<const char*>(record + 1);
+    return std::make_shared<std::vector<char>>(data, data + record->_size);
+}
+
+bool TileStore::save(const TileDesc& tile, const char* data, std::size_t size)
+{
+    if (tile.getNormalizedViewId() != 0)
+        return false;
+
+    erase(tile);
+
+    const std::size_t offset = _header->_end;
+    const std::size_t end = align(offset + sizeof(Record) + size);
+    if (end > _capacity)
+    {
+        LOG_TRC("Tile store [" << _path << "] is full.");
+        return false;
+    }
+
+    // Shared with the stores of the other documents open.
+    if (LiveSize.fetch_add(end - offset) + (end - offset) > _maxLiveSize)
+    {
+        LiveSize -= end - offset;
+        LOG_TRC("Tile stores open are full, not saving to [" << _path << "].");
+        return false;
+    }
+
+    Record* record = reinterpret_cast<Record*>(_mapping + offset);
+    record->_part = tile.getPart();
+    record->_width = tile.getWidth();
+    record->_height = tile.getHeight();
+    record->_tilePosX = tile.getTilePosX();
+    record->_tilePosY = tile.getTilePosY();
+    record->_tileWidth = tile.getTileWidth();
+    record->_tileHeight = tile.getTileHeight();
+    record->_size = size;
+    record->_live = 1;
+    record->_reserved = 0;
+    std::memcpy(record + 1, data, size);
+
+    // Only once the record is complete.
+    _header->_end = end;
+    _tiles.emplace(tile, offset);
+    return true;
+}
+
+void TileStore::erase(const TileDesc& tile)
+{
+    const auto it = _tiles.find(tile);
+    if (it != _tiles.end())
+        erase(it);
+}
+
+TileMap<uint64_t>::iterator TileStore::erase(TileMap<uint64_t>::iterator it)
+{
+    reinterpret_cast<Record*>(_mapping + it->second)->_live = 0;
+    return _tiles.erase(it);
+}
+
+void TileStore::prune(const std::string& dir, const std::string& keep, std::size_t maxSize)
+{
+    DIR* dirp = opendir(dir.c_str());
+    if (!dirp)
+        return;
+
+    // The files of the other versions of the document are of no more use.
+    const std::string docPrefix = keep.substr(0, keep.find('-', dir.size()) + 1);
+
+    std::vector<std::tuple<timespec, std::size_t, std::string>> files;
+    std::size_t total = 0;
+    while (const dirent* entry = readdir(dirp))
+    {
+        const std::string name = entry->d_name;
+        const std::string path = dir + '/' + name;
+        struct stat st;
+        if (name.size() <= sizeof(Extension) - 1
+            || name.compare(name.size() - sizeof(Extension) + 1, std::string::npos, Extension) != 0
+            || path == keep || stat(path.c_str(), &st) != 0 || isOpen(path))
+            continue;
+
+        if (path.compare(0, docPrefix.size(), docPrefix) == 0)
+        {
+            if (removeIfClosed(path))
+                LOG_INF("Removed the tile store of an older version [" << path << "].");
+            continue;
+        }
+
+        // What it takes on disk, as it is sparse while open.
+        const std::size_t size = st.st_blocks * 512;
+        files.emplace_back(st.st_mtim, size, path);
+        total += size;
+    }
+    closedir(dirp);
+
+    if (total <= maxSize)
+        return;
+
+    std::sort(files.begin(), files.end(),
+              [](const std::tuple<timespec, std::size_t, std::string>& l,
+                 const std::tuple<timespec, std::size_t, std::string>& r)
+              {
+                  return std::get<0>(l).tv_sec != std::get<0>(r).tv_sec
+                             ? std::get<0>(l).tv_sec < std::get<0>(r).tv_sec
+                             : std::get<0>(l).tv_nsec < std::get<0>(r).tv_nsec;
+              });
+
+    for (const auto& file : files)
+    {
+        if (total <= maxSize)
+            break;
+
+        if (removeIfClosed(std::get<2>(file)))
+        {
+            LOG_INF("Removed the least recently used tile store [" << std::get<2>(file) << "].");
+            total -= std::get<1>(file);
+        }
+    }
+}
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -0,0 +1,108 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "TileDesc.hpp"
+#include "TileMap.hpp"
+
+/// The tiles of one version of a document, kept on disk between the
+/// sessions of the document and across restarts, so that opening it again
+/// unchanged doesn't render them again.
+///
+/// Each version has a file in the store directory, mapped in memory, to
+/// which the tiles are appended. The files open in this process share half
+/// of the budget of the directory. The least recently used of the others
+/// are removed beyond the other half, unless another server has them open.
+/// Only the tiles of the default view are kept, as the other views are
+/// numbered per session.
+class TileStore
+{
+    struct Header;
+    struct Record;
+
+public:
+    using Tile = std::shared_ptr<std::vector<char>>;
+
+    /// Open the tiles of the given version of the document in the directory,
+    /// or start them, after removing the least recently used files closed
+    /// beyond half of maxSize bytes. Returns null if that fails, or another
+    /// server has them open.
+    static std::unique_ptr<TileStore> open(const std::string& dir, const std::string& docKey,
+                                           const std::string& version, std::size_t maxSize);
+
+    /// Shrinks the file to the tiles it holds and marks it as recently used.
+    ~TileStore();
+
+    TileStore(const TileStore&) = delete;
+    TileStore& operator=(const TileStore&) = delete;
+
+    /// A copy of the tile, if it is stored.
+    Tile find(const TileDesc& tile) const;
+
+    /// True if the tile is stored.
+    bool contains(const TileDesc& tile) const
+    {
+        return tile.getNormalizedViewId() == 0 && _tiles.find(tile) != _tiles.end();
+    }
+
+    /// Append the tile, replacing any older version of it.
+    /// Returns false if it is not of the default view, or the stores open
+    /// have used up their half of maxSize.
+    bool save(const TileDesc& tile, const char* data, std::size_t size);
+
+    /// Forget the tile, if stored.
+    void erase(const TileDesc& tile);
+
+    /// Forget the tiles for which pred returns true.
+    template <typename Pred> void eraseIf(Pred pred)
+    {
+        for (auto it = _tiles.begin(); it != _tiles.end();)
+        {
+            if (pred(it->first))
+                it = erase(it);
+            else
+                ++it;
+        }
+    }
+
+    /// The number of tiles stored.
+    std::size_t size() const { return _tiles.size(); }
+
+    const std::string& getPath() const { return _path; }
+
+private:
+    TileStore(std::string path, int fd, char* mapping, std::size_t capacity, std::size_t maxLiveSize);
+
+    TileMap<uint64_t>::iterator erase(TileMap<uint64_t>::iterator it);
+
+    /// Reads the records of an existing file into _tiles.
+    bool load();
+
+    /// Removes the least recently used files of the directory, apart from
+    /// the given one and those open, until they take at most maxSize bytes.
+    static void prune(const std::string& dir, const std::string& keep, std::size_t maxSize);
+
+    const std::string _path;
+    const int _fd;
+    char* const _mapping;
+    const std::size_t _capacity;
+    /// Of the bytes written by all the stores open in this process.
+    const std::size_t _maxLiveSize;
+    Header* const _header;
+
+    /// The offsets of the records of the tiles stored.
+    TileMap<uint64_t> _tiles;
+};
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */